@@ -0,0 +1,415 @@
+// ndppd - NDP Proxy Daemon
+// Copyright (C) 2011  Daniel Adolfsson <daniel@priv.nu>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+// Drives the solicit/session/advert pipeline through socketless
+// interfaces (see iface::open_fake()), and prints one JSON object per
+// scenario. Every solicit forwarded to the daughter interface is
+// answered right away, so the numbers measure ndppd itself rather
+// than the network.
+//
+// Usage: ndppd-bench [-q] [-r <file.pcap>]
+//
+// -q           Only run the small scenarios.
+// -r <file>    Replay the solicits in an Ethernet pcap capture through
+//              a proxy with a single ::/0 rule, instead of the
+//              synthetic scenarios.
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+#include <malloc.h>
+#include <unistd.h>
+
+#include <netinet/in.h>
+#include <netinet/ip6.h>
+#include <netinet/icmp6.h>
+#include <net/ethernet.h>
+
+#include "ndppd.h"
+#include "stats.h"
+
+using namespace ndppd;
+
+// How many solicits are fed in before the queued output is flushed,
+// which is roughly what one pass through the main loop handles.
+static const size_t BATCH = 32;
+
+static const char* requester = "2001:db8:ffff::1";
+
+// State shared with tx_hook().
+static ptr<iface> upstream, downstream;
+
+static std::vector<in6_addr> to_answer;
+
+static std::vector<int64_t> latencies;
+
+static int64_t sent_at;
+
+static size_t adverts;
+
+static void tx_hook(iface* ifa, const address& daddr, const uint8_t* msg, size_t len)
+{
+    int type = msg[0];
+
+    if ((ifa == downstream.get_pointer()) && (type == ND_NEIGHBOR_SOLICIT)) {
+        in6_addr taddr;
+        memcpy(&taddr, msg + offsetof(struct nd_neighbor_solicit, nd_ns_target), sizeof(taddr));
+        to_answer.push_back(taddr);
+    } else if ((ifa == upstream.get_pointer()) && (type == ND_NEIGHBOR_ADVERT)) {
+        latencies.push_back(stats::now() - sent_at);
+        adverts++;
+    }
+}
+
+static size_t build_solicit(uint8_t* buf, const in6_addr& saddr, const in6_addr& taddr)
+{
+    memset(buf, 0, 86);
+
+    // Ethernet, to the solicited-node multicast group.
+    buf[0] = 0x33; buf[1] = 0x33; buf[2] = 0xff;
+    memcpy(buf + 3, &taddr.s6_addr[13], 3);
+    buf[6] = 0x02; buf[11] = 0x01;
+    buf[12] = 0x86; buf[13] = 0xdd;
+
+    uint8_t* ip6 = buf + ETH_HLEN;
+    ip6[0] = 0x60;
+    ip6[5] = 32;
+    ip6[6] = IPPROTO_ICMPV6;
+    ip6[7] = 255;
+    memcpy(ip6 + 8, &saddr, 16);
+
+    static const uint8_t snm[13] = { 0xff, 0x02, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0x01, 0xff };
+    memcpy(ip6 + 24, snm, 13);
+    memcpy(ip6 + 37, &taddr.s6_addr[13], 3);
+
+    uint8_t* ns = ip6 + 40;
+    ns[0] = ND_NEIGHBOR_SOLICIT;
+    memcpy(ns + 8, &taddr, 16);
+
+    // Source link-layer address option.
+    ns[24] = ND_OPT_SOURCE_LINKADDR;
+    ns[25] = 1;
+    ns[26] = 0x02; ns[31] = 0x01;
+
+    return 86;
+}
+
+static void answer_all()
+{
+    std::vector<in6_addr> pending;
+    pending.swap(to_answer);
+
+    for (std::vector<in6_addr>::iterator it = pending.begin(); it != pending.end(); it++) {
+        downstream->handle_advert(address(*it), address(*it));
+    }
+}
+
+// Runs what the main loop would do after a batch: send what's queued,
+// let the "target" answer, and send the adverts that causes.
+static void settle()
+{
+    iface::flush_all();
+    answer_all();
+    iface::flush_all();
+}
+
+static size_t heap_used()
+{
+#if defined(__GLIBC__) && ((__GLIBC__ > 2) || ((__GLIBC__ == 2) && (__GLIBC_MINOR__ >= 33)))
+    return mallinfo2().uordblks;
+#else
+    return mallinfo().uordblks;
+#endif
+}
+
+static int64_t percentile(std::vector<int64_t>& v, double p)
+{
+    if (v.empty())
+        return 0;
+
+    size_t i = (size_t)(p * (v.size() - 1));
+    std::nth_element(v.begin(), v.begin() + i, v.end());
+    return v[i];
+}
+
+static int scenario_id;
+
+static void open_scenario()
+{
+    char name[32];
+
+    // Proxies can't be removed again, so every scenario gets fresh
+    // interfaces, and the sessions of the earlier ones are dropped.
+    proxy::drop_sessions();
+
+    snprintf(name, sizeof(name), "up%d", scenario_id);
+    upstream = iface::open_fake(name, 2 * scenario_id + 1, tx_hook);
+
+    snprintf(name, sizeof(name), "down%d", scenario_id);
+    downstream = iface::open_fake(name, 2 * scenario_id + 2, tx_hook);
+
+    scenario_id++;
+}
+
+static in6_addr target(unsigned rule, unsigned host)
+{
+    in6_addr a;
+    memset(&a, 0, sizeof(a));
+    a.s6_addr[0] = 0x20; a.s6_addr[1] = 0x01;
+    a.s6_addr[2] = 0x0d; a.s6_addr[3] = 0xb8;
+    a.s6_addr[4] = (rule >> 24) & 0xff; a.s6_addr[5] = (rule >> 16) & 0xff;
+    a.s6_addr[6] = (rule >> 8) & 0xff;  a.s6_addr[7] = rule & 0xff;
+    a.s6_addr32[3] = htonl(host + 1);
+    return a;
+}
+
+struct result {
+    size_t packets;
+
+    int64_t elapsed;
+
+    int64_t p50, p99;
+};
+
+// Feeds a solicit for each of 'targets' through the upstream interface.
+static result feed(const std::vector<in6_addr>& targets)
+{
+    in6_addr saddr = address(requester).const_addr();
+    uint8_t frame[128];
+
+    latencies.clear();
+    latencies.reserve(targets.size());
+    adverts = 0;
+
+    int64_t start = stats::now();
+
+    for (size_t i = 0; i < targets.size(); ) {
+        sent_at = stats::now();
+        stats::rx_time(sent_at);
+
+        for (size_t n = 0; (n < BATCH) && (i < targets.size()); n++, i++) {
+            size_t len = build_solicit(frame, saddr, targets[i]);
+            upstream->handle_solicit_frame(frame, len);
+        }
+
+        settle();
+    }
+
+    result r;
+    r.packets = targets.size();
+    r.elapsed = stats::now() - start;
+    r.p50     = percentile(latencies, 0.50);
+    r.p99     = percentile(latencies, 0.99);
+    return r;
+}
+
+static void print_result(const char* phase, const char* scenario, const result& r, long extra_key, const char* extra)
+{
+    double pps = r.elapsed ? (double)r.packets * 1000000 / r.elapsed : 0;
+
+    printf("{\"scenario\":\"%s\",\"phase\":\"%s\",\"packets\":%zu,\"adverts\":%zu,"
+           "\"pps\":%.0f,\"p50_us\":%lld,\"p99_us\":%lld",
+           scenario, phase, r.packets, adverts, pps, (long long)r.p50, (long long)r.p99);
+
+    if (extra)
+        printf(",\"%s\":%ld", extra, extra_key);
+
+    printf("}\n");
+    fflush(stdout);
+}
+
+static void run_synthetic(unsigned rules, unsigned sessions)
+{
+    open_scenario();
+
+    ptr<proxy> pr = proxy::create(upstream, false);
+
+    downstream->add_parent(pr);
+
+    for (unsigned i = 0; i < rules; i++)
+        pr->add_rule(address(target(i, 0), 64), downstream, false);
+
+    std::vector<in6_addr> targets;
+    targets.reserve(sessions);
+
+    for (unsigned i = 0; i < sessions; i++)
+        targets.push_back(target(i % rules, i / rules));
+
+    char name[64];
+    snprintf(name, sizeof(name), "rules=%u,sessions=%u", rules, sessions);
+
+    size_t before = heap_used();
+
+    // New targets: solicit forwarded, answered, advert sent back.
+    result r = feed(targets);
+
+    long per_session = sessions ? (long)((heap_used() - before) / sessions) : 0;
+
+    print_result("new", name, r, per_session, "bytes_per_session");
+
+    // Known targets: answered straight from the session.
+    r = feed(targets);
+    print_result("known", name, r, 0, 0);
+}
+
+static bool run_pcap(const char* path)
+{
+    FILE* f = fopen(path, "rb");
+
+    if (!f) {
+        fprintf(stderr, "Failed to open '%s'\n", path);
+        return false;
+    }
+
+    uint8_t ghdr[24];
+
+    if ((fread(ghdr, 1, sizeof(ghdr), f) != sizeof(ghdr))) {
+        fprintf(stderr, "'%s' is not a pcap file\n", path);
+        fclose(f);
+        return false;
+    }
+
+    uint32_t magic, linktype;
+    memcpy(&magic, ghdr, 4);
+    memcpy(&linktype, ghdr + 20, 4);
+
+    bool swap = false;
+
+    if ((magic == 0xd4c3b2a1) || (magic == 0x4d3cb2a1)) {
+        swap = true;
+        linktype = __builtin_bswap32(linktype);
+    } else if ((magic != 0xa1b2c3d4) && (magic != 0xa1b23c4d)) {
+        fprintf(stderr, "'%s' is not a pcap file\n", path);
+        fclose(f);
+        return false;
+    }
+
+    if (linktype != 1) {
+        fprintf(stderr, "'%s' is not an Ethernet capture\n", path);
+        fclose(f);
+        return false;
+    }
+
+    std::vector<std::vector<uint8_t> > frames;
+    uint8_t rhdr[16];
+
+    while (fread(rhdr, 1, sizeof(rhdr), f) == sizeof(rhdr)) {
+        uint32_t caplen;
+        memcpy(&caplen, rhdr + 8, 4);
+
+        if (swap)
+            caplen = __builtin_bswap32(caplen);
+
+        if (caplen > 65536)
+            break;
+
+        frames.push_back(std::vector<uint8_t>(caplen));
+
+        if (caplen && (fread(&frames.back()[0], 1, caplen, f) != caplen)) {
+            frames.pop_back();
+            break;
+        }
+    }
+
+    fclose(f);
+
+    open_scenario();
+
+    ptr<proxy> pr = proxy::create(upstream, false);
+    downstream->add_parent(pr);
+    pr->add_rule(address("::/0"), downstream, false);
+
+    latencies.clear();
+    adverts = 0;
+
+    int64_t start = stats::now();
+
+    for (size_t i = 0; i < frames.size(); ) {
+        sent_at = stats::now();
+        stats::rx_time(sent_at);
+
+        for (size_t n = 0; (n < BATCH) && (i < frames.size()); n++, i++) {
+            if (!frames[i].empty())
+                upstream->handle_solicit_frame(&frames[i][0], frames[i].size());
+        }
+
+        settle();
+    }
+
+    result r;
+    r.packets = frames.size();
+    r.elapsed = stats::now() - start;
+    r.p50     = percentile(latencies, 0.50);
+    r.p99     = percentile(latencies, 0.99);
+
+    print_result("replay", path, r, (long)stats::get(stats::SOLICITS_INVALID), "invalid");
+
+    return true;
+}
+
+int main(int argc, char* argv[])
+{
+    const char* pcap = 0;
+    bool quick = false;
+    int c;
+
+    while ((c = getopt(argc, argv, "qr:")) != -1) {
+        switch (c) {
+        case 'q':
+            quick = true;
+            break;
+
+        case 'r':
+            pcap = optarg;
+            break;
+
+        default:
+            fprintf(stderr, "Usage: %s [-q] [-r <file.pcap>]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    // Keep the numbers about packet handling, not formatting.
+    logger::verbosity(LOG_WARNING);
+
+    if (pcap) {
+        bool ok = run_pcap(pcap);
+        upstream = ptr<iface>();
+        downstream = ptr<iface>();
+        return ok ? 0 : 1;
+    }
+
+    static const unsigned sizes[] = { 10, 1000, 100000 };
+    size_t n = quick ? 2 : 3;
+
+    for (size_t r = 0; r < n; r++) {
+        for (size_t s = 0; s < n; s++)
+            run_synthetic(sizes[r], sizes[s]);
+    }
+
+    proxy::drop_sessions();
+
+    // iface::_map may be gone by the time static destructors get to
+    // these.
+    upstream = ptr<iface>();
+    downstream = ptr<iface>();
+
+    return 0;
+}
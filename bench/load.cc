@@ -0,0 +1,936 @@
+// ndppd - NDP Proxy Daemon
+// Copyright (C) 2011  Daniel Adolfsson <daniel@priv.nu>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+// Generates Neighbor Solicitation load against a running ndppd, over the
+// network rather than through socketless interfaces like ndppd-bench.
+//
+// For every 'proxy' section in the configuration file, a veth pair is
+// created with the proxy's interface name, the other end of which sits
+// in a network namespace of its own and plays the hosts soliciting for
+// targets. Every interface named by an 'iface' rule, and every 'auto'
+// rule, gets a veth pair of its own too, plus a route to the rule for
+// 'auto', and the other end of these answers the solicits ndppd sends
+// through them. The interface names in the file must not exist yet.
+//
+// Once ndppd is up, solicits for random targets in each proxy's rules
+// are sent at a fixed rate, and the time until the matching advert
+// comes back is taken. A solicit that isn't answered within the
+// timeout counts as dropped. When done, one JSON object with the
+// results is printed, and the namespaces are deleted again.
+//
+// Usage: nd-load -c <file> [-x <command>] [options]
+//
+// -c <file>     The ndppd configuration file to build the setup from.
+// -x <command>  Runs <command> through /bin/sh once the interfaces are
+//               up, and stops it again when done. Otherwise ndppd is
+//               expected to be started by hand within the -w time.
+// -w <ms>       How long to wait before sending. Default 2000.
+// -r <rate>     Solicits per second, over all proxies. Default 1000.
+// -d <seconds>  How long to send for. Default 10.
+// -t <ms>       How long the targets take to answer. Default 0.
+// -m <percent>  How many targets never answer. Default 0.
+// -H <percent>  How many solicits are for one of the hot targets
+//               rather than a random one. Default 0.
+// -n <count>    Number of hot targets per proxy. Default 100.
+// -s <percent>  How many solicits come from a random source address
+//               in the proxy's source network rather than its first
+//               address. Default 0.
+// -T <ms>       How long to wait for an advert. Default 2000.
+// -k            Leaves the namespaces in place when done.
+//
+// Proxy number N solicits from fd00:ff:N::/64, which is routed through
+// the proxy's interface. ndppd's adverts to sources picked with -s need
+// a neighbor entry each on the host, so at high rates they are limited
+// by net.ipv6.neigh.default.gc_thresh3 as much as by ndppd.
+
+#include <cstdarg>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <csignal>
+#include <string>
+#include <vector>
+#include <deque>
+#include <algorithm>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sched.h>
+#include <unistd.h>
+
+#include <sys/ioctl.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include <net/if.h>
+#include <net/ethernet.h>
+#include <netinet/in.h>
+#include <netinet/ip6.h>
+#include <netinet/icmp6.h>
+#include <netpacket/packet.h>
+
+#include "ndppd.h"
+#include "addr_map.h"
+#include "packet.h"
+#include "stats.h"
+
+using namespace ndppd;
+
+// Length of the solicits and adverts we build: Ethernet, IPv6, the ND
+// message and one link-layer address option.
+static const size_t ND_FRAME_LEN = ETH_HLEN + 40 + 24 + 8;
+
+// One end of a veth pair. 'name' is what ndppd sees, 'peer' the end in
+// the namespace 'ns' that we send and receive through.
+struct veth {
+    std::string name, ns, peer;
+
+    // PF_PACKET socket bound to 'peer'.
+    int fd;
+
+    uint8_t mac[ETH_ALEN];
+
+    // Targets answered through this pair. Empty for the client side.
+    std::vector<address> prefixes;
+
+    // The prefixes are routed through 'name', for auto rules.
+    bool route;
+
+    // We made 'ns', so it's ours to delete.
+    bool created;
+
+    veth() :
+        fd(-1), route(false), created(false)
+    {
+    }
+};
+
+// A rule of a proxy.
+struct target_rule {
+    address prefix;
+
+    // Its targets are looked for through one of our pairs, rather than
+    // answered for by ndppd right away.
+    bool daughter;
+};
+
+struct proxy_load {
+    // Index into links of the client side.
+    size_t client;
+
+    std::vector<target_rule> rules;
+
+    std::vector<in6_addr> hot;
+
+    // fd00:ff:N::/64.
+    in6_addr source;
+};
+
+// A solicit we're waiting on an advert for.
+struct sent {
+    in6_addr taddr;
+
+    int64_t time;
+
+    // Sequence number of the next solicit for the same target, or 0.
+    uint64_t next;
+
+    // Something is going to answer it.
+    bool expected;
+
+    bool answered;
+};
+
+// The oldest and newest solicits for a target that haven't had an
+// advert yet.
+struct outstanding {
+    uint64_t first, last;
+};
+
+// An advert a target owes ndppd.
+struct answer {
+    int64_t due;
+
+    size_t link;
+
+    uint8_t frame[ND_FRAME_LEN];
+};
+
+static std::vector<veth> links;
+
+static std::vector<proxy_load> proxies;
+
+// Every solicit sent, oldest first; sent_log[0] has sequence number 'base'.
+static std::deque<sent> sent_log;
+
+static uint64_t base = 1;
+
+static addr_map<outstanding> waiting;
+
+static std::deque<answer> answers;
+
+static std::vector<uint32_t> latencies;
+
+static uint64_t n_sent, n_answered, n_dropped, n_unanswerable, n_unsolicited;
+
+static int missing_pct, hot_pct, spoof_pct, delay_ms, timeout_ms = 2000;
+
+static int orig_ns = -1;
+
+static volatile sig_atomic_t stopping;
+
+static uint64_t rng_state = 0x9e3779b97f4a7c15ULL;
+
+static uint64_t rng()
+{
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return rng_state;
+}
+
+static bool roll(int pct)
+{
+    return (pct > 0) && ((int)(rng() % 100) < pct);
+}
+
+// Targets whose hash falls below -m never answer, so the same ones stay
+// silent every time they're asked about.
+static bool is_missing(const in6_addr& taddr)
+{
+    return (int)(addr_map<int>::hash(taddr) % 100) < missing_pct;
+}
+
+static void random_in(in6_addr& addr, const in6_addr& net, int prefix)
+{
+    for (int i = 0; i < 16; i += 8) {
+        uint64_t r = rng();
+        memcpy(&addr.s6_addr[i], &r, 8);
+    }
+
+    for (int i = 0; i < 16; i++) {
+        int bits = std::min(std::max(prefix - i * 8, 0), 8);
+        uint8_t mask = (uint8_t)(0xff00 >> bits);
+        addr.s6_addr[i] = (net.s6_addr[i] & mask) | (addr.s6_addr[i] & ~mask);
+    }
+}
+
+static bool run(const char* fmt, ...) __attribute__((format(printf, 1, 2)));
+
+// Runs an ip(8) or sysctl(8) command.
+static bool run(const char* fmt, ...)
+{
+    char cmd[512];
+
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(cmd, sizeof(cmd), fmt, ap);
+    va_end(ap);
+
+    if (system(cmd) != 0) {
+        fprintf(stderr, "Failed to run '%s'\n", cmd);
+        return false;
+    }
+
+    return true;
+}
+
+// Creates veth pair 'l', with an address for IPv6 on the end ndppd sees,
+// and none on the other.
+static bool create_link(veth& l)
+{
+    if (if_nametoindex(l.name.c_str())) {
+        fprintf(stderr, "Interface '%s' already exists\n", l.name.c_str());
+        return false;
+    }
+
+    if (!run("ip netns add %s", l.ns.c_str()))
+        return false;
+
+    l.created = true;
+
+    return run("ip link add %s type veth peer name %s netns %s",
+               l.name.c_str(), l.peer.c_str(), l.ns.c_str()) &&
+           run("sysctl -qw net.ipv6.conf.%s.accept_dad=0", l.name.c_str()) &&
+           run("ip netns exec %s sysctl -qw net.ipv6.conf.%s.disable_ipv6=1",
+               l.ns.c_str(), l.peer.c_str()) &&
+           run("ip link set %s up", l.name.c_str()) &&
+           run("ip -n %s link set %s up", l.ns.c_str(), l.peer.c_str());
+}
+
+static void delete_links()
+{
+    for (std::vector<veth>::iterator it = links.begin(); it != links.end(); it++) {
+        if (!it->created)
+            continue;
+
+        // Deleting the namespace would take the pair with it, but only
+        // in the background, and we might be run again right away.
+        if (if_nametoindex(it->name.c_str()))
+            run("ip link del %s", it->name.c_str());
+
+        run("ip netns del %s", it->ns.c_str());
+    }
+}
+
+// Opens a PF_PACKET socket on the far end of 'l', from inside its
+// namespace.
+static bool open_link(veth& l)
+{
+    std::string path = "/run/netns/" + l.ns;
+
+    int nsfd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+
+    if ((nsfd < 0) || (setns(nsfd, CLONE_NEWNET) < 0)) {
+        fprintf(stderr, "Failed to enter namespace '%s': %s\n", l.ns.c_str(), strerror(errno));
+
+        if (nsfd >= 0)
+            close(nsfd);
+
+        return false;
+    }
+
+    close(nsfd);
+
+    bool ok = false;
+
+    struct ifreq ifr;
+    memset(&ifr, 0, sizeof(ifr));
+    strncpy(ifr.ifr_name, l.peer.c_str(), IFNAMSIZ - 1);
+
+    struct sockaddr_ll lladdr;
+    memset(&lladdr, 0, sizeof(lladdr));
+    lladdr.sll_family   = AF_PACKET;
+    lladdr.sll_protocol = htons(ETH_P_IPV6);
+    lladdr.sll_ifindex  = if_nametoindex(l.peer.c_str());
+
+    if ((l.fd = socket(PF_PACKET, SOCK_RAW | SOCK_NONBLOCK | SOCK_CLOEXEC, htons(ETH_P_IPV6))) < 0) {
+        fprintf(stderr, "Failed to create socket: %s\n", strerror(errno));
+    } else if (bind(l.fd, (struct sockaddr* )&lladdr, sizeof(lladdr)) < 0) {
+        fprintf(stderr, "Failed to bind to '%s': %s\n", l.peer.c_str(), strerror(errno));
+    } else if (ioctl(l.fd, SIOCGIFHWADDR, &ifr) < 0) {
+        fprintf(stderr, "Failed to get the address of '%s': %s\n", l.peer.c_str(), strerror(errno));
+    } else {
+        memcpy(l.mac, ifr.ifr_hwaddr.sa_data, ETH_ALEN);
+
+        // Room for bursts of adverts coming back.
+        int size = 4 << 20;
+        setsockopt(l.fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+
+        ok = true;
+    }
+
+    if (setns(orig_ns, CLONE_NEWNET) < 0) {
+        fprintf(stderr, "Failed to leave namespace '%s': %s\n", l.ns.c_str(), strerror(errno));
+        return false;
+    }
+
+    return ok;
+}
+
+// Returns the index of the pair ndppd knows as 'name', adding it if
+// there isn't one yet.
+static size_t find_link(const std::string& name)
+{
+    for (size_t i = 0; i < links.size(); i++) {
+        if (links[i].name == name)
+            return i;
+    }
+
+    char buf[32];
+
+    veth l;
+    l.name = name;
+
+    snprintf(buf, sizeof(buf), "ndl-%zu", links.size());
+    l.ns = buf;
+
+    snprintf(buf, sizeof(buf), "ndl%zu", links.size());
+    l.peer = buf;
+
+    links.push_back(l);
+    return links.size() - 1;
+}
+
+// Works out the links from the configuration file.
+static bool plan(const ptr<conf>& cf)
+{
+    std::vector<ptr<conf> > pr_cfs(cf->find_all("proxy"));
+
+    if (pr_cfs.empty()) {
+        fprintf(stderr, "No proxies to load\n");
+        return false;
+    }
+
+    for (size_t i = 0; i < pr_cfs.size(); i++) {
+        const ptr<conf>& pr_cf = pr_cfs[i];
+
+        proxy_load pl;
+        pl.client = find_link(pr_cf->as_str());
+
+        memset(&pl.source, 0, sizeof(pl.source));
+        pl.source.s6_addr[0] = 0xfd;
+        pl.source.s6_addr[3] = 0xff;
+        pl.source.s6_addr[4] = (uint8_t)(i >> 8);
+        pl.source.s6_addr[5] = (uint8_t)i;
+
+        std::vector<ptr<conf> > ru_cfs(pr_cf->find_all("rule"));
+
+        for (size_t j = 0; j < ru_cfs.size(); j++) {
+            const ptr<conf>& ru_cf = ru_cfs[j];
+            ptr<conf> x_cf;
+
+            target_rule tr;
+
+            if (!tr.prefix.parse_string(ru_cf->as_str())) {
+                fprintf(stderr, "Invalid rule '%s'\n", ru_cf->as_str().c_str());
+                return false;
+            }
+
+            tr.daughter = true;
+
+            if (x_cf = ru_cf->find("iface")) {
+                links[find_link(x_cf->as_str())].prefixes.push_back(tr.prefix);
+            } else if (ru_cf->find("auto")) {
+                char name[IFNAMSIZ];
+                snprintf(name, sizeof(name), "ndla%zu", links.size());
+
+                veth& v = links[find_link(name)];
+                v.prefixes.push_back(tr.prefix);
+                v.route = true;
+            } else {
+                // Static rules are answered by ndppd itself.
+                tr.daughter = false;
+            }
+
+            pl.rules.push_back(tr);
+        }
+
+        if (pl.rules.empty()) {
+            fprintf(stderr, "Proxy '%s' has no rules\n", pr_cf->as_str().c_str());
+            return false;
+        }
+
+        proxies.push_back(pl);
+    }
+
+    return true;
+}
+
+static bool setup()
+{
+    for (size_t i = 0; i < links.size(); i++) {
+        if (!create_link(links[i]))
+            return false;
+    }
+
+    for (size_t i = 0; i < proxies.size(); i++) {
+        if (!run("ip -6 route add %s dev %s", address(proxies[i].source, 64).to_string().c_str(),
+                 links[proxies[i].client].name.c_str()))
+            return false;
+    }
+
+    for (size_t i = 0; i < links.size(); i++) {
+        const veth& l = links[i];
+
+        if (!l.route)
+            continue;
+
+        for (std::vector<address>::const_iterator it = l.prefixes.begin(); it != l.prefixes.end(); it++) {
+            if (!run("ip -6 route add %s dev %s", it->to_string().c_str(), l.name.c_str()))
+                return false;
+        }
+    }
+
+    for (size_t i = 0; i < links.size(); i++) {
+        if (!open_link(links[i]))
+            return false;
+    }
+
+    return true;
+}
+
+// Adds up the ICMPv6 checksum of the message the IPv6 header 'ip6'
+// carries.
+static uint16_t icmp6_checksum(const uint8_t* ip6, size_t len)
+{
+    uint32_t sum = len + IPPROTO_ICMPV6;
+
+    // The addresses, then the message itself.
+    for (size_t i = 8; i < 40; i += 2)
+        sum += (ip6[i] << 8) | ip6[i + 1];
+
+    for (size_t i = 0; i < len; i += 2)
+        sum += (ip6[40 + i] << 8) | ((i + 1 < len) ? ip6[41 + i] : 0);
+
+    while (sum >> 16)
+        sum = (sum & 0xffff) + (sum >> 16);
+
+    return (uint16_t)~sum;
+}
+
+// Builds a solicit or advert for 'taddr' from 'mac'. Adverts are
+// solicited and override.
+static void build_nd(uint8_t* buf, int type, const uint8_t* dmac, const uint8_t* smac,
+                     const in6_addr& saddr, const in6_addr& daddr, const in6_addr& taddr)
+{
+    memset(buf, 0, ND_FRAME_LEN);
+
+    memcpy(buf, dmac, ETH_ALEN);
+    memcpy(buf + ETH_ALEN, smac, ETH_ALEN);
+    buf[12] = 0x86; buf[13] = 0xdd;
+
+    uint8_t* ip6 = buf + ETH_HLEN;
+    ip6[0] = 0x60;
+    ip6[5] = 32;
+    ip6[6] = IPPROTO_ICMPV6;
+    ip6[7] = 255;
+    memcpy(ip6 + 8, &saddr, 16);
+    memcpy(ip6 + 24, &daddr, 16);
+
+    uint8_t* nd = ip6 + 40;
+    nd[0] = type;
+
+    if (type == ND_NEIGHBOR_ADVERT)
+        nd[4] = 0x60;
+
+    memcpy(nd + 8, &taddr, 16);
+
+    nd[24] = (type == ND_NEIGHBOR_ADVERT) ? ND_OPT_TARGET_LINKADDR : ND_OPT_SOURCE_LINKADDR;
+    nd[25] = 1;
+    memcpy(nd + 26, smac, ETH_ALEN);
+
+    uint16_t sum = icmp6_checksum(ip6, 32);
+    nd[2] = sum >> 8;
+    nd[3] = sum & 0xff;
+}
+
+static void send_frame(const veth& l, const uint8_t* frame)
+{
+    if (send(l.fd, frame, ND_FRAME_LEN, 0) < 0 && (errno != EAGAIN) && (errno != ENOBUFS))
+        fprintf(stderr, "Failed to send through '%s': %s\n", l.peer.c_str(), strerror(errno));
+}
+
+// Sends a solicit through the client side of 'pl'.
+static void send_solicit(proxy_load& pl, int64_t now)
+{
+    in6_addr taddr, saddr = pl.source;
+
+    const target_rule& tr = pl.rules[rng() % pl.rules.size()];
+
+    if (!pl.hot.empty() && roll(hot_pct))
+        taddr = pl.hot[rng() % pl.hot.size()];
+    else
+        random_in(taddr, tr.prefix.const_addr(), tr.prefix.prefix());
+
+    if (roll(spoof_pct))
+        random_in(saddr, pl.source, 64);
+    else
+        saddr.s6_addr[15] = 1;
+
+    // To the target's solicited-node multicast group.
+    in6_addr daddr;
+    memset(&daddr, 0, sizeof(daddr));
+    daddr.s6_addr[0]  = 0xff;
+    daddr.s6_addr[1]  = 0x02;
+    daddr.s6_addr[11] = 0x01;
+    daddr.s6_addr[12] = 0xff;
+    memcpy(&daddr.s6_addr[13], &taddr.s6_addr[13], 3);
+
+    uint8_t dmac[ETH_ALEN] = { 0x33, 0x33, 0xff };
+    memcpy(dmac + 3, &taddr.s6_addr[13], 3);
+
+    const veth& l = links[pl.client];
+
+    uint8_t frame[ND_FRAME_LEN];
+    build_nd(frame, ND_NEIGHBOR_SOLICIT, dmac, l.mac, saddr, daddr, taddr);
+    send_frame(l, frame);
+
+    // Hot targets may come from any rule. Go by the rule ndppd will
+    // pick for them.
+    bool daughter = false;
+    int best = -1;
+
+    for (std::vector<target_rule>::const_iterator it = pl.rules.begin(); it != pl.rules.end(); it++) {
+        if ((it->prefix.prefix() > best) && (address::common_prefix(it->prefix.const_addr(), taddr) >= it->prefix.prefix())) {
+            best     = it->prefix.prefix();
+            daughter = it->daughter;
+        }
+    }
+
+    sent s;
+    s.taddr    = taddr;
+    s.time     = now;
+    s.next     = 0;
+    s.expected = !daughter || !is_missing(taddr);
+    s.answered = false;
+
+    uint64_t seq = base + sent_log.size();
+    sent_log.push_back(s);
+
+    outstanding* o = waiting.find(taddr);
+
+    if (o) {
+        sent_log[o->last - base].next = seq;
+        o->last = seq;
+    } else {
+        o = &waiting.insert(taddr);
+        o->first = o->last = seq;
+    }
+
+    n_sent++;
+}
+
+// Moves 'o' on from the oldest solicit for 'taddr'.
+static void advance(const in6_addr& taddr, outstanding* o)
+{
+    uint64_t next = sent_log[o->first - base].next;
+
+    if (next)
+        o->first = next;
+    else
+        waiting.erase(taddr);
+}
+
+static void handle_advert(const in6_addr& taddr, int64_t now)
+{
+    outstanding* o = waiting.find(taddr);
+
+    if (!o) {
+        n_unsolicited++;
+        return;
+    }
+
+    sent& s = sent_log[o->first - base];
+    s.answered = true;
+
+    latencies.push_back((uint32_t)(now - s.time));
+    n_answered++;
+
+    advance(taddr, o);
+}
+
+// Gives up on solicits older than the timeout, or on all of them.
+static void expire(int64_t now, bool all)
+{
+    while (!sent_log.empty() && (all || (now - sent_log.front().time > (int64_t)timeout_ms * 1000))) {
+        sent& s = sent_log.front();
+
+        if (!s.answered) {
+            if (s.expected)
+                n_dropped++;
+            else
+                n_unanswerable++;
+
+            advance(s.taddr, waiting.find(s.taddr));
+        }
+
+        sent_log.pop_front();
+        base++;
+    }
+}
+
+// Handles what came in on 'l': adverts on the client side, solicits
+// everywhere.
+static void receive(size_t idx, int64_t now)
+{
+    veth& l = links[idx];
+
+    uint8_t buf[2048];
+
+    struct sockaddr_ll from;
+    socklen_t fromlen = sizeof(from);
+
+    ssize_t len;
+
+    while ((len = recvfrom(l.fd, buf, sizeof(buf), 0, (struct sockaddr* )&from, &fromlen)) > 0) {
+        fromlen = sizeof(from);
+
+        // We see what we send ourselves as well.
+        if (from.sll_pkttype == PACKET_OUTGOING)
+            continue;
+
+        packet p;
+
+        if (!p.parse_frame(buf, len))
+            continue;
+
+        if (p.type() == ND_NEIGHBOR_ADVERT) {
+            if (l.prefixes.empty())
+                handle_advert(p.taddr(), now);
+            continue;
+        }
+
+        bool covered = false;
+
+        if (l.prefixes.empty()) {
+            // The kernel looking for one of our sources, so ndppd's
+            // advert can get to it.
+            for (size_t i = 0; i < proxies.size(); i++) {
+                if ((proxies[i].client == idx) && (address::common_prefix(proxies[i].source, p.taddr()) >= 64))
+                    covered = true;
+            }
+        } else if (!is_missing(p.taddr())) {
+            for (std::vector<address>::const_iterator it = l.prefixes.begin(); it != l.prefixes.end(); it++) {
+                if (address::common_prefix(it->const_addr(), p.taddr()) >= it->prefix())
+                    covered = true;
+            }
+        }
+
+        if (!covered)
+            continue;
+
+        answer a;
+        a.due  = now + (l.prefixes.empty() ? 0 : (int64_t)delay_ms * 1000);
+        a.link = idx;
+
+        // Straight back to whoever asked.
+        build_nd(a.frame, ND_NEIGHBOR_ADVERT, buf + ETH_ALEN, l.mac, p.taddr(), p.saddr(), p.taddr());
+
+        if (a.due <= now)
+            send_frame(l, a.frame);
+        else
+            answers.push_back(a);
+    }
+}
+
+static void send_answers(int64_t now)
+{
+    while (!answers.empty() && (answers.front().due <= now)) {
+        send_frame(links[answers.front().link], answers.front().frame);
+        answers.pop_front();
+    }
+}
+
+static uint32_t percentile(const std::vector<uint32_t>& v, double p)
+{
+    if (v.empty())
+        return 0;
+
+    return v[std::min(v.size() - 1, (size_t)(p * v.size()))];
+}
+
+static void print_result(int rate, int64_t elapsed)
+{
+    std::sort(latencies.begin(), latencies.end());
+
+    uint64_t expected = n_answered + n_dropped;
+
+    printf("{\"rate\":%d,\"sent\":%llu,\"pps\":%.0f,\"answered\":%llu,\"dropped\":%llu,"
+           "\"drop_pct\":%.3f,\"unanswerable\":%llu,\"unsolicited\":%llu,"
+           "\"p50_us\":%u,\"p90_us\":%u,\"p99_us\":%u,\"p999_us\":%u,\"max_us\":%u}\n",
+           rate, (unsigned long long)n_sent, elapsed ? (double)n_sent * 1000000 / elapsed : 0,
+           (unsigned long long)n_answered, (unsigned long long)n_dropped,
+           expected ? (double)n_dropped * 100 / expected : 0,
+           (unsigned long long)n_unanswerable, (unsigned long long)n_unsolicited,
+           percentile(latencies, 0.50), percentile(latencies, 0.90), percentile(latencies, 0.99),
+           percentile(latencies, 0.999), latencies.empty() ? 0 : latencies.back());
+    fflush(stdout);
+}
+
+static void stop(int sig)
+{
+    stopping = 1;
+}
+
+// Returns false if the child started with -x has gone away.
+static bool child_alive(pid_t child)
+{
+    int status;
+
+    if ((child <= 0) || (waitpid(child, &status, WNOHANG) != child))
+        return true;
+
+    fprintf(stderr, "The command given with -x exited\n");
+    return false;
+}
+
+static bool load(pid_t child, int rate, int seconds)
+{
+    std::vector<struct pollfd> pfds(links.size());
+
+    for (size_t i = 0; i < links.size(); i++) {
+        pfds[i].fd     = links[i].fd;
+        pfds[i].events = POLLIN;
+    }
+
+    int64_t start = stats::now(), end = start + (int64_t)seconds * 1000000;
+    int64_t drain = end + (int64_t)timeout_ms * 1000;
+
+    uint64_t total = (uint64_t)rate * seconds;
+
+    size_t next_proxy = 0;
+
+    int64_t now = start;
+
+    while (!stopping && ((now = stats::now()) < drain)) {
+        // Keep up with the rate, even if that means a burst after we
+        // were held up.
+        uint64_t due = std::min(total, (uint64_t)((now - start) * rate / 1000000));
+
+        while (n_sent < due) {
+            send_solicit(proxies[next_proxy], now);
+            next_proxy = (next_proxy + 1) % proxies.size();
+        }
+
+        send_answers(now);
+        expire(now, false);
+
+        int64_t wake = drain;
+
+        if (n_sent < total)
+            wake = std::min(wake, start + (int64_t)((n_sent + 1) * 1000000 / rate));
+
+        if (!answers.empty())
+            wake = std::min(wake, answers.front().due);
+
+        int timeout = (wake > now) ? (int)((wake - now) / 1000) : 0;
+
+        if (poll(&pfds[0], pfds.size(), timeout) < 0) {
+            if (errno == EINTR)
+                continue;
+
+            fprintf(stderr, "Failed to poll: %s\n", strerror(errno));
+            return false;
+        }
+
+        now = stats::now();
+
+        for (size_t i = 0; i < pfds.size(); i++) {
+            if (pfds[i].revents & POLLIN)
+                receive(i, now);
+        }
+
+        if (!child_alive(child))
+            return false;
+
+        // Nothing left to wait for.
+        if ((n_sent == total) && sent_log.empty() && answers.empty())
+            break;
+    }
+
+    expire(stats::now(), true);
+
+    print_result(rate, std::min(now, end) - start);
+    return true;
+}
+
+int main(int argc, char* argv[])
+{
+    const char* path = 0;
+    const char* cmd = 0;
+    int rate = 1000, seconds = 10, wait_ms = 2000, hot_count = 100;
+    bool keep = false;
+    int c;
+
+    while ((c = getopt(argc, argv, "c:x:w:r:d:t:m:H:n:s:T:k")) != -1) {
+        switch (c) {
+        case 'c': path = optarg; break;
+        case 'x': cmd = optarg; break;
+        case 'w': wait_ms = atoi(optarg); break;
+        case 'r': rate = atoi(optarg); break;
+        case 'd': seconds = atoi(optarg); break;
+        case 't': delay_ms = atoi(optarg); break;
+        case 'm': missing_pct = atoi(optarg); break;
+        case 'H': hot_pct = atoi(optarg); break;
+        case 'n': hot_count = atoi(optarg); break;
+        case 's': spoof_pct = atoi(optarg); break;
+        case 'T': timeout_ms = atoi(optarg); break;
+        case 'k': keep = true; break;
+
+        default:
+            path = 0;
+            optind = argc;
+            break;
+        }
+    }
+
+    if (!path || (rate <= 0) || (seconds <= 0)) {
+        fprintf(stderr, "Usage: %s -c <file> [-x <command>] [-w <ms>] [-r <rate>] [-d <seconds>]\n"
+                        "       [-t <ms>] [-m <percent>] [-H <percent>] [-n <count>] [-s <percent>]\n"
+                        "       [-T <ms>] [-k]\n", argv[0]);
+        return 1;
+    }
+
+    logger::verbosity(LOG_WARNING);
+
+    ptr<conf> cf = conf::load(path);
+
+    if (cf.is_null() || !plan(cf))
+        return 1;
+
+    rng_state ^= (uint64_t)stats::now() ^ ((uint64_t)getpid() << 32);
+
+    for (std::vector<proxy_load>::iterator it = proxies.begin(); it != proxies.end(); it++) {
+        for (int i = 0; i < hot_count; i++) {
+            const target_rule& tr = it->rules[rng() % it->rules.size()];
+
+            in6_addr taddr;
+            random_in(taddr, tr.prefix.const_addr(), tr.prefix.prefix());
+            it->hot.push_back(taddr);
+        }
+    }
+
+    if ((orig_ns = open("/proc/self/ns/net", O_RDONLY | O_CLOEXEC)) < 0) {
+        fprintf(stderr, "Failed to open our namespace: %s\n", strerror(errno));
+        return 1;
+    }
+
+    signal(SIGINT, stop);
+    signal(SIGTERM, stop);
+
+    bool ok = setup();
+
+    pid_t child = 0;
+
+    if (ok && cmd) {
+        // Whatever the shell starts is handed to us when it exits, so
+        // we can wait for all of it before pulling the interfaces.
+        prctl(PR_SET_CHILD_SUBREAPER, 1);
+
+        if ((child = fork()) == 0) {
+            // In a group of its own, so the shell and whatever it
+            // started can be stopped together.
+            setpgid(0, 0);
+            execl("/bin/sh", "sh", "-c", cmd, (char* )0);
+            _exit(127);
+        }
+
+        if (child < 0) {
+            fprintf(stderr, "Failed to fork: %s\n", strerror(errno));
+            ok = false;
+        }
+    }
+
+    if (ok) {
+        usleep(wait_ms * 1000);
+        ok = !stopping && child_alive(child) && load(child, rate, seconds);
+    }
+
+    if (child > 0) {
+        kill(-child, SIGTERM);
+
+        while ((waitpid(-child, 0, 0) > 0) || (errno == EINTR))
+            ;
+    }
+
+    if (!keep)
+        delete_links();
+
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,156 @@
+// ndppd - NDP Proxy Daemon
+// Copyright (C) 2011  Daniel Adolfsson <daniel@priv.nu>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+#pragma once
+
+#include <cstddef>
+#include <cstring>
+#include <stdint.h>
+
+#include <netinet/in.h>
+
+#include "ndppd.h"
+#include "addr_map.h"
+
+NDPPD_NS_BEGIN
+
+// A fixed-size table of values keyed on IPv6 addresses, for state we
+// want to keep about an unbounded set of addresses without letting it
+// grow without bounds. Each key may live in one of WAYS neighbouring
+// slots; when they're all taken, the one that was used the longest ago
+// is handed over to the new key.
+
+template <typename T>
+class addr_cache {
+public:
+    static const size_t WAYS = 4;
+
+    addr_cache() :
+        _slots(0), _mask(0)
+    {
+    }
+
+    ~addr_cache()
+    {
+        delete[] _slots;
+    }
+
+    // Drops every entry and resizes the table to 'slots' entries, which
+    // must be a power of two. A size of 0 frees the table.
+    void reset(size_t slots)
+    {
+        delete[] _slots;
+        _slots = slots ? new slot[slots] : 0;
+        _mask  = slots ? slots - 1 : 0;
+    }
+
+    bool enabled() const
+    {
+        return _slots != 0;
+    }
+
+    // Returns the value stored for 'key', or NULL.
+    T* find(const in6_addr& key, int64_t now)
+    {
+        slot* sl = lookup(key);
+
+        if (!sl)
+            return 0;
+
+        sl->used = now;
+        return &sl->value;
+    }
+
+    // Returns the value stored for 'key', or a default-constructed one
+    // that replaced the least recently used entry of its set.
+    T& insert(const in6_addr& key, int64_t now)
+    {
+        size_t first = addr_map<T>::hash(key) & _mask;
+
+        slot* sl = 0;
+
+        for (size_t i = 0; i < WAYS; i++) {
+            slot* cand = &_slots[(first + i) & _mask];
+
+            if ((cand->used >= 0) && !memcmp(&cand->key, &key, sizeof(key))) {
+                sl = cand;
+                break;
+            }
+
+            if (!sl || (cand->used < sl->used))
+                sl = cand;
+        }
+
+        if ((sl->used < 0) || memcmp(&sl->key, &key, sizeof(key))) {
+            sl->key   = key;
+            sl->value = T();
+        }
+
+        sl->used = now;
+        return sl->value;
+    }
+
+    void erase(const in6_addr& key)
+    {
+        slot* sl = lookup(key);
+
+        if (sl) {
+            sl->used  = -1;
+            sl->value = T();
+        }
+    }
+
+private:
+    struct slot {
+        in6_addr key;
+
+        // When the entry was last used, or -1 if the slot is free.
+        int64_t used;
+
+        T value;
+
+        slot() :
+            used(-1)
+        {
+        }
+    };
+
+    slot* _slots;
+
+    size_t _mask;
+
+    slot* lookup(const in6_addr& key) const
+    {
+        if (!_slots)
+            return 0;
+
+        size_t first = addr_map<T>::hash(key) & _mask;
+
+        for (size_t i = 0; i < WAYS; i++) {
+            slot* sl = &_slots[(first + i) & _mask];
+
+            if ((sl->used >= 0) && !memcmp(&sl->key, &key, sizeof(key)))
+                return sl;
+        }
+
+        return 0;
+    }
+
+    addr_cache(const addr_cache&);
+
+    addr_cache& operator=(const addr_cache&);
+};
+
+NDPPD_NS_END
@@ -0,0 +1,233 @@
+// ndppd - NDP Proxy Daemon
+// Copyright (C) 2011  Daniel Adolfsson <daniel@priv.nu>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+#pragma once
+
+#include <cstddef>
+#include <algorithm>
+#include <stdint.h>
+
+#include <netinet/in.h>
+
+#include "ndppd.h"
+
+NDPPD_NS_BEGIN
+
+// An open-addressing hash table keyed on full 128-bit IPv6 addresses.
+// Collisions are resolved with linear probing, and erase() shifts the
+// following entries back into place so there are no tombstones to slow
+// down later lookups. The table grows when it's 3/4 full and shrinks
+// again once it drops below 1/8, so a burst of entries doesn't pin
+// memory forever.
+//
+// Any insert() or erase() may move entries around; pointers returned
+// by find() and insert() are only valid until the next modification.
+
+template <typename T>
+class addr_map {
+public:
+    typedef void (*visitor)(const in6_addr& key, T& value, void* data);
+
+    addr_map() :
+        _slots(0), _mask(0), _size(0)
+    {
+    }
+
+    ~addr_map()
+    {
+        delete[] _slots;
+    }
+
+    static uint32_t hash(const in6_addr& a)
+    {
+        uint64_t lo = ((uint64_t)a.s6_addr32[1] << 32) | a.s6_addr32[0];
+        uint64_t hi = ((uint64_t)a.s6_addr32[3] << 32) | a.s6_addr32[2];
+
+        uint64_t h = (lo * 0x9e3779b97f4a7c15ULL) ^ hi;
+        h ^= h >> 32;
+        h *= 0xd6e8feb86659fd93ULL;
+        h ^= h >> 32;
+
+        return (uint32_t)h;
+    }
+
+    // Returns the value stored for 'key', or NULL.
+    T* find(const in6_addr& key) const
+    {
+        if (!_size)
+            return 0;
+
+        for (size_t i = hash(key) & _mask; _slots[i].used; i = (i + 1) & _mask) {
+            if (same(_slots[i].key, key))
+                return &_slots[i].value;
+        }
+
+        return 0;
+    }
+
+    // Returns the value stored for 'key', creating an empty one if there
+    // was none.
+    T& insert(const in6_addr& key)
+    {
+        if ((_size + 1) * 4 > capacity() * 3)
+            rehash(capacity() ? capacity() * 2 : 16);
+
+        size_t i = hash(key) & _mask;
+
+        for (; _slots[i].used; i = (i + 1) & _mask) {
+            if (same(_slots[i].key, key))
+                return _slots[i].value;
+        }
+
+        _slots[i].used = true;
+        _slots[i].key  = key;
+        _size++;
+
+        return _slots[i].value;
+    }
+
+    // Removes 'key' from the table. Returns false if it wasn't there.
+    bool erase(const in6_addr& key)
+    {
+        if (!_size)
+            return false;
+
+        size_t i = hash(key) & _mask;
+
+        for (; ; i = (i + 1) & _mask) {
+            if (!_slots[i].used)
+                return false;
+
+            if (same(_slots[i].key, key))
+                break;
+        }
+
+        // Hold on to the value until the table is consistent again, in
+        // case destroying it ends up back here.
+        T old = T();
+        std::swap(old, _slots[i].value);
+
+        // Shift any entry that probed past the hole back into it.
+        for (size_t j = (i + 1) & _mask; _slots[j].used; j = (j + 1) & _mask) {
+            size_t home = hash(_slots[j].key) & _mask;
+
+            if (((j - home) & _mask) >= ((j - i) & _mask)) {
+                _slots[i].key   = _slots[j].key;
+                _slots[i].value = _slots[j].value;
+                i = j;
+            }
+        }
+
+        _slots[i].used  = false;
+        _slots[i].value = T();
+        _size--;
+
+        if ((capacity() > 16) && (_size * 8 < capacity()))
+            rehash(capacity() / 2);
+
+        return true;
+    }
+
+    // Calls 'fn' for every entry. 'fn' must not modify the table.
+    void walk(visitor fn, void* data)
+    {
+        for (size_t i = 0; i < capacity(); i++) {
+            if (_slots[i].used)
+                fn(_slots[i].key, _slots[i].value, data);
+        }
+    }
+
+    void clear()
+    {
+        delete[] _slots;
+        _slots = 0;
+        _mask  = 0;
+        _size  = 0;
+    }
+
+    size_t size() const
+    {
+        return _size;
+    }
+
+    bool empty() const
+    {
+        return !_size;
+    }
+
+private:
+    struct slot {
+        in6_addr key;
+
+        bool used;
+
+        T value;
+
+        slot() :
+            used(false), value()
+        {
+        }
+    };
+
+    slot* _slots;
+
+    size_t _mask;
+
+    size_t _size;
+
+    size_t capacity() const
+    {
+        return _slots ? _mask + 1 : 0;
+    }
+
+    static bool same(const in6_addr& a, const in6_addr& b)
+    {
+        return !((a.s6_addr32[0] ^ b.s6_addr32[0]) |
+                 (a.s6_addr32[1] ^ b.s6_addr32[1]) |
+                 (a.s6_addr32[2] ^ b.s6_addr32[2]) |
+                 (a.s6_addr32[3] ^ b.s6_addr32[3]));
+    }
+
+    void rehash(size_t cap)
+    {
+        slot* old     = _slots;
+        size_t old_sz = capacity();
+
+        _slots = new slot[cap];
+        _mask  = cap - 1;
+
+        for (size_t n = 0; n < old_sz; n++) {
+            if (!old[n].used)
+                continue;
+
+            size_t i = hash(old[n].key) & _mask;
+
+            while (_slots[i].used)
+                i = (i + 1) & _mask;
+
+            _slots[i].used  = true;
+            _slots[i].key   = old[n].key;
+            _slots[i].value = old[n].value;
+        }
+
+        delete[] old;
+    }
+
+    addr_map(const addr_map&);
+
+    addr_map& operator=(const addr_map&);
+};
+
+NDPPD_NS_END
@@ -15,9 +15,9 @@
 // along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include <string>
 #include <vector>
-#include <fstream>
 #include <list>
 #include <map>
+#include <algorithm>
 
 #include <cstring>
 #include <cstdio>
@@ -30,44 +30,35 @@
 #include "ndppd.h"
 #include "address.h"
 #include "route.h"
+#include "stats.h"
+#include "procfs.h"
 
 NDPPD_NS_BEGIN
 
-std::list<ptr<route> > address::_addresses;
+addr_map<address::owner_vector> address::_locals;
 
 int address::_ttl;
 
-int address::_c_ttl;
+static void update_expired(void* data)
+{
+    address::update();
+}
+
+timer address::_timer(&update_expired);
 
 address::address()
 {
     reset();
 }
 
-address::address(const address& addr)
+address::address(const address& addr) :
+    _addr(addr._addr), _prefix(addr._prefix)
 {
-    _addr.s6_addr32[0] = addr._addr.s6_addr32[0];
-    _addr.s6_addr32[1] = addr._addr.s6_addr32[1];
-    _addr.s6_addr32[2] = addr._addr.s6_addr32[2];
-    _addr.s6_addr32[3] = addr._addr.s6_addr32[3];
-
-    _mask.s6_addr32[0] = addr._mask.s6_addr32[0];
-    _mask.s6_addr32[1] = addr._mask.s6_addr32[1];
-    _mask.s6_addr32[2] = addr._mask.s6_addr32[2];
-    _mask.s6_addr32[3] = addr._mask.s6_addr32[3];
 }
 
-address::address(const ptr<address>& addr)
+address::address(const ptr<address>& addr) :
+    _addr(addr->_addr), _prefix(addr->_prefix)
 {
-    _addr.s6_addr32[0] = addr->_addr.s6_addr32[0];
-    _addr.s6_addr32[1] = addr->_addr.s6_addr32[1];
-    _addr.s6_addr32[2] = addr->_addr.s6_addr32[2];
-    _addr.s6_addr32[3] = addr->_addr.s6_addr32[3];
-
-    _mask.s6_addr32[0] = addr->_mask.s6_addr32[0];
-    _mask.s6_addr32[1] = addr->_mask.s6_addr32[1];
-    _mask.s6_addr32[2] = addr->_mask.s6_addr32[2];
-    _mask.s6_addr32[3] = addr->_mask.s6_addr32[3];
 }
 
 address::address(const std::string& str)
@@ -80,134 +71,38 @@ address::address(const char* str)
     parse_string(str);
 }
 
-address::address(const in6_addr& addr)
-{
-    _addr.s6_addr32[0] = addr.s6_addr32[0];
-    _addr.s6_addr32[1] = addr.s6_addr32[1];
-    _addr.s6_addr32[2] = addr.s6_addr32[2];
-    _addr.s6_addr32[3] = addr.s6_addr32[3];
-
-    _mask.s6_addr32[0] = 0xffffffff;
-    _mask.s6_addr32[1] = 0xffffffff;
-    _mask.s6_addr32[2] = 0xffffffff;
-    _mask.s6_addr32[3] = 0xffffffff;
-}
-
-address::address(const in6_addr& addr, const in6_addr& mask)
+address::address(const in6_addr& addr) :
+    _addr(addr), _prefix(128)
 {
-    _addr.s6_addr32[0] = addr.s6_addr32[0];
-    _addr.s6_addr32[1] = addr.s6_addr32[1];
-    _addr.s6_addr32[2] = addr.s6_addr32[2];
-    _addr.s6_addr32[3] = addr.s6_addr32[3];
-
-    _mask.s6_addr32[0] = mask.s6_addr32[0];
-    _mask.s6_addr32[1] = mask.s6_addr32[1];
-    _mask.s6_addr32[2] = mask.s6_addr32[2];
-    _mask.s6_addr32[3] = mask.s6_addr32[3];
 }
 
-address::address(const in6_addr& addr, int pf)
+address::address(const in6_addr& addr, int pf) :
+    _addr(addr)
 {
-    _addr.s6_addr32[0] = addr.s6_addr32[0];
-    _addr.s6_addr32[1] = addr.s6_addr32[1];
-    _addr.s6_addr32[2] = addr.s6_addr32[2];
-    _addr.s6_addr32[3] = addr.s6_addr32[3];
-
     prefix(pf);
 }
 
-bool address::operator==(const address& addr) const
-{
-    return !(((_addr.s6_addr32[0] ^ addr._addr.s6_addr32[0]) & _mask.s6_addr32[0]) |
-             ((_addr.s6_addr32[1] ^ addr._addr.s6_addr32[1]) & _mask.s6_addr32[1]) |
-             ((_addr.s6_addr32[2] ^ addr._addr.s6_addr32[2]) & _mask.s6_addr32[2]) |
-             ((_addr.s6_addr32[3] ^ addr._addr.s6_addr32[3]) & _mask.s6_addr32[3]));
-}
-
-bool address::operator!=(const address& addr) const
-{
-    return !!(((_addr.s6_addr32[0] ^ addr._addr.s6_addr32[0]) & _mask.s6_addr32[0]) |
-              ((_addr.s6_addr32[1] ^ addr._addr.s6_addr32[1]) & _mask.s6_addr32[1]) |
-              ((_addr.s6_addr32[2] ^ addr._addr.s6_addr32[2]) & _mask.s6_addr32[2]) |
-              ((_addr.s6_addr32[3] ^ addr._addr.s6_addr32[3]) & _mask.s6_addr32[3]));
-}
-
 bool address::is_empty() const
 {
-    if (_addr.s6_addr32[0] == 0 &&
-        _addr.s6_addr32[1] == 0 &&
-        _addr.s6_addr32[2] == 0 &&
-        _addr.s6_addr32[3] == 0 &&
-        _mask.s6_addr32[0] == 0xffffffff &&
-        _mask.s6_addr32[1] == 0xffffffff &&
-        _mask.s6_addr32[2] == 0xffffffff &&
-        _mask.s6_addr32[3] == 0xffffffff)
-        return true;
-        
-    return false;
+    return (_prefix == 128) &&
+           !(_addr.s6_addr32[0] | _addr.s6_addr32[1] |
+             _addr.s6_addr32[2] | _addr.s6_addr32[3]);
 }
 
 void address::reset()
 {
-    _addr.s6_addr32[0] = 0;
-    _addr.s6_addr32[1] = 0;
-    _addr.s6_addr32[2] = 0;
-    _addr.s6_addr32[3] = 0;
-
-    _mask.s6_addr32[0] = 0xffffffff;
-    _mask.s6_addr32[1] = 0xffffffff;
-    _mask.s6_addr32[2] = 0xffffffff;
-    _mask.s6_addr32[3] = 0xffffffff;
+    memset(&_addr, 0, sizeof(_addr));
+    _prefix = 128;
 }
 
 int address::prefix() const
 {
-    if (!_mask.s6_addr[0]) {
-        return 0;
-    }
-
-    for (int p = 0; p < 128; p++) {
-        int byi = p / 8, bii = 7 - (p % 8);
-
-        if (!(_mask.s6_addr[byi]&  (1 << bii))) {
-            return p;
-        }
-    }
-
-    return 128;
+    return _prefix;
 }
 
 void address::prefix(int pf)
 {
-    const unsigned char maskbit[] = {
-        0x00, 0x80, 0xc0, 0xe0, 0xf0,
-        0xf8, 0xfc, 0xfe, 0xff
-    };
-
-    if (pf >= 128) {
-        _mask.s6_addr32[0] = 0xffffffff;
-        _mask.s6_addr32[1] = 0xffffffff;
-        _mask.s6_addr32[2] = 0xffffffff;
-        _mask.s6_addr32[3] = 0xffffffff;
-        return;
-    } else {
-        _mask.s6_addr32[0] = 0;
-        _mask.s6_addr32[1] = 0;
-        _mask.s6_addr32[2] = 0;
-        _mask.s6_addr32[3] = 0;
-
-        if (pf <= 0) {
-            return;
-        }
-    }
-
-    int offset = pf / 8, n;
-
-    for (n = 0; n < offset; n++) {
-        _mask.s6_addr[n] = 0xff;
-    }
-
-    _mask.s6_addr[offset] = maskbit[pf % 8];
+    _prefix = (pf < 0) ? 0 : (pf > 128) ? 128 : pf;
 }
 
 const std::string address::to_string() const
@@ -272,10 +167,7 @@ bool address::parse_string(const std::string& str)
     }
 
     if (*p == '\0') {
-        _mask.s6_addr32[0] = 0xffffffff;
-        _mask.s6_addr32[1] = 0xffffffff;
-        _mask.s6_addr32[2] = 0xffffffff;
-        _mask.s6_addr32[3] = 0xffffffff;
+        _prefix = 128;
         return true;
     }
 
@@ -324,11 +216,6 @@ const struct in6_addr& address::const_addr() const
     return _addr;
 }
 
-struct in6_addr& address::mask()
-{
-    return _mask;
-}
-
 bool address::is_multicast() const
 {
     return _addr.s6_addr[0] == 0xff;
@@ -343,76 +230,173 @@ bool address::is_unicast() const
     return _addr.s6_addr[0] != 0xff;
 }
 
-void address::add(const address& addr, const std::string& ifname)
+void address::add_local(const in6_addr& addr, int ifindex)
 {
-    ptr<route> rt(new route(addr, ifname));
-    // logger::debug() << "address::create() addr=" << addr << ", ifname=" << ifname;
-    _addresses.push_back(rt);
+    owner_vector& owners = _locals.insert(addr);
+
+    for (owner_vector::iterator it = owners.begin(); it != owners.end(); it++) {
+        if (it->ifindex == ifindex)
+            return;
+    }
+
+    ND_DEBUG << "found local addr=" << address(addr) << ", ifindex=" << ifindex;
+
+    iface::filters_changed();
+
+    owner o;
+    o.ifindex = ifindex;
+    owners.push_back(o);
 }
 
-std::list<ptr<route> >::iterator address::addresses_begin()
+void address::remove_local(const in6_addr& addr, int ifindex)
 {
-    return _addresses.begin();
+    owner_vector* owners = _locals.find(addr);
+
+    if (!owners)
+        return;
+
+    for (owner_vector::iterator it = owners->begin(); it != owners->end(); ) {
+        if (it->ifindex == ifindex) {
+            ND_DEBUG << "lost local addr=" << address(addr) << ", ifindex=" << it->ifindex;
+            it = owners->erase(it);
+            iface::filters_changed();
+        } else {
+            it++;
+        }
+    }
+
+    if (owners->empty())
+        _locals.erase(addr);
 }
 
-std::list<ptr<route> >::iterator address::addresses_end()
+const address::owner_vector* address::find_local(const in6_addr& addr)
 {
-    return _addresses.end();
+    return _locals.find(addr);
 }
 
-void address::load(const std::string& path)
+bool address::is_local(const in6_addr& addr)
 {
-    // Hack to make sure the addresses are not freed prematurely.
-    std::list<ptr<route> > tmp_addresses(_addresses);
-    _addresses.clear();
-
-    logger::debug() << "reading IP addresses";
-
-    try {
-        std::ifstream ifs;
-        ifs.exceptions(std::ifstream::badbit | std::ifstream::failbit);
-        ifs.open(path.c_str(), std::ios::in);
-        ifs.exceptions(std::ifstream::badbit);
-
-        while (!ifs.eof()) {
-            char buf[1024];
-            ifs.getline(buf, sizeof(buf));
-
-            if (ifs.gcount() < 53) {
-                if (ifs.gcount() > 0)
-                    logger::debug() << "skipping entry (size=" << ifs.gcount() << ")";
-                continue;
-            }
-
-            address addr;
-
-            if (route::hexdec(buf, (unsigned char* )&addr.addr(), 16) != 16) {
-                logger::warning() << "failed to load address (" << buf << ")";
-                continue;
-            }
-            
-            addr.prefix(128);
-            
-            std::string iface = route::token(buf + 45);
-
-            address::add(addr, iface);
-            
-            logger::debug() << "found local addr=" << addr << ", iface=" << iface;
+    return _locals.find(addr) != 0;
+}
+
+// What collect() is looking for, and where to put it.
+struct local_query {
+    int ifindex;
+
+    std::vector<in6_addr>* out;
+};
+
+void address::collect(const in6_addr& addr, owner_vector& owners, void* data)
+{
+    local_query* q = (local_query* )data;
+
+    for (owner_vector::iterator it = owners.begin(); it != owners.end(); it++) {
+        if (it->ifindex == q->ifindex) {
+            q->out->push_back(addr);
+            return;
         }
-    } catch (std::ifstream::failure e) {
-        logger::warning() << "Failed to parse IPv6 address data from '" << path << "'";
-        logger::error() << e.what();
     }
-    
-    logger::debug() << "completed IP addresses load";
 }
 
-void address::update(int elapsed_time)
+void address::find_locals(int ifindex, std::vector<in6_addr>& out)
 {
-    if ((_c_ttl -= elapsed_time) <= 0) {
-        load("/proc/net/if_inet6");
-        _c_ttl = _ttl;
+    local_query q;
+    q.ifindex = ifindex;
+    q.out     = &out;
+
+    _locals.walk(&address::collect, &q);
+}
+
+// An address as /proc/net/if_inet6 lists it.
+struct local_entry {
+    in6_addr addr;
+
+    int ifindex;
+
+    bool operator<(const local_entry& e) const
+    {
+        if (int d = memcmp(&addr, &e.addr, sizeof(addr)))
+            return d < 0;
+
+        return ifindex < e.ifindex;
+    }
+};
+
+static procfs local_file("");
+
+// The addresses the file listed last time, sorted, and the ones it
+// lists now.
+static std::vector<local_entry> local_entries, local_next;
+
+void address::load(const std::string& path)
+{
+    ND_DEBUG << "reading IP addresses";
+
+    // As with the routes, the entries are what the table holds.
+    if (local_file.path() != path)
+        local_file = procfs(path);
+
+    int changed = local_file.read();
+
+    if (changed < 0) {
+        logger::warning() << "Failed to load IPv6 address data from '" << path << "'";
+        return;
     }
+
+    if (!changed)
+        return;
+
+    local_next.clear();
+
+    for (const char* line = local_file.data(); *line; ) {
+        const char* end = strchr(line, '\n');
+
+        if (!end)
+            end = line + strlen(line);
+
+        local_entry e;
+
+        if (((end - line) < 53) || !procfs::hex(line, e.addr.s6_addr, 16)) {
+            if (end > line)
+                ND_DEBUG << "skipping entry (size=" << (end - line) << ")";
+        } else {
+            e.ifindex = (int)strtol(line + 33, NULL, 16);
+            local_next.push_back(e);
+        }
+
+        line = *end ? end + 1 : end;
+    }
+
+    std::sort(local_next.begin(), local_next.end());
+
+    std::vector<local_entry>::iterator o_it = local_entries.begin(), n_it = local_next.begin();
+
+    while ((o_it != local_entries.end()) || (n_it != local_next.end())) {
+        if ((n_it == local_next.end()) || ((o_it != local_entries.end()) && (*o_it < *n_it))) {
+            remove_local(o_it->addr, o_it->ifindex);
+            o_it++;
+        } else if ((o_it == local_entries.end()) || (*n_it < *o_it)) {
+            add_local(n_it->addr, n_it->ifindex);
+            n_it++;
+        } else {
+            o_it++;
+            n_it++;
+        }
+    }
+
+    local_entries.swap(local_next);
+
+    ND_DEBUG << "completed IP addresses load";
+}
+
+void address::update()
+{
+    int64_t start = stats::now();
+
+    load("/proc/net/if_inet6");
+
+    stats::record(stats::ADDRESS_RELOAD, stats::now() - start);
+    _timer.start(_ttl);
 }
 
 int address::ttl()
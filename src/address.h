@@ -16,10 +16,19 @@
 #pragma once
 
 #include <string>
-#include <list>
+#include <vector>
 #include <netinet/ip6.h>
+#include <stdint.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#endif
 
 #include "ndppd.h"
+#include "timer.h"
+#include "addr_map.h"
 
 NDPPD_NS_BEGIN
 
@@ -27,18 +36,29 @@ class iface;
 
 class route;
 
+// An address and a prefix length. Host addresses have a prefix of 128,
+// and where only ever a host address is stored, a plain in6_addr is used
+// instead.
 class address {
 public:
+    // An interface that a local address is assigned to.
+    struct owner {
+        int ifindex;
+    };
+
+    typedef std::vector<owner> owner_vector;
+
     address();
     address(const address& addr);
     address(const ptr<address>& addr);
     address(const std::string& str);
     address(const char* str);
     address(const in6_addr& addr);
-    address(const in6_addr& addr, const in6_addr& mask);
     address(const in6_addr& addr, int prefix);
     
-    static void update(int elapsed_time);
+    // Reloads the table now, and schedules the next reload 'ttl'
+    // milliseconds from now.
+    static void update();
 
     static int ttl();
 
@@ -48,9 +68,8 @@ public:
 
     const struct in6_addr& const_addr() const;
 
-    struct in6_addr& mask();
-
-    // Compare _a/_m against a._a.
+    // Returns true if the first prefix() bits of this address and
+    // 'addr' are the same.
     bool operator==(const address& addr) const;
 
     bool operator!=(const address& addr) const;
@@ -71,24 +90,116 @@ public:
 
     bool is_multicast() const;
 
+    // Returns true if 'a' and 'b' are the same address.
+    static bool equal(const in6_addr& a, const in6_addr& b);
+
+    // Returns the number of leading bits 'a' and 'b' have in common.
+    static int common_prefix(const in6_addr& a, const in6_addr& b);
+
     operator std::string() const;
     
-    static void add(const address& addr, const std::string& ifname);
-    
+    // Records that 'addr' is assigned to the interface 'ifindex'.
+    static void add_local(const in6_addr& addr, int ifindex);
+
+    // Forgets that 'addr' is assigned to 'ifindex'.
+    static void remove_local(const in6_addr& addr, int ifindex);
+
+    // Returns the interfaces 'addr' is assigned to, or NULL if it isn't
+    // one of our addresses.
+    static const owner_vector* find_local(const in6_addr& addr);
+
+    static bool is_local(const in6_addr& addr);
+
+    // Appends every local address assigned to 'ifindex' to 'out'.
+    static void find_locals(int ifindex, std::vector<in6_addr>& out);
+
+    // Brings the local address table up to date with 'path', only
+    // touching the addresses that were added or removed since last time.
     static void load(const std::string& path);
-    
-    static std::list<ptr<route> >::iterator addresses_begin();
-    
-    static std::list<ptr<route> >::iterator addresses_end();
 
 private:
     static int _ttl;
 
-    static int _c_ttl;
-    
-    static std::list<ptr<route> > _addresses;
-    
-    struct in6_addr _addr, _mask;
+    static timer _timer;
+
+    // Every address assigned to this machine.
+    static addr_map<owner_vector> _locals;
+
+    static void collect(const in6_addr& addr, owner_vector& owners, void* data);
+
+    struct in6_addr _addr;
+
+    uint8_t _prefix;
 };
 
+// These two are behind every rule match and session lookup, so they
+// compare all 16 bytes at once where the CPU can.
+
+inline bool address::equal(const in6_addr& a, const in6_addr& b)
+{
+#if defined(__SSE2__)
+    __m128i eq = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)&a),
+                                _mm_loadu_si128((const __m128i*)&b));
+
+    return _mm_movemask_epi8(eq) == 0xffff;
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+    return vminvq_u8(vceqq_u8(vld1q_u8(a.s6_addr), vld1q_u8(b.s6_addr))) == 0xff;
+#else
+    return !((a.s6_addr32[0] ^ b.s6_addr32[0]) |
+             (a.s6_addr32[1] ^ b.s6_addr32[1]) |
+             (a.s6_addr32[2] ^ b.s6_addr32[2]) |
+             (a.s6_addr32[3] ^ b.s6_addr32[3]));
+#endif
+}
+
+inline int address::common_prefix(const in6_addr& a, const in6_addr& b)
+{
+#if defined(__SSE2__)
+    __m128i eq = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)&a),
+                                _mm_loadu_si128((const __m128i*)&b));
+
+    // One bit for each byte that differs.
+    unsigned diff = ~_mm_movemask_epi8(eq) & 0xffff;
+
+    if (!diff)
+        return 128;
+
+    int i = __builtin_ctz(diff);
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+    uint8x16_t eq = vceqq_u8(vld1q_u8(a.s6_addr), vld1q_u8(b.s6_addr));
+
+    // Four bits for each byte that differs.
+    uint64_t diff = ~vget_lane_u64(vreinterpret_u64_u8(
+        vshrn_n_u16(vreinterpretq_u16_u8(eq), 4)), 0);
+
+    if (!diff)
+        return 128;
+
+    int i = __builtin_ctzll(diff) / 4;
+#else
+    int i = 0;
+
+    while ((i < 16) && (a.s6_addr[i] == b.s6_addr[i]))
+        i++;
+
+    if (i == 16)
+        return 128;
+#endif
+
+    return i * 8 + __builtin_clz((unsigned)(a.s6_addr[i] ^ b.s6_addr[i])) - 24;
+}
+
+inline bool address::operator==(const address& addr) const
+{
+    if (_prefix >= 128)
+        return equal(_addr, addr._addr);
+
+    return common_prefix(_addr, addr._addr) >= _prefix;
+}
+
+inline bool address::operator!=(const address& addr) const
+{
+    return !(*this == addr);
+}
+
 NDPPD_NS_END
@@ -24,43 +24,93 @@
 #include <netinet/ip6.h>
 #include <netinet/icmp6.h>
 #include <netinet/ether.h>
-#include <netpacket/packet.h>
 
 #include <net/if.h>
 #include <sys/ioctl.h>
 #include <sys/types.h>
 #include <sys/socket.h>
-#include <sys/poll.h>
+#include <sys/mman.h>
+#include <sys/epoll.h>
+#include <sys/uio.h>
 
 #include <linux/filter.h>
+#include <linux/if_packet.h>
 
 #include <errno.h>
 #include <string>
 #include <vector>
 #include <map>
+#include <algorithm>
 
 #include "ndppd.h"
 #include "route.h"
+#include "trie.h"
+#include "worker.h"
+#include "packet.h"
+#include "stats.h"
 
 NDPPD_NS_BEGIN
 
 std::map<std::string, weak_ptr<iface> > iface::_map;
 
-bool iface::_map_dirty = false;
+int iface::_rx_batch = 32;
 
-std::vector<struct pollfd> iface::_pollfds;
+bool iface::_rx_ring = false;
+
+int iface::_busy_poll = 0;
+
+int iface::_renew_rate = 0;
+
+int iface::_renew_burst = 1;
+
+int iface::_max_probes = 0;
+
+std::vector<uint8_t> iface::_rx_buf;
+
+std::vector<struct mmsghdr> iface::_rx_msgs;
+
+std::vector<struct iovec> iface::_rx_iovs;
+
+std::vector<struct sockaddr_storage> iface::_rx_names;
+
+std::vector<weak_ptr<iface> > iface::_tx_pending;
+
+bool iface::_filters_dirty = false;
+
+std::vector<struct mmsghdr> iface::_tx_msgs;
+
+std::vector<struct iovec> iface::_tx_iovs;
+
+// ff02::1:ff00:0, which the last 24 bits of a target are appended to.
+static const struct in6_addr solicited_node_prefix = {{{
+    0xff, 0x02, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0x01, 0xff, 0, 0, 0
+}}};
+
+// Room for a solicit or advert with a few options and extension headers.
+static const size_t RX_MSG_SIZE = 512;
+
+// Geometry of the TPACKET_V3 receive ring. Blocks are handed to us when
+// they fill up or after RX_RING_TIMEOUT milliseconds, whichever is first.
+static const size_t RX_RING_BLOCK_SIZE = 1 << 16;
+static const size_t RX_RING_BLOCKS     = 16;
+static const size_t RX_RING_FRAME_SIZE = 2048;
+static const int    RX_RING_TIMEOUT    = 1;
 
 iface::iface() :
-    _ifd(-1), _pfd(-1), _name("")
+    _probes(0), _tx_hook(0), _ifd(-1), _pfd(-1), _ring(NULL),
+    _ring_block_size(0), _ring_blocks(0), _ring_next(0), _name(""), _ifindex(0)
 {
 }
 
 iface::~iface()
 {
-    logger::debug() << "iface::~iface()";
+    ND_DEBUG << "iface::~iface()";
 
-    if (_ifd >= 0)
+    if (_ifd >= 0) {
+        flush();
+        reactor::remove(&_ifd_watch);
         close(_ifd);
+    }
 
     if (_pfd >= 0) {
         if (_prev_allmulti >= 0) {
@@ -69,15 +119,50 @@ iface::~iface()
         if (_prev_promiscuous >= 0) {
             promiscuous(_prev_promiscuous);
         }
+        close_ring();
+        reactor::remove(&_pfd_watch);
         close(_pfd);
     }
 
-    _map_dirty = true;
-    
+    std::map<std::string, weak_ptr<iface> >::iterator it = _map.find(_name);
+
+    if ((it != _map.end()) && !it->second) {
+        _map.erase(it);
+    }
+
     _serves.clear();
     _parents.clear();
 }
 
+// Older headers don't know about these yet.
+#ifndef SO_BUSY_POLL
+#define SO_BUSY_POLL 46
+#endif
+
+#ifndef SO_PREFER_BUSY_POLL
+#define SO_PREFER_BUSY_POLL 69
+#endif
+
+// Offset of nd_ns_target in an Ethernet frame carrying a solicit.
+#define NS_TARGET_OFFSET \
+    (ETH_HLEN + sizeof(struct ip6_hdr) + offsetof(struct nd_neighbor_solicit, nd_ns_target))
+
+// The same, relative to the IPv6 header.
+#define FANOUT_TARGET_OFFSET \
+    (sizeof(struct ip6_hdr) + offsetof(struct nd_neighbor_solicit, nd_ns_target))
+
+static struct sock_filter bpf_stmt(uint16_t code, uint32_t k)
+{
+    struct sock_filter insn = BPF_STMT(code, k);
+    return insn;
+}
+
+static struct sock_filter bpf_jump(uint16_t code, uint32_t k, uint8_t jt, uint8_t jf)
+{
+    struct sock_filter insn = BPF_JUMP(code, k, jt, jf);
+    return insn;
+}
+
 ptr<iface> iface::open_pfd(const std::string& name, bool promiscuous)
 {
     int fd = 0;
@@ -136,7 +221,10 @@ ptr<iface> iface::open_pfd(const std::string& name, bool promiscuous)
         return ptr<iface>();
     }
 
-    // Set up filter.
+    set_busy_poll(fd, name);
+
+    // Set up filter. This is replaced by update_filter() once we know
+    // which targets we're interested in.
 
     static struct sock_filter filter[] = {
         // Load the ether_type.
@@ -166,10 +254,27 @@ ptr<iface> iface::open_pfd(const std::string& name, bool promiscuous)
     };
 
     if (setsockopt(fd, SOL_SOCKET, SO_ATTACH_FILTER, &fprog, sizeof(fprog)) < 0) {
+        close(fd);
         logger::error() << "Failed to set filter";
         return ptr<iface>();
     }
 
+    // Set up the receive ring; if that's not possible we'll simply fall
+    // back to reading with recvmmsg().
+
+    if (_rx_ring && !ifa->open_ring(fd)) {
+        logger::warning() << "Failed to set up receive ring on interface '" << name << "'";
+    }
+
+    // Note that the fanout group has to be joined after the ring is set
+    // up, since the ring can't be changed once we're a member.
+
+    if ((worker::count() > 1) && !ifa->join_fanout(fd)) {
+        ifa->close_ring();
+        close(fd);
+        return ptr<iface>();
+    }
+
     // Set up an instance of 'iface'.
 
     ifa->_pfd = fd;
@@ -184,7 +289,12 @@ ptr<iface> iface::open_pfd(const std::string& name, bool promiscuous)
         ifa->_prev_promiscuous = -1;
     }
 
-    _map_dirty = true;
+    ifa->_pfd_watch.fd   = fd;
+    ifa->_pfd_watch.fn   = &iface::handle_io;
+    ifa->_pfd_watch.data = ifa.get_pointer();
+    ifa->_pfd_watch.role = PFD;
+
+    reactor::add(&ifa->_pfd_watch);
 
     return ifa;
 }
@@ -233,7 +343,7 @@ ptr<iface> iface::open_ifd(const std::string& name)
         return ptr<iface>();
     }
 
-    logger::debug()
+    ND_DEBUG
         << "fd=" << fd << ", hwaddr="
         << ether_ntoa((const struct ether_addr* )&ifr.ifr_hwaddr.sa_data);
 
@@ -267,6 +377,8 @@ ptr<iface> iface::open_ifd(const std::string& name)
         return ptr<iface>();
     }
 
+    set_busy_poll(fd, name);
+
     // Set up filter.
 
     struct icmp6_filter filter;
@@ -294,261 +406,527 @@ ptr<iface> iface::open_ifd(const std::string& name)
 
     ifa->_ifd = fd;
 
+    ifa->_ifindex = if_nametoindex(name.c_str());
+
     memcpy(&ifa->hwaddr, ifr.ifr_hwaddr.sa_data, sizeof(struct ether_addr));
 
-    _map_dirty = true;
+    ifa->build_templates();
+
+    ifa->_ifd_watch.fd   = fd;
+    ifa->_ifd_watch.fn   = &iface::handle_io;
+    ifa->_ifd_watch.data = ifa.get_pointer();
+    ifa->_ifd_watch.role = IFD;
+
+    reactor::add(&ifa->_ifd_watch);
 
     return ifa;
 }
 
-ssize_t iface::read(int fd, struct sockaddr* saddr, ssize_t saddr_size, uint8_t* msg, size_t size)
+ptr<iface> iface::open_fake(const std::string& name, int ifindex, tx_hook fn)
 {
-    struct msghdr mhdr;
-    struct iovec iov;
-    int len;
+    if (_map.find(name) != _map.end()) {
+        logger::error() << "Interface '" << name << "' is already open";
+        return ptr<iface>();
+    }
 
-    if (!msg || (size < 0))
-        return -1;
+    ptr<iface> ifa(new iface());
+    ifa->_name    = name;
+    ifa->_ptr     = ifa;
+    ifa->_ifindex = ifindex;
+    ifa->_tx_hook = fn;
 
-    iov.iov_len = size;
-    iov.iov_base = (caddr_t)msg;
+    // A locally administered address, so templates look plausible.
+    memset(&ifa->hwaddr, 0, sizeof(ifa->hwaddr));
+    ifa->hwaddr.ether_addr_octet[0] = 0x02;
+    ifa->hwaddr.ether_addr_octet[4] = (ifindex >> 8) & 0xff;
+    ifa->hwaddr.ether_addr_octet[5] = ifindex & 0xff;
 
-    memset(&mhdr, 0, sizeof(mhdr));
-    mhdr.msg_name = (caddr_t)saddr;
-    mhdr.msg_namelen = saddr_size;
-    mhdr.msg_iov =& iov;
-    mhdr.msg_iovlen = 1;
-    
-    if ((len = recvmsg(fd,& mhdr, 0)) < 0)
-    {
-        logger::error() << "iface::read() failed! error=" << logger::err() << ", ifa=" << name();
-        return -1;
-    }
-    
-    logger::debug() << "iface::read() ifa=" << name() << ", len=" << len;
+    ifa->build_templates();
 
-    if (len < sizeof(struct icmp6_hdr))
-        return -1;
+    _map[name] = ifa;
 
-    return len;
+    return ifa;
 }
 
-ssize_t iface::write(int fd, const address& daddr, const uint8_t* msg, size_t size)
+bool iface::open_ring(int fd)
 {
-    struct sockaddr_in6 daddr_tmp;
-    struct msghdr mhdr;
-    struct iovec iov;
+    int version = TPACKET_V3;
 
-    memset(&daddr_tmp, 0, sizeof(struct sockaddr_in6));
-    daddr_tmp.sin6_family = AF_INET6;
-    daddr_tmp.sin6_port   = htons(IPPROTO_ICMPV6); // Needed?
-    memcpy(&daddr_tmp.sin6_addr,& daddr.const_addr(), sizeof(struct in6_addr));
+    if (setsockopt(fd, SOL_PACKET, PACKET_VERSION, &version, sizeof(version)) < 0)
+        return false;
 
-    iov.iov_len = size;
-    iov.iov_base = (caddr_t)msg;
+    struct tpacket_req3 req;
 
-    memset(&mhdr, 0, sizeof(mhdr));
-    mhdr.msg_name = (caddr_t)&daddr_tmp;
-    mhdr.msg_namelen = sizeof(sockaddr_in6);
-    mhdr.msg_iov =& iov;
-    mhdr.msg_iovlen = 1;
+    memset(&req, 0, sizeof(req));
+    req.tp_block_size       = RX_RING_BLOCK_SIZE;
+    req.tp_block_nr         = RX_RING_BLOCKS;
+    req.tp_frame_size       = RX_RING_FRAME_SIZE;
+    req.tp_frame_nr         = (RX_RING_BLOCK_SIZE / RX_RING_FRAME_SIZE) * RX_RING_BLOCKS;
+    req.tp_retire_blk_tov   = RX_RING_TIMEOUT;
 
-    logger::debug() << "iface::write() ifa=" << name() << ", daddr=" << daddr.to_string() << ", len="
-                    << size;
+    if (setsockopt(fd, SOL_PACKET, PACKET_RX_RING, &req, sizeof(req)) < 0)
+        return false;
 
-    int len;
+    void* ring = mmap(NULL, RX_RING_BLOCK_SIZE * RX_RING_BLOCKS, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_LOCKED, fd, 0);
 
-    if ((len = sendmsg(fd,& mhdr, 0)) < 0)
-    {
-        logger::error() << "iface::write() failed! error=" << logger::err() << ", ifa=" << name() << ", daddr=" << daddr.to_string();
-        return -1;
+    if (ring == MAP_FAILED) {
+        // Disable the ring again so the socket works with recvmmsg().
+        memset(&req, 0, sizeof(req));
+        setsockopt(fd, SOL_PACKET, PACKET_RX_RING, &req, sizeof(req));
+        return false;
     }
 
-    return len;
+    _ring            = (uint8_t* )ring;
+    _ring_block_size = RX_RING_BLOCK_SIZE;
+    _ring_blocks     = RX_RING_BLOCKS;
+    _ring_next       = 0;
+
+    ND_DEBUG << "iface::open_ring() ifa=" << _name << ", blocks=" << (int)_ring_blocks;
+
+    return true;
 }
 
-ssize_t iface::read_solicit(address& saddr, address& daddr, address& taddr)
+void iface::close_ring()
 {
-    struct sockaddr_ll t_saddr;
-    uint8_t msg[256];
-    ssize_t len;
+    if (!_ring)
+        return;
 
-    if ((len = read(_pfd, (struct sockaddr*)&t_saddr, sizeof(struct sockaddr_ll), msg, sizeof(msg))) < 0) {
-        logger::warning() << "iface::read_solicit() failed: " << logger::err();
-        return -1;
+    munmap(_ring, _ring_block_size * _ring_blocks);
+
+    _ring            = NULL;
+    _ring_block_size = 0;
+    _ring_blocks     = 0;
+    _ring_next       = 0;
+}
+
+int iface::read_batch(int fd)
+{
+    size_t n = _rx_batch;
+
+    if (_rx_msgs.size() != n) {
+        _rx_buf.resize(n * RX_MSG_SIZE);
+        _rx_msgs.resize(n);
+        _rx_iovs.resize(n);
+        _rx_names.resize(n);
     }
 
-    struct ip6_hdr* ip6h =
-          (struct ip6_hdr* )(msg + ETH_HLEN);
+    for (size_t i = 0; i < n; i++) {
+        _rx_iovs[i].iov_base = &_rx_buf[i * RX_MSG_SIZE];
+        _rx_iovs[i].iov_len  = RX_MSG_SIZE;
 
-    struct nd_neighbor_solicit*  ns =
-        (struct nd_neighbor_solicit*)(msg + ETH_HLEN + sizeof(struct ip6_hdr));
+        memset(&_rx_msgs[i], 0, sizeof(struct mmsghdr));
+        _rx_msgs[i].msg_hdr.msg_name    = &_rx_names[i];
+        _rx_msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_storage);
+        _rx_msgs[i].msg_hdr.msg_iov     = &_rx_iovs[i];
+        _rx_msgs[i].msg_hdr.msg_iovlen  = 1;
+    }
 
-    taddr = ns->nd_ns_target;
-    daddr = ip6h->ip6_dst;
-    saddr = ip6h->ip6_src;
-    
-    // Ignore packets sent from this machine
-    if (iface::is_local(saddr) == true) {
-        return 0;
+    int len;
+
+    if ((len = recvmmsg(fd, &_rx_msgs[0], n, MSG_DONTWAIT, NULL)) < 0) {
+        if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+            return 0;
+
+        logger::error() << "iface::read_batch() failed! error=" << logger::err() << ", ifa=" << name();
+        return -1;
     }
 
-    logger::debug() << "iface::read_solicit() saddr=" << saddr.to_string()
-                    << ", daddr=" << daddr.to_string() << ", taddr=" << taddr.to_string() << ", len=" << len;
+    ND_DEBUG << "iface::read_batch() ifa=" << name() << ", count=" << len;
 
     return len;
 }
 
-ssize_t iface::write_solicit(const address& taddr)
+void iface::build_templates()
 {
-    char buf[128];
-
-    memset(buf, 0, sizeof(buf));
+    memset(_ns_template, 0, sizeof(_ns_template));
+    memset(_na_template, 0, sizeof(_na_template));
 
     struct nd_neighbor_solicit* ns =
-        (struct nd_neighbor_solicit* )&buf[0];
+        (struct nd_neighbor_solicit* )&_ns_template[0];
 
     struct nd_opt_hdr* opt =
-        (struct nd_opt_hdr* )&buf[sizeof(struct nd_neighbor_solicit)];
+        (struct nd_opt_hdr* )&_ns_template[sizeof(struct nd_neighbor_solicit)];
 
+    ns->nd_ns_type   = ND_NEIGHBOR_SOLICIT;
     opt->nd_opt_type = ND_OPT_SOURCE_LINKADDR;
     opt->nd_opt_len  = 1;
 
-    ns->nd_ns_type   = ND_NEIGHBOR_SOLICIT;
+    memcpy(_ns_template + sizeof(struct nd_neighbor_solicit) + sizeof(struct nd_opt_hdr),
+           &hwaddr, 6);
+
+    struct nd_neighbor_advert* na =
+        (struct nd_neighbor_advert* )&_na_template[0];
 
-    memcpy(&ns->nd_ns_target,& taddr.const_addr(), sizeof(struct in6_addr));
+    opt = (struct nd_opt_hdr* )&_na_template[sizeof(struct nd_neighbor_advert)];
 
-    memcpy(buf + sizeof(struct nd_neighbor_solicit) + sizeof(struct nd_opt_hdr),
+    na->nd_na_type   = ND_NEIGHBOR_ADVERT;
+    opt->nd_opt_type = ND_OPT_TARGET_LINKADDR;
+    opt->nd_opt_len  = 1;
+
+    memcpy(_na_template + sizeof(struct nd_neighbor_advert) + sizeof(struct nd_opt_hdr),
            &hwaddr, 6);
+}
 
-    // FIXME: Alright, I'm lazy.
-    static address multicast("ff02::1:ff00:0000");
+ssize_t iface::write(const address& daddr, const uint8_t* msg, size_t size, int64_t since)
+{
+    if (size > sizeof(((tx_msg* )0)->buf))
+        return -1;
+
+    if (_tx_queue.empty())
+        _tx_pending.push_back(_ptr);
+
+    _tx_queue.resize(_tx_queue.size() + 1);
 
-    address daddr;
+    tx_msg& m = _tx_queue.back();
 
-    daddr = multicast;
+    memset(&m.daddr, 0, sizeof(struct sockaddr_in6));
+    m.daddr.sin6_family = AF_INET6;
+    m.daddr.sin6_port   = htons(IPPROTO_ICMPV6); // Needed?
+    memcpy(&m.daddr.sin6_addr, &daddr.const_addr(), sizeof(struct in6_addr));
 
-    daddr.addr().s6_addr[13] = taddr.const_addr().s6_addr[13];
-    daddr.addr().s6_addr[14] = taddr.const_addr().s6_addr[14];
-    daddr.addr().s6_addr[15] = taddr.const_addr().s6_addr[15];
+    // Link-local destinations, such as a router that answered for a
+    // target, need to know which link they're on.
+    if (IN6_IS_ADDR_LINKLOCAL(&m.daddr.sin6_addr))
+        m.daddr.sin6_scope_id = _ifindex;
 
-    logger::debug() << "iface::write_solicit() taddr=" << taddr.to_string()
-                    << ", daddr=" << daddr.to_string();
+    memcpy(m.buf, msg, size);
+    m.len   = size;
+    m.since = since;
 
-    return write(_ifd, daddr, (uint8_t* )buf, sizeof(struct nd_neighbor_solicit)
-                 + sizeof(struct nd_opt_hdr) + 6);
+    ND_DEBUG << "iface::write() ifa=" << name() << ", daddr=" << daddr.to_string() << ", len="
+                    << (int)size;
+
+    return size;
 }
 
-ssize_t iface::write_advert(const address& daddr, const address& taddr, bool router)
+int iface::flush()
 {
-    char buf[128];
+    size_t n = _tx_queue.size();
 
-    memset(buf, 0, sizeof(buf));
+    if (!n)
+        return 0;
 
-    struct nd_neighbor_advert* na =
-        (struct nd_neighbor_advert* )&buf[0];
+    if (_ifd < 0) {
+        for (size_t i = 0; i < n; i++) {
+            if (_tx_hook)
+                _tx_hook(this, address(_tx_queue[i].daddr.sin6_addr), _tx_queue[i].buf, _tx_queue[i].len);
+        }
 
-    struct nd_opt_hdr* opt =
-        (struct nd_opt_hdr* )&buf[sizeof(struct nd_neighbor_advert)];
+        _tx_queue.clear();
+        _tx_solicits.clear();
+        return n;
+    }
 
-    opt->nd_opt_type         = ND_OPT_TARGET_LINKADDR;
-    opt->nd_opt_len          = 1;
+    if (_tx_msgs.size() < n) {
+        _tx_msgs.resize(n);
+        _tx_iovs.resize(n);
+    }
 
-    na->nd_na_type           = ND_NEIGHBOR_ADVERT;
-    na->nd_na_flags_reserved = (daddr.is_multicast() ? 0 : ND_NA_FLAG_SOLICITED) | (router ? ND_NA_FLAG_ROUTER : 0);
+    for (size_t i = 0; i < n; i++) {
+        _tx_iovs[i].iov_base = _tx_queue[i].buf;
+        _tx_iovs[i].iov_len  = _tx_queue[i].len;
 
-    memcpy(&na->nd_na_target,& taddr.const_addr(), sizeof(struct in6_addr));
+        memset(&_tx_msgs[i], 0, sizeof(struct mmsghdr));
+        _tx_msgs[i].msg_hdr.msg_name    = &_tx_queue[i].daddr;
+        _tx_msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in6);
+        _tx_msgs[i].msg_hdr.msg_iov     = &_tx_iovs[i];
+        _tx_msgs[i].msg_hdr.msg_iovlen  = 1;
+    }
 
-    memcpy(buf + sizeof(struct nd_neighbor_advert) + sizeof(struct nd_opt_hdr),
-           &hwaddr, 6);
+    int sent = 0;
 
-    logger::debug() << "iface::write_advert() daddr=" << daddr.to_string()
-                    << ", taddr=" << taddr.to_string();
+    for (size_t off = 0; off < n; ) {
+        size_t cnt = n - off;
+
+        if (cnt > UIO_MAXIOV)
+            cnt = UIO_MAXIOV;
+
+        int len;
+
+        if ((len = sendmmsg(_ifd, &_tx_msgs[off], cnt, 0)) < 0) {
+            // Skip the message that failed, and carry on with the rest.
+            logger::error() << "iface::flush() failed! error=" << logger::err() << ", ifa=" << name()
+                            << ", daddr=" << address(_tx_queue[off].daddr.sin6_addr).to_string();
+            off++;
+            continue;
+        }
+
+        int64_t now = 0;
+
+        for (int i = 0; i < len; i++) {
+            if (!_tx_queue[off + i].since)
+                continue;
+
+            if (!now)
+                now = stats::now();
+
+            stats::record(stats::RESPONSE_LATENCY, now - _tx_queue[off + i].since);
+        }
 
-    return write(_ifd, daddr, (uint8_t* )buf, sizeof(struct nd_neighbor_advert) +
-        sizeof(struct nd_opt_hdr) + 6);
+        sent += len;
+        off  += len;
+    }
+
+    ND_DEBUG << "iface::flush() ifa=" << name() << ", sent=" << sent << "/" << (int)n;
+
+    _tx_queue.clear();
+
+    if (!_tx_solicits.empty())
+        _tx_solicits.clear();
+
+    return sent;
 }
 
-ssize_t iface::read_advert(address& saddr, address& taddr)
+void iface::flush_all()
 {
-    struct sockaddr_in6 t_saddr;
-    uint8_t msg[256];
-    ssize_t len;
-    
-    memset(&t_saddr, 0, sizeof(struct sockaddr_in6));
-    t_saddr.sin6_family = AF_INET6;
-    t_saddr.sin6_port   = htons(IPPROTO_ICMPV6); // Needed?
+    // Swap the list out first, in case a flush queues something new.
+    std::vector<weak_ptr<iface> > pending;
+    pending.swap(_tx_pending);
+
+    for (std::vector<weak_ptr<iface> >::iterator it = pending.begin();
+            it != pending.end(); it++) {
+        if (!it->is_null())
+            (*it)->flush();
+    }
+}
 
-    if ((len = read(_ifd, (struct sockaddr* )&t_saddr, sizeof(struct sockaddr_in6), msg, sizeof(msg))) < 0) {
-        logger::warning() << "iface::read_advert() failed: " << logger::err();
-        return -1;
+void iface::handle_solicit_frame(const uint8_t* msg, size_t len)
+{
+    packet pkt;
+
+    if (!pkt.parse_frame(msg, len) || (pkt.type() != ND_NEIGHBOR_SOLICIT)) {
+        ND_DEBUG << "iface::handle_solicit_frame() invalid frame, len=" << (int)len;
+        stats::inc(stats::SOLICITS_INVALID);
+        return;
     }
 
-    saddr = t_saddr.sin6_addr;
-    
+    stats::inc(stats::SOLICITS_RECEIVED);
+
     // Ignore packets sent from this machine
-    if (iface::is_local(saddr) == true) {
+    if (address::is_local(pkt.saddr())) {
+        ND_DEBUG << "iface::read_solicits() loopback received and ignored";
+        return;
+    }
+
+    address taddr(pkt.taddr()), daddr(pkt.daddr()), saddr(pkt.saddr());
+
+    ND_DEBUG << "iface::read_solicits() saddr=" << saddr.to_string()
+                    << ", daddr=" << daddr.to_string() << ", taddr=" << taddr.to_string() << ", len=" << (int)len;
+
+    handle_solicit(saddr, daddr, taddr);
+}
+
+int iface::read_ring()
+{
+    int cnt = 0;
+
+    for (;;) {
+        struct tpacket_block_desc* bd =
+            (struct tpacket_block_desc* )(_ring + _ring_next * _ring_block_size);
+
+        if (!(__atomic_load_n(&bd->hdr.bh1.block_status, __ATOMIC_ACQUIRE) & TP_STATUS_USER))
+            break;
+
+        uint8_t* p = (uint8_t* )bd + bd->hdr.bh1.offset_to_first_pkt;
+
+        stats::rx_time(stats::now());
+
+        for (uint32_t i = 0; i < bd->hdr.bh1.num_pkts; i++) {
+            struct tpacket3_hdr* ph = (struct tpacket3_hdr* )p;
+
+            handle_solicit_frame(p + ph->tp_mac, ph->tp_snaplen);
+            cnt++;
+
+            p += ph->tp_next_offset;
+        }
+
+        // Hand the block back to the kernel.
+        __atomic_store_n(&bd->hdr.bh1.block_status, TP_STATUS_KERNEL, __ATOMIC_RELEASE);
+
+        _ring_next = (_ring_next + 1) % _ring_blocks;
+    }
+
+    return cnt;
+}
+
+int iface::read_solicits()
+{
+    if (_ring)
+        return read_ring();
+
+    int cnt;
+
+    if ((cnt = read_batch(_pfd)) < 0) {
+        logger::warning() << "iface::read_solicits() failed: " << logger::err();
+        return -1;
+    }
+
+    stats::rx_time(stats::now());
+
+    for (int i = 0; i < cnt; i++) {
+        handle_solicit_frame((const uint8_t* )_rx_iovs[i].iov_base, _rx_msgs[i].msg_len);
+    }
+
+    return cnt;
+}
+
+ssize_t iface::write_solicit(const address& taddr, const address& daddr)
+{
+    // Only one solicit per target each time we flush.
+    bool& queued = _tx_solicits.insert(taddr.const_addr());
+
+    if (queued) {
+        ND_DEBUG << "iface::write_solicit() taddr=" << taddr.to_string() << " already queued";
         return 0;
     }
 
-    if (((struct icmp6_hdr* )msg)->icmp6_type != ND_NEIGHBOR_ADVERT)
+    queued = true;
+
+    uint8_t buf[sizeof(_ns_template)];
+
+    memcpy(buf, _ns_template, sizeof(buf));
+    memcpy(&((struct nd_neighbor_solicit* )buf)->nd_ns_target, &taddr.const_addr(), sizeof(struct in6_addr));
+
+    stats::inc(stats::SOLICITS_SENT);
+
+    if (!daddr.is_empty()) {
+        ND_DEBUG << "iface::write_solicit() taddr=" << taddr.to_string()
+                        << ", daddr=" << daddr.to_string();
+
+        stats::inc(stats::SOLICITS_UNICAST);
+
+        return write(daddr, buf, sizeof(buf));
+    }
+
+    // Send it to the solicited-node multicast address ff02::1:ffXX:XXXX.
+    struct in6_addr group = solicited_node_prefix;
+
+    group.s6_addr[13] = taddr.const_addr().s6_addr[13];
+    group.s6_addr[14] = taddr.const_addr().s6_addr[14];
+    group.s6_addr[15] = taddr.const_addr().s6_addr[15];
+
+    ND_DEBUG << "iface::write_solicit() taddr=" << taddr.to_string()
+                    << ", daddr=" << address(group).to_string();
+
+    return write(group, buf, sizeof(buf));
+}
+
+ssize_t iface::write_advert(const address& daddr, const address& taddr, bool router, int64_t since)
+{
+    uint8_t buf[sizeof(_na_template)];
+
+    memcpy(buf, _na_template, sizeof(buf));
+
+    struct nd_neighbor_advert* na =
+        (struct nd_neighbor_advert* )&buf[0];
+
+    na->nd_na_flags_reserved = (daddr.is_multicast() ? 0 : ND_NA_FLAG_SOLICITED) | (router ? ND_NA_FLAG_ROUTER : 0);
+
+    memcpy(&na->nd_na_target, &taddr.const_addr(), sizeof(struct in6_addr));
+
+    ND_DEBUG << "iface::write_advert() daddr=" << daddr.to_string()
+                    << ", taddr=" << taddr.to_string();
+
+    stats::inc(stats::ADVERTS_SENT);
+
+    return write(daddr, buf, sizeof(buf), since);
+}
+
+int iface::read_adverts()
+{
+    int cnt;
+
+    if ((cnt = read_batch(_ifd)) < 0) {
+        logger::warning() << "iface::read_adverts() failed: " << logger::err();
         return -1;
+    }
 
-    taddr = ((struct nd_neighbor_solicit* )msg)->nd_ns_target;
+    stats::rx_time(stats::now());
 
-    logger::debug() << "iface::read_advert() saddr=" << saddr.to_string() << ", taddr=" << taddr.to_string() << ", len=" << len;
+    for (int i = 0; i < cnt; i++) {
+        const uint8_t* msg = (const uint8_t* )_rx_iovs[i].iov_base;
+        size_t len = _rx_msgs[i].msg_len;
 
-    return len;
+        packet pkt;
+
+        if (!pkt.parse_icmp(msg, len, ((struct sockaddr_in6* )&_rx_names[i])->sin6_addr) ||
+            (pkt.type() != ND_NEIGHBOR_ADVERT)) {
+            if (len && (msg[0] == ND_NEIGHBOR_ADVERT))
+                stats::inc(stats::ADVERTS_INVALID);
+            continue;
+        }
+
+        stats::inc(stats::ADVERTS_RECEIVED);
+
+        // Ignore packets sent from this machine
+        if (address::is_local(pkt.saddr())) {
+            ND_DEBUG << "iface::read_adverts() loopback received and ignored";
+            continue;
+        }
+
+        address saddr(pkt.saddr()), taddr(pkt.taddr());
+
+        ND_DEBUG << "iface::read_adverts() saddr=" << saddr.to_string() << ", taddr=" << taddr.to_string() << ", len=" << (int)len;
+
+        handle_advert(saddr, taddr);
+    }
+
+    return cnt;
 }
 
 bool iface::is_local(const address& addr)
 {
-    // Check if the address is for an interface we own that is attached to
-    // one of the slave interfaces    
-    for (std::list<ptr<route> >::iterator ad = address::addresses_begin(); ad != address::addresses_end(); ad++)
-    {
-        if ((*ad)->addr() == addr)
-            return true;
-    }
-    return false;
+    return address::is_local(addr.const_addr());
 }
 
 bool iface::handle_local(const address& saddr, const address& taddr)
 {
     // Check if the address is for an interface we own that is attached to
-    // one of the slave interfaces    
-    for (std::list<ptr<route> >::iterator ad = address::addresses_begin(); ad != address::addresses_end(); ad++)
-    {
-        if ((*ad)->addr() == taddr)
-        {
-            // Loop through all the serves that are using this iface to respond to NDP solicitation requests
-            for (std::list<weak_ptr<proxy> >::iterator pit = serves_begin(); pit != serves_end(); pit++) {
-                ptr<proxy> pr = (*pit);
-                if (!pr) continue;
-                
-                for (std::list<ptr<rule> >::iterator it = pr->rules_begin(); it != pr->rules_end(); it++) {
-                    ptr<rule> ru = *it;
-
-                    if (ru->daughter() && ru->daughter()->name() == (*ad)->ifname())
-                    {
-                        logger::debug() << "proxy::handle_solicit() found local taddr=" << taddr;
-                        write_advert(saddr, taddr, false);
-                        return true;
-                    }
-                }
-            }
+    // one of the slave interfaces
+    const address::owner_vector* owners = address::find_local(taddr.const_addr());
+
+    if (!owners)
+        return false;
+
+    for (address::owner_vector::const_iterator it = owners->begin(); it != owners->end(); it++) {
+        if (std::find(_daughters.begin(), _daughters.end(), it->ifindex) != _daughters.end()) {
+            ND_DEBUG << "proxy::handle_solicit() found local taddr=" << taddr;
+            write_advert(saddr, taddr, false, stats::rx_time());
+            return true;
         }
     }
-    
+
     return false;
 }
 
+// What handle_reverse_advert() sends to the worker owning 'saddr'.
+struct reverse_advert_msg {
+    in6_addr saddr;
+
+    char ifname[IFNAMSIZ];
+};
+
 void iface::handle_reverse_advert(const address& saddr, const std::string& ifname)
 {
     if (!saddr.is_unicast())
         return;
+
+    // The solicit came to us because we own its target, but its sender
+    // is tracked by whoever owns that, so that's where the session has
+    // to be made.
+    if (!worker::owns(saddr.const_addr())) {
+        reverse_advert_msg msg;
+        memset(&msg, 0, sizeof(msg));
+
+        msg.saddr = saddr.const_addr();
+        strncpy(msg.ifname, ifname.c_str(), IFNAMSIZ - 1);
+
+        worker::send(worker::owner(saddr.const_addr()), &msg, sizeof(msg));
+        return;
+    }
     
-    logger::debug()
+    ND_DEBUG
         << "proxy::handle_reverse_advert()";
     
     // Loop through all the parents that forward new NDP soliciation requests to this interface
@@ -561,205 +939,331 @@ void iface::handle_reverse_advert(const address& saddr, const std::string& ifnam
         // Setup the reverse path on any proxies that are dealing
         // with the reverse direction (this helps improve connectivity and
         // latency in a full duplex setup)
-        for (std::list<ptr<rule> >::iterator it = parent->rules_begin(); it != parent->rules_end(); it++) {
-            ptr<rule> ru = *it;
-
-            if (ru->addr() == saddr &&
-                ru->daughter()->name() == ifname)
-            {
-                logger::debug() << " - generating artifical advertisement: " << ifname;
-                parent->handle_stateless_advert(saddr, saddr, ifname, ru->autovia());
-            }
+        ptr<rule> ru = parent->find_rule(saddr, ifname);
+
+        if (ru) {
+            ND_DEBUG << " - generating artifical advertisement: " << ifname;
+            parent->handle_stateless_advert(saddr, saddr, ifname, ru->autovia());
         }
     }
 }
 
-void iface::fixup_pollfds()
+void iface::handle_worker_message(const uint8_t* msg, size_t len)
 {
-    _pollfds.resize(_map.size()*  2);
+    reverse_advert_msg ra;
 
-    int i = 0;
+    if (len != sizeof(ra))
+        return;
 
-    logger::debug() << "iface::fixup_pollfds() _map.size()=" << _map.size();
+    memcpy(&ra, msg, sizeof(ra));
+    ra.ifname[IFNAMSIZ - 1] = 0;
 
-    for (std::map<std::string, weak_ptr<iface> >::iterator it = _map.begin();
-            it != _map.end(); it++) {
-        _pollfds[i].fd      = it->second->_ifd;
-        _pollfds[i].events  = POLLIN;
-        _pollfds[i].revents = 0;
-        i++;
+    std::map<std::string, weak_ptr<iface> >::iterator it = _map.find(ra.ifname);
 
-        _pollfds[i].fd      = it->second->_pfd;
-        _pollfds[i].events  = POLLIN;
-        _pollfds[i].revents = 0;
-        i++;
+    if ((it == _map.end()) || !it->second)
+        return;
+
+    ptr<iface> ifa = it->second;
+
+    ifa->handle_reverse_advert(address(ra.saddr), ifa->_name);
+}
+
+bool iface::join_fanout(int fd)
+{
+    int arg = worker::fanout_group(_ifindex) | (PACKET_FANOUT_CBPF << 16);
+
+    if (setsockopt(fd, SOL_PACKET, PACKET_FANOUT, &arg, sizeof(arg)) < 0) {
+        logger::error() << "Failed to join fanout group on interface '" << _name << "': " << logger::err();
+        return false;
     }
+
+    // The kernel runs the program on the packet as seen from the IPv6
+    // header, and hands it to the member at the index it returns
+    // (modulo the number of members). This must match worker::hash().
+    struct sock_filter prog[] = {
+        bpf_stmt(BPF_LD | BPF_W | BPF_ABS, FANOUT_TARGET_OFFSET + 8),
+        bpf_stmt(BPF_MISC | BPF_TAX, 0),
+        bpf_stmt(BPF_LD | BPF_W | BPF_ABS, FANOUT_TARGET_OFFSET + 12),
+        bpf_stmt(BPF_ALU | BPF_XOR | BPF_X, 0),
+        bpf_stmt(BPF_RET | BPF_A, 0)
+    };
+
+    struct sock_fprog fprog;
+    fprog.len    = sizeof(prog) / sizeof(prog[0]);
+    fprog.filter = prog;
+
+    if (setsockopt(fd, SOL_PACKET, PACKET_FANOUT_DATA, &fprog, sizeof(fprog)) < 0) {
+        logger::error() << "Failed to set fanout program on interface '" << _name << "': " << logger::err();
+        return false;
+    }
+
+    return true;
 }
 
-void iface::cleanup()
+void iface::filters_changed()
 {
+    _filters_dirty = true;
+}
+
+void iface::update_filters()
+{
+    if (!_filters_dirty)
+        return;
+
+    _filters_dirty = false;
+
     for (std::map<std::string, weak_ptr<iface> >::iterator it = _map.begin();
-            it != _map.end(); ) {
-        std::map<std::string, weak_ptr<iface> >::iterator c_it = it++;
-        if (!c_it->second) {
-            _map.erase(c_it);
-        }
+            it != _map.end(); it++) {
+        ptr<iface> ifa = it->second;
+
+        if (ifa && (ifa->_pfd >= 0))
+            ifa->update_filter();
     }
 }
 
-int iface::poll_all()
+static void collect_prefix(const in6_addr& addr, int len, bool& value, void* data)
 {
-    if (_map_dirty) {
-        cleanup();
-        fixup_pollfds();
-        _map_dirty = false;
-    }
+    std::vector<address>* prefixes = (std::vector<address>* )data;
 
-    if (_pollfds.size() == 0) {
-        ::sleep(1);
-        return 0;
-    }
+    // The walk visits a prefix before the ones it covers, so anything
+    // covered by the last prefix we kept can be left out.
+    if (!prefixes->empty() && (prefixes->back() == address(addr, 128)))
+        return;
+
+    prefixes->push_back(address(addr, len));
+}
 
-    assert(_pollfds.size() == _map.size()*  2);
+bool iface::update_filter()
+{
+    std::vector<struct sock_filter> prog;
 
-    int len;
+    // Same as the filter set up by open_pfd(), except that a match
+    // jumps past the "drop" at #6 to the target checks.
+    struct sock_filter head[] = {
+        BPF_STMT(BPF_LD | BPF_H | BPF_ABS,
+            offsetof(struct ether_header, ether_type)),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ETHERTYPE_IPV6, 0, 4),
+        BPF_STMT(BPF_LD | BPF_B | BPF_ABS,
+            sizeof(struct ether_header) + offsetof(struct ip6_hdr, ip6_nxt)),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, IPPROTO_ICMPV6, 0, 2),
+        BPF_STMT(BPF_LD | BPF_B | BPF_ABS,
+            sizeof(struct ether_header) + sizeof(ip6_hdr) + offsetof(struct icmp6_hdr, icmp6_type)),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ND_NEIGHBOR_SOLICIT, 1, 0),
+        BPF_STMT(BPF_RET | BPF_K, 0)
+    };
 
-    if ((len = ::poll(&_pollfds[0], _pollfds.size(), 50)) < 0) {
-        logger::error() << "Failed to poll interfaces: " << logger::err();
-        return -1;
+    prog.assign(head, head + sizeof(head) / sizeof(head[0]));
+
+    // Reverse adverts are generated from the source of any solicit, so
+    // if we're a daughter ourselves we need to see all of them.
+    bool filter_targets = _parents.empty();
+
+    prefix_trie<bool> targets;
+
+    for (std::list<weak_ptr<proxy> >::iterator pit = _serves.begin();
+            filter_targets && (pit != _serves.end()); pit++) {
+        ptr<proxy> pr = *pit;
+
+        if (!pr)
+            continue;
+
+        for (std::list<ptr<rule> >::iterator it = pr->rules_begin(); it != pr->rules_end(); it++) {
+            targets.insert((*it)->addr().const_addr(), (*it)->addr().prefix());
+        }
     }
 
-    if (len == 0) {
-        return 0;
+    for (std::vector<int>::iterator it = _daughters.begin(); it != _daughters.end(); it++) {
+        std::vector<in6_addr> locals;
+
+        address::find_locals(*it, locals);
+
+        for (std::vector<in6_addr>::iterator a_it = locals.begin(); a_it != locals.end(); a_it++) {
+            targets.insert(*a_it, 128);
+        }
     }
 
-    std::map<std::string, weak_ptr<iface> >::iterator i_it = _map.begin();
+    std::vector<address> prefixes;
+
+    targets.walk(&collect_prefix, &prefixes);
+
+    if (!prefixes.empty() && !prefixes.front().prefix())
+        filter_targets = false;
+
+    // One block per prefix: compare as many 32-bit words of the target
+    // as the prefix covers, falling through to the next block on the
+    // first mismatch, and jump to the "accept" at the end on a match.
+    size_t accept = prog.size();
+
+    for (std::vector<address>::iterator it = prefixes.begin();
+            filter_targets && (it != prefixes.end()); it++) {
+        int len = it->prefix(), words = (len + 31) / 32;
 
-    int i = 0;
+        size_t size = 1;
 
-    for (std::vector<struct pollfd>::iterator f_it = _pollfds.begin();
-            f_it != _pollfds.end(); f_it++) {
-        assert(i_it != _map.end());
+        for (int w = 0; w < words; w++)
+            size += (len - w * 32 < 32) ? 3 : 2;
 
-        if (i && !(i % 2)) {
-            i_it++;
+        size_t end = prog.size() + size;
+
+        for (int w = 0; w < words; w++) {
+            uint32_t mask = (len - w * 32 < 32) ? ~(0xffffffffU >> (len - w * 32)) : 0xffffffffU;
+
+            prog.push_back(bpf_stmt(BPF_LD | BPF_W | BPF_ABS, NS_TARGET_OFFSET + w * 4));
+
+            if (mask != 0xffffffffU)
+                prog.push_back(bpf_stmt(BPF_ALU | BPF_AND | BPF_K, mask));
+
+            uint32_t value = ntohl(it->const_addr().s6_addr32[w]) & mask;
+
+            // Jump to the next block if it's not a match.
+            prog.push_back(bpf_jump(BPF_JMP | BPF_JEQ | BPF_K, value, 0, end - prog.size() - 1));
         }
 
-        bool is_pfd = i++ % 2;
+        // Fixed up below, once we know where "accept" ends up.
+        prog.push_back(bpf_stmt(BPF_JMP | BPF_JA, 0));
+
+        accept = prog.size();
+    }
 
-        ptr<iface> ifa = i_it->second;
+    if (filter_targets) {
+        prog.push_back(bpf_stmt(BPF_RET | BPF_K, 0));
 
-        if (f_it->revents & POLLERR) {
-            logger::error() << "Error polling interface " << ifa->_name.c_str();
-            return -1;
+        accept = prog.size();
+
+        for (size_t i = 7; i < prog.size(); i++) {
+            if (prog[i].code == (BPF_JMP | BPF_JA))
+                prog[i].k = accept - i - 1;
         }
+    }
+
+    prog.push_back(bpf_stmt(BPF_RET | BPF_K, (u_int32_t)-1));
+
+    if (prog.size() > BPF_MAXINSNS) {
+        logger::warning()
+            << "Too many rules to filter solicits on interface '" << _name
+            << "' in the kernel";
+        prog.assign(head, head + sizeof(head) / sizeof(head[0]));
+        prog.push_back(bpf_stmt(BPF_RET | BPF_K, (u_int32_t)-1));
+        filter_targets = false;
+    }
+
+    struct sock_fprog fprog;
+
+    fprog.len    = prog.size();
+    fprog.filter = &prog[0];
+
+    // Attaching a new filter atomically replaces the old one.
+    if (setsockopt(_pfd, SOL_SOCKET, SO_ATTACH_FILTER, &fprog, sizeof(fprog)) < 0) {
+        logger::error() << "Failed to set filter on interface '" << _name << "': " << logger::err();
+        return false;
+    }
+
+    ND_DEBUG
+        << "iface::update_filter() " << _name << ": " << (filter_targets ? (int)prefixes.size() : 0)
+        << " target prefixes, " << (int)prog.size() << " instructions";
+
+    return true;
+}
+
+void iface::handle_io(reactor::watch* w, uint32_t events)
+{
+    // Hold on to the interface while we're working with it.
+    ptr<iface> ifa = ((iface* )w->data)->_ptr;
+
+    if (!ifa)
+        return;
+
+    if (events & EPOLLERR) {
+        int err = 0;
+        socklen_t len = sizeof(err);
+
+        // Fetching the error clears it, so we won't be woken up again
+        // for the same one.
+        getsockopt(w->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+        errno = err;
+
+        logger::error()
+            << "Error on interface '" << ifa->_name << "': " << logger::err();
+    }
+
+    if (!(events & EPOLLIN))
+        return;
+
+    int res = (w->role == PFD) ? ifa->read_solicits() : ifa->read_adverts();
+
+    if (res < 0) {
+        logger::error() << "Failed to read from interface '" << ifa->_name << "'";
+    }
+}
+
+void iface::handle_solicit(const address& saddr, const address& daddr, const address& taddr)
+{
+    // Process any local addresses for interfaces that we are proxying
+    if (handle_local(saddr, taddr) == true) {
+        return;
+    }
+    
+    // We have to handle all the parents who may be interested in
+    // the reverse path towards the one who sent this solicit.
+    // In fact, the parent need to know the source address in order
+    // to respond to NDP Solicitations
+    handle_reverse_advert(saddr, _name);
+
+    // Loop through all the proxies that are using this iface to respond to NDP solicitation requests
+    bool handled = false;
+    for (std::list<weak_ptr<proxy> >::iterator pit = serves_begin(); pit != serves_end(); pit++) {
+        // A weak reference is enough: proxy::remove() only runs from
+        // reload(), which the main loop defers until we've returned.
+        const weak_ptr<proxy>& pr = *pit;
+        if (!pr) continue;
+        
+        // Process the solicitation request by relating it to other
+        // interfaces or lookup up any statics routes we have configured
+        handled = true;
+        pr->handle_solicit(saddr, taddr, _name);
+    }
+    
+    // If it was not handled then write an error message
+    if (handled == false) {
+        ND_DEBUG << " - solicit was ignored";
+    }
+}
 
-        if (!(f_it->revents & POLLIN)) {
+void iface::handle_advert(const address& saddr, const address& taddr)
+{
+    // Process the NDP advert
+    bool handled = false;
+    for (std::list<weak_ptr<proxy> >::iterator pit = parents_begin(); pit != parents_end(); pit++) {
+        const weak_ptr<proxy>& pr = *pit;
+        if (!pr || !pr->ifa()) {
             continue;
         }
+        
+        // The proxy must have a rule for this interface or it is not meant to receive
+        // any notifications and thus they must be ignored
+        ptr<rule> ru = pr->find_rule(taddr, _name);
 
-        address saddr, daddr, taddr;
-        ssize_t size;
-
-        if (is_pfd) {
-            size = ifa->read_solicit(saddr, daddr, taddr);
-            if (size < 0) {
-                logger::error() << "Failed to read from interface '%s'", ifa->_name.c_str();
-                continue;
-            } 
-            if (size == 0) {
-                logger::debug() << "iface::read_solicit() loopback received and ignored";
-                continue;
-            }
-            
-            // Process any local addresses for interfaces that we are proxying
-            if (ifa->handle_local(saddr, taddr) == true) {
-                continue;
-            }
-            
-            // We have to handle all the parents who may be interested in
-            // the reverse path towards the one who sent this solicit.
-            // In fact, the parent need to know the source address in order
-            // to respond to NDP Solicitations
-            ifa->handle_reverse_advert(saddr, ifa->name());
-
-            // Loop through all the proxies that are using this iface to respond to NDP solicitation requests
-            bool handled = false;
-            for (std::list<weak_ptr<proxy> >::iterator pit = ifa->serves_begin(); pit != ifa->serves_end(); pit++) {
-                ptr<proxy> pr = (*pit);
-                if (!pr) continue;
-                
-                // Process the solicitation request by relating it to other
-                // interfaces or lookup up any statics routes we have configured
-                handled = true;
-                pr->handle_solicit(saddr, taddr, ifa->name());
-            }
-            
-            // If it was not handled then write an error message
-            if (handled == false) {
-                logger::debug() << " - solicit was ignored";
-            }
-            
-        } else {
-            size = ifa->read_advert(saddr, taddr);
-            if (size < 0) {
-                logger::error() << "Failed to read from interface '%s'", ifa->_name.c_str();
-                continue;
-            }
-            if (size == 0) {
-                logger::debug() << "iface::read_advert() loopback received and ignored";
-                continue;
-            }
-            
-            // Process the NDP advert
-            bool handled = false;
-            for (std::list<weak_ptr<proxy> >::iterator pit = ifa->parents_begin(); pit != ifa->parents_end(); pit++) {
-                ptr<proxy> pr = (*pit);
-                if (!pr || !pr->ifa()) {
-                    continue;
-                }
-                
-                // The proxy must have a rule for this interface or it is not meant to receive
-                // any notifications and thus they must be ignored
-                bool autovia = false;
-                bool is_relevant = false;
-                for (std::list<ptr<rule> >::iterator it = pr->rules_begin(); it != pr->rules_end(); it++) {
-                    ptr<rule> ru = *it;
-                    
-                    if (ru->addr() == taddr &&
-                        ru->daughter() &&
-                        ru->daughter()->name() == ifa->name())
-                    {
-                        is_relevant = true;
-                        autovia = ru->autovia();
-                        break;
-                    }
-                }
-                if (is_relevant == false) {
-                    logger::debug() << "iface::read_advert() advert is not for " << ifa->name() << "...skipping";
-                    continue;
-                }
-                
-                // Process the NDP advertisement
-                handled = true;
-                pr->handle_advert(saddr, taddr, ifa->name(), autovia);
-            }
-            
-            // If it was not handled then write an error message
-            if (handled == false) {
-                logger::debug() << " - advert was ignored";
-            }
+        if (!ru) {
+            ND_DEBUG << "iface::read_adverts() advert is not for " << _name << "...skipping";
+            continue;
         }
+        
+        // Process the NDP advertisement
+        handled = true;
+        pr->handle_advert(saddr, taddr, _name, ru->autovia());
+    }
+    
+    // If it was not handled then write an error message
+    if (handled == false) {
+        ND_DEBUG << " - advert was ignored";
     }
-
-    return 0;
 }
 
 int iface::allmulti(int state)
 {
     struct ifreq ifr;
 
-    logger::debug()
+    ND_DEBUG
         << "iface::allmulti() state="
         << state << ", _name=\"" << _name << "\"";
 
@@ -798,7 +1302,7 @@ int iface::promiscuous(int state)
 {
     struct ifreq ifr;
 
-    logger::debug()
+    ND_DEBUG
         << "iface::promiscuous() state="
         << state << ", _name=\"" << _name << "\"";
 
@@ -833,16 +1337,148 @@ int iface::promiscuous(int state)
     return old_state;
 }
 
+void iface::rx_batch(int n)
+{
+    _rx_batch = (n < 1) ? 1 : ((n > 1024) ? 1024 : n);
+}
+
+int iface::rx_batch()
+{
+    return _rx_batch;
+}
+
+void iface::rx_ring(bool enable)
+{
+    _rx_ring = enable;
+}
+
+bool iface::rx_ring()
+{
+    return _rx_ring;
+}
+
+void iface::busy_poll(int usec)
+{
+    _busy_poll = (usec < 0) ? 0 : usec;
+}
+
+int iface::busy_poll()
+{
+    return _busy_poll;
+}
+
+void iface::set_busy_poll(int fd, const std::string& name)
+{
+    if (!_busy_poll)
+        return;
+
+    if (setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &_busy_poll, sizeof(_busy_poll)) < 0) {
+        logger::warning() << "Failed to enable busy polling on interface '" << name << "': " << logger::err();
+        return;
+    }
+
+    // Only there since Linux 5.11, and busy polling works without it.
+    int on = 1;
+
+    if (setsockopt(fd, SOL_SOCKET, SO_PREFER_BUSY_POLL, &on, sizeof(on)) < 0)
+        ND_DEBUG << "iface::set_busy_poll() no SO_PREFER_BUSY_POLL on " << name << ": " << logger::err();
+}
+
+void iface::renew_rate(int rate, int burst)
+{
+    _renew_rate  = (rate < 0) ? 0 : rate;
+    _renew_burst = (burst < 1) ? 1 : burst;
+}
+
+int iface::renew_reserve(bool background)
+{
+    return background ? _renew_burst / 2 : 0;
+}
+
+void iface::take_renewal(bool background)
+{
+    if (_renew_rate)
+        _renew_bucket.take(_renew_rate, _renew_burst, timer::now(), renew_reserve(background));
+}
+
+int iface::renew_delay(bool background)
+{
+    if (!_renew_rate)
+        return 0;
+
+    if (_renew_bucket.available(_renew_rate, _renew_burst, timer::now(), renew_reserve(background)))
+        return 0;
+
+    stats::inc(stats::RENEWALS_DEFERRED);
+
+    // Come back once a token or a few should be in, at a random point
+    // in that window so the sessions turned away now don't all return
+    // together.
+    int gap = 1000 / _renew_rate;
+
+    if (gap < 1)
+        gap = 1;
+
+    if (background)
+        gap *= 4;
+
+    return gap + rand() % gap;
+}
+
+void iface::max_probes(int n)
+{
+    _max_probes = (n < 0) ? 0 : n;
+}
+
+int iface::max_probes()
+{
+    return _max_probes;
+}
+
+bool iface::take_probe()
+{
+    if (_max_probes && (_probes >= _max_probes)) {
+        stats::inc(stats::PROBES_DEFERRED);
+        return false;
+    }
+
+    _probes++;
+    return true;
+}
+
+void iface::release_probe()
+{
+    if (_probes > 0)
+        _probes--;
+}
+
 const std::string& iface::name() const
 {
     return _name;
 }
 
+int iface::ifindex() const
+{
+    return _ifindex;
+}
+
 void iface::add_serves(const ptr<proxy>& pr)
 {
     _serves.push_back(pr);
 }
 
+void iface::remove_serves(const ptr<proxy>& pr)
+{
+    for (std::list<weak_ptr<proxy> >::iterator it = _serves.begin(); it != _serves.end(); ) {
+        if (!*it || (*it == pr))
+            it = _serves.erase(it);
+        else
+            it++;
+    }
+
+    filters_changed();
+}
+
 std::list<weak_ptr<proxy> >::iterator iface::serves_begin()
 {
     return _serves.begin();
@@ -853,9 +1489,49 @@ std::list<weak_ptr<proxy> >::iterator iface::serves_end()
     return _serves.end();
 }
 
+void iface::add_daughter(const ptr<iface>& ifa)
+{
+    if (std::find(_daughters.begin(), _daughters.end(), ifa->ifindex()) == _daughters.end())
+        _daughters.push_back(ifa->ifindex());
+}
+
+void iface::update_daughters()
+{
+    _daughters.clear();
+
+    for (std::list<weak_ptr<proxy> >::iterator pit = _serves.begin(); pit != _serves.end(); pit++) {
+        ptr<proxy> pr = *pit;
+
+        if (!pr)
+            continue;
+
+        for (std::list<ptr<rule> >::iterator it = pr->rules_begin(); it != pr->rules_end(); it++) {
+            if ((*it)->daughter())
+                add_daughter((*it)->daughter());
+        }
+    }
+
+    filters_changed();
+}
+
 void iface::add_parent(const ptr<proxy>& pr)
 {
-    _parents.push_back(pr);
+    if (std::find(_parents.begin(), _parents.end(), pr) == _parents.end())
+        _parents.push_back(pr);
+
+    filters_changed();
+}
+
+void iface::remove_parent(const ptr<proxy>& pr)
+{
+    for (std::list<weak_ptr<proxy> >::iterator it = _parents.begin(); it != _parents.end(); ) {
+        if (!*it || (*it == pr))
+            it = _parents.erase(it);
+        else
+            it++;
+    }
+
+    filters_changed();
 }
 
 std::list<weak_ptr<proxy> >::iterator iface::parents_begin()
@@ -20,10 +20,15 @@
 #include <vector>
 #include <map>
 
-#include <sys/poll.h>
+#include <stdint.h>
+
+#include <sys/socket.h>
 #include <net/ethernet.h>
 
 #include "ndppd.h"
+#include "addr_map.h"
+#include "reactor.h"
+#include "limiter.h"
 
 NDPPD_NS_BEGIN
 
@@ -40,58 +45,250 @@ public:
 
     static ptr<iface> open_pfd(const std::string& name, bool promiscuous);
 
-    static int poll_all();
+    // Called for each message a socketless interface would have sent.
+    typedef void (*tx_hook)(iface* ifa, const address& daddr, const uint8_t* msg, size_t len);
+
+    // Opens an interface with no sockets behind it, so the packet
+    // handling can be driven without a kernel. Frames are fed in with
+    // handle_solicit_frame() and handle_advert(), and whatever would be
+    // sent is handed to 'fn' on flush(). Used by the benchmark.
+    static ptr<iface> open_fake(const std::string& name, int ifindex, tx_hook fn);
+
+    // Parses a frame from _pfd and handles it.
+    void handle_solicit_frame(const uint8_t* msg, size_t len);
+
+    // Queues a message to be sent to 'daddr' through the _ifd socket
+    // on the next flush(). If 'since' is set, the time from then until
+    // the message is sent is recorded as a response latency.
+    ssize_t write(const address& daddr, const uint8_t* msg, size_t size, int64_t since = 0);
+
+    // Queues a NB_NEIGHBOR_SOLICIT for 'taddr' on the _ifd socket, sent
+    // to its solicited-node multicast group, or unicast to 'daddr' if
+    // that's set. A second solicit for the same target before the next
+    // flush() is dropped.
+    ssize_t write_solicit(const address& taddr, const address& daddr = address());
+
+    // Queues a NB_NEIGHBOR_ADVERT message for the _ifd socket. 'since'
+    // is when the solicit it answers arrived, if it answers one.
+    ssize_t write_advert(const address& daddr, const address& taddr, bool router, int64_t since = 0);
+
+    // Sends every message queued on this interface with sendmmsg().
+    // Returns the number of messages sent.
+    int flush();
+
+    // Flushes every interface that has queued messages.
+    static void flush_all();
 
-    ssize_t read(int fd, struct sockaddr* saddr, ssize_t saddr_size, uint8_t* msg, size_t size);
+    // Notes that the rules or local addresses the solicit filters are
+    // built from have changed.
+    static void filters_changed();
 
-    ssize_t write(int fd, const address& daddr, const uint8_t* msg, size_t size);
+    // Regenerates the filter on every PF_PACKET socket if anything
+    // changed since the last call.
+    static void update_filters();
 
-    // Writes a NB_NEIGHBOR_SOLICIT message to the _ifd socket.
-    ssize_t write_solicit(const address& taddr);
+    // Reads and handles up to rx_batch() NB_NEIGHBOR_SOLICIT messages
+    // from the _pfd socket. Returns the number of messages read, or -1.
+    int read_solicits();
 
-    // Writes a NB_NEIGHBOR_ADVERT message to the _ifd socket;
-    ssize_t write_advert(const address& daddr, const address& taddr, bool router);
+    // Reads and handles up to rx_batch() NB_NEIGHBOR_ADVERT messages
+    // from the _ifd socket. Returns the number of messages read, or -1.
+    int read_adverts();
 
-    // Reads a NB_NEIGHBOR_SOLICIT message from the _pfd socket.
-    ssize_t read_solicit(address& saddr, address& daddr, address& taddr);
+    // Handles a NB_NEIGHBOR_SOLICIT message received on _pfd.
+    void handle_solicit(const address& saddr, const address& daddr, const address& taddr);
 
-    // Reads a NB_NEIGHBOR_ADVERT message from the _ifd socket;
-    ssize_t read_advert(address& saddr, address& taddr);
+    // Handles a NB_NEIGHBOR_ADVERT message received on _ifd.
+    void handle_advert(const address& saddr, const address& taddr);
     
     bool handle_local(const address& saddr, const address& taddr);
     
     bool is_local(const address& addr);
     
+    // Lets the proxies behind this interface learn that 'saddr' can be
+    // reached through 'ifname'. With workers, this is handed to the
+    // worker solicits for 'saddr' go to.
     void handle_reverse_advert(const address& saddr, const std::string& ifname);
 
+    // Handles a reverse advert another worker handed to us.
+    static void handle_worker_message(const uint8_t* msg, size_t len);
+
     // Returns the name of the interface.
     const std::string& name() const;
+
+    // Returns the kernel's index for this interface.
+    int ifindex() const;
     
     std::list<weak_ptr<proxy> >::iterator serves_begin();
     
     std::list<weak_ptr<proxy> >::iterator serves_end();
     
     void add_serves(const ptr<proxy>& proxy);
+
+    void remove_serves(const ptr<proxy>& proxy);
     
     std::list<weak_ptr<proxy> >::iterator parents_begin();
     
     std::list<weak_ptr<proxy> >::iterator parents_end();
     
     void add_parent(const ptr<proxy>& parent);
+
+    void remove_parent(const ptr<proxy>& parent);
+
+    // Marks 'ifa' as the daughter of a rule of a proxy we serve, so
+    // solicits for its own addresses are answered right away.
+    void add_daughter(const ptr<iface>& ifa);
+
+    // Rebuilds the daughters from the rules of the proxies we serve,
+    // after some of them have been replaced.
+    void update_daughters();
     
     static std::map<std::string, weak_ptr<iface> > _map;
 
+    // Sets the maximum number of messages to read from a socket each
+    // time it becomes readable.
+    static void rx_batch(int n);
+
+    static int rx_batch();
+
+    // Controls whether PF_PACKET sockets opened from now on receive
+    // through a memory-mapped TPACKET_V3 ring instead of recvmmsg().
+    static void rx_ring(bool enable);
+
+    static bool rx_ring();
+
+    // Sets SO_BUSY_POLL, and SO_PREFER_BUSY_POLL where the kernel has
+    // it, on the sockets opened from now on, so reads poll the device
+    // for up to 'usec' microseconds instead of waiting for an interrupt.
+    // 0 turns it off.
+    static void busy_poll(int usec);
+
+    static int busy_poll();
+
+    // Limits how many renewing solicits each interface sends per second,
+    // with room for bursts of up to 'burst'. 0 means no limit.
+    static void renew_rate(int rate, int burst);
+
+    // Returns 0 if a renewing solicit may go out through this interface
+    // now, or how many milliseconds to wait before asking again. This
+    // doesn't take the slot; take_renewal() does. 'background' renewals,
+    // of sessions nobody asked about lately, leave half the burst to the
+    // others and wait longer.
+    int renew_delay(bool background);
+
+    // Takes the slot renew_delay() said was free.
+    void take_renewal(bool background);
+
+    // Limits how many targets may be looked for through each interface
+    // at once. 0 means no limit.
+    static void max_probes(int n);
+
+    static int max_probes();
+
+    // Takes one of the probe slots above. Returns false if they're all
+    // in use.
+    bool take_probe();
+
+    void release_probe();
+
 private:
 
-    static bool _map_dirty;
+    static int _rx_batch;
+
+    static bool _rx_ring;
+
+    static int _busy_poll;
+
+    // Applies busy_poll() to 'fd'.
+    static void set_busy_poll(int fd, const std::string& name);
+
+    static int _renew_rate, _renew_burst;
+
+    // How many tokens a renewal must leave in _renew_bucket.
+    static int renew_reserve(bool background);
 
-    // An array of objects used with ::poll.
-    static std::vector<struct pollfd> _pollfds;
+    token_bucket _renew_bucket;
 
-    // Updates the array above.
-    static void fixup_pollfds();
+    static int _max_probes;
 
-    static void cleanup();
+    // Sessions waiting for an answer through this interface.
+    int _probes;
+
+    // Receive buffers shared by every interface.
+    static std::vector<uint8_t> _rx_buf;
+
+    static std::vector<struct mmsghdr> _rx_msgs;
+
+    static std::vector<struct iovec> _rx_iovs;
+
+    static std::vector<struct sockaddr_storage> _rx_names;
+
+    // Receives up to rx_batch() messages from 'fd' into the buffers
+    // above. Returns the number of messages, or -1.
+    int read_batch(int fd);
+
+    struct tx_msg {
+        struct sockaddr_in6 daddr;
+
+        size_t len;
+
+        int64_t since;
+
+        uint8_t buf[64];
+    };
+
+    // Messages waiting for the next flush().
+    std::vector<tx_msg> _tx_queue;
+
+    // Targets of the solicits in _tx_queue.
+    addr_map<bool> _tx_solicits;
+
+    // Where socketless interfaces send their messages.
+    tx_hook _tx_hook;
+
+    // Interfaces with a non-empty _tx_queue.
+    static std::vector<weak_ptr<iface> > _tx_pending;
+
+    // Message headers shared by every flush().
+    static std::vector<struct mmsghdr> _tx_msgs;
+
+    static std::vector<struct iovec> _tx_iovs;
+
+    // Prebuilt NB_NEIGHBOR_SOLICIT and NB_NEIGHBOR_ADVERT messages
+    // carrying our link-layer address. Only the target and flags need
+    // to be filled in before sending.
+    uint8_t _ns_template[32], _na_template[32];
+
+    void build_templates();
+
+    static bool _filters_dirty;
+
+    // Attaches a filter to _pfd that only lets through solicits for
+    // targets covered by one of our rules, or owned by one of our
+    // daughters. Falls back to accepting every solicit if that's not
+    // possible.
+    bool update_filter();
+
+    // Joins 'fd' to the fanout group the workers share for this
+    // interface.
+    bool join_fanout(int fd);
+
+    // Sets up the TPACKET_V3 ring on 'fd'.
+    bool open_ring(int fd);
+
+    // Unmaps the ring, if there is one.
+    void close_ring();
+
+    // Handles every frame the kernel has handed over in the ring.
+    int read_ring();
+
+    // Which of our sockets a reactor::watch belongs to.
+    enum {
+        IFD, PFD
+    };
+
+    // Called by the reactor when _ifd or _pfd is readable.
+    static void handle_io(reactor::watch* w, uint32_t events);
 
     // Weak pointer so this object can reference itself.
     weak_ptr<iface> _ptr;
@@ -104,6 +301,18 @@ private:
     // NB_NEIGHBOR_SOLICIT messages.
     int _pfd;
 
+    // Registrations of _ifd and _pfd with the reactor.
+    reactor::watch _ifd_watch, _pfd_watch;
+
+    // The receive ring mapped from _pfd, or NULL if rx_ring() was off.
+    uint8_t* _ring;
+
+    // Size of each block in the ring, and the number of blocks.
+    size_t _ring_block_size, _ring_blocks;
+
+    // The next block to check for frames.
+    size_t _ring_next;
+
     // Previous state of ALLMULTI for the interface.
     int _prev_allmulti;
     
@@ -112,11 +321,17 @@ private:
 
     // Name of this interface.
     std::string _name;
+
+    // Index of this interface.
+    int _ifindex;
     
     std::list<weak_ptr<proxy> > _serves;
     
     std::list<weak_ptr<proxy> > _parents;
 
+    // Indexes of the interfaces passed to add_daughter().
+    std::vector<int> _daughters;
+
     // The link-layer address of this interface.
     struct ether_addr hwaddr;
 
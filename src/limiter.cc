@@ -0,0 +1,111 @@
+// ndppd - NDP Proxy Daemon
+// Copyright (C) 2011  Daniel Adolfsson <daniel@priv.nu>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+#include "ndppd.h"
+#include "limiter.h"
+
+NDPPD_NS_BEGIN
+
+// Number of buckets in each limiter.
+static const size_t LIMITER_SLOTS = 1024;
+
+token_bucket::token_bucket() :
+    _tokens(-1), _stamp(0)
+{
+}
+
+bool token_bucket::take(int rate, int burst, int64_t now, int reserve)
+{
+    if (!available(rate, burst, now, reserve))
+        return false;
+
+    _tokens -= 1000;
+    return true;
+}
+
+bool token_bucket::available(int rate, int burst, int64_t now, int reserve)
+{
+    int64_t max = (int64_t)burst * 1000;
+
+    if (_tokens < 0) {
+        _tokens = max;
+    } else if (now > _stamp) {
+        _tokens += (now - _stamp) * rate;
+
+        if (_tokens > max)
+            _tokens = max;
+    }
+
+    _stamp = now;
+
+    return _tokens >= ((int64_t)reserve + 1) * 1000;
+}
+
+limiter::limiter() :
+    _rate(0), _burst(0), _prefix(64), _drops(0)
+{
+}
+
+void limiter::configure(int rate, int burst, int prefix)
+{
+    rate   = (rate < 0) ? 0 : rate;
+    burst  = (burst < 1) ? 1 : burst;
+    prefix = (prefix < 0) ? 0 : (prefix > 128) ? 128 : prefix;
+
+    if ((rate == _rate) && (burst == _burst) && (prefix == _prefix))
+        return;
+
+    _rate   = rate;
+    _burst  = burst;
+    _prefix = prefix;
+
+    _buckets.reset(_rate ? LIMITER_SLOTS : 0);
+}
+
+bool limiter::enabled() const
+{
+    return _rate != 0;
+}
+
+bool limiter::admit(const in6_addr& addr, int64_t now)
+{
+    if (!_rate)
+        return true;
+
+    in6_addr key = addr;
+
+    for (int i = 0; i < 16; i++) {
+        int bits = _prefix - i * 8;
+
+        if (bits <= 0) {
+            key.s6_addr[i] = 0;
+        } else if (bits < 8) {
+            key.s6_addr[i] &= (uint8_t)(0xff << (8 - bits));
+        }
+    }
+
+    if (_buckets.insert(key, now).take(_rate, _burst, now))
+        return true;
+
+    _drops++;
+    return false;
+}
+
+uint64_t limiter::drops() const
+{
+    return _drops;
+}
+
+NDPPD_NS_END
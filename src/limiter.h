@@ -0,0 +1,77 @@
+// ndppd - NDP Proxy Daemon
+// Copyright (C) 2011  Daniel Adolfsson <daniel@priv.nu>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+#pragma once
+
+#include <stdint.h>
+
+#include <netinet/in.h>
+
+#include "ndppd.h"
+#include "addr_cache.h"
+
+NDPPD_NS_BEGIN
+
+// A token bucket holding up to 'burst' tokens, refilled at 'rate'
+// tokens per second. Tokens are kept in thousandths so that rates
+// below one per millisecond still refill smoothly.
+
+class token_bucket {
+public:
+    token_bucket();
+
+    // Takes a token if one is available, and 'reserve' more are left
+    // for others. The bucket starts out full.
+    bool take(int rate, int burst, int64_t now, int reserve = 0);
+
+    // Returns true if take() would succeed, without taking anything.
+    bool available(int rate, int burst, int64_t now, int reserve = 0);
+
+private:
+    int64_t _tokens;
+
+    int64_t _stamp;
+};
+
+// A set of token buckets, one for each source prefix, kept in a
+// fixed-size addr_cache so the amount of memory used doesn't depend on
+// how many sources we see.
+
+class limiter {
+public:
+    limiter();
+
+    // Sets how many tokens each source gets per second, how many it
+    // may save up, and the length of the prefix sources are grouped by.
+    // A rate of 0 disables the limiter.
+    void configure(int rate, int burst, int prefix);
+
+    bool enabled() const;
+
+    // Takes a token from the bucket of the prefix 'addr' belongs to.
+    // Returns false, and counts a drop, if there was none.
+    bool admit(const in6_addr& addr, int64_t now);
+
+    uint64_t drops() const;
+
+private:
+    addr_cache<token_bucket> _buckets;
+
+    int _rate, _burst, _prefix;
+
+    uint64_t _drops;
+};
+
+NDPPD_NS_END
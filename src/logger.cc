@@ -19,6 +19,7 @@
 #include <cstdlib>
 #include <cstring>
 #include <cerrno>
+#include <algorithm>
 #include <iostream>
 #include <sstream>
 
@@ -43,6 +44,24 @@ int logger::_max_pri = LOG_NOTICE;
 
 bool logger::_syslog = false;
 
+std::vector<char> logger::_ring;
+
+size_t logger::_head;
+
+size_t logger::_tail;
+
+size_t logger::_used;
+
+bool logger::_buffered = false;
+
+unsigned logger::_dropped;
+
+// Size of the ring buffer messages are queued in while buffered.
+static const size_t RING_SIZE = 1 << 18;
+
+// Longest message we'll queue; anything beyond is cut off.
+static const size_t MAX_MESSAGE = 4096;
+
 const logger::pri_name logger::_pri_names[] = {
     { "emergency",  LOG_EMERG   },
     { "alert",      LOG_ALERT   },
@@ -156,16 +175,102 @@ void logger::flush()
     if (!_force_log && (_pri > _max_pri))
         return;
 
+    std::string msg = _ss.str();
+    _ss.str("");
+
+    if (!_buffered) {
+        write(_pri, msg);
+        return;
+    }
+
+    if (msg.size() > MAX_MESSAGE)
+        msg.resize(MAX_MESSAGE);
+
+    if (RING_SIZE - _used < msg.size() + 3) {
+        _dropped++;
+        return;
+    }
+
+    char hdr[3] = {
+        (char)_pri, (char)(msg.size() >> 8), (char)(msg.size() & 0xff)
+    };
+
+    ring_put(hdr, 3);
+    ring_put(msg.data(), msg.size());
+}
+
+void logger::write(int pri, const std::string& msg)
+{
 #ifndef DISABLE_SYSLOG
     if (_syslog) {
-        ::syslog(_pri, "(%s) %s", _pri_names[_pri].name, _ss.str().c_str());
+        ::syslog(pri, "(%s) %s", _pri_names[pri].name, msg.c_str());
         return;
     }
 #endif
 
-    std::cout << "(" << _pri_names[_pri].name << ") " << _ss.str() << std::endl;
+    std::cout << "(" << _pri_names[pri].name << ") " << msg << std::endl;
+}
+
+void logger::ring_put(const char* data, size_t len)
+{
+    size_t n = std::min(len, RING_SIZE - _head);
 
-    _ss.str("");
+    memcpy(&_ring[_head], data, n);
+    memcpy(&_ring[0], data + n, len - n);
+
+    _head  = (_head + len) % RING_SIZE;
+    _used += len;
+}
+
+void logger::ring_get(char* data, size_t len)
+{
+    size_t n = std::min(len, RING_SIZE - _tail);
+
+    memcpy(data, &_ring[_tail], n);
+    memcpy(data + n, &_ring[0], len - n);
+
+    _tail  = (_tail + len) % RING_SIZE;
+    _used -= len;
+}
+
+void logger::buffered(bool enable)
+{
+    if (enable && _ring.empty())
+        _ring.resize(RING_SIZE);
+
+    if (!enable)
+        drain();
+
+    _buffered = enable;
+}
+
+void logger::drain()
+{
+    if (!_used && !_dropped)
+        return;
+
+    std::string msg;
+
+    while (_used) {
+        unsigned char hdr[3];
+
+        ring_get((char* )hdr, 3);
+
+        msg.resize((hdr[1] << 8) | hdr[2]);
+
+        if (!msg.empty())
+            ring_get(&msg[0], msg.size());
+
+        write(hdr[0], msg);
+    }
+
+    if (_dropped) {
+        std::ostringstream ss;
+        ss << _dropped << " log messages were dropped";
+        _dropped = 0;
+
+        write(LOG_WARNING, ss.str());
+    }
 }
 
 #ifndef DISABLE_SYSLOG
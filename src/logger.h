@@ -16,6 +16,7 @@
 #pragma once
 
 #include <sstream>
+#include <vector>
 
 #ifndef DISABLE_SYSLOG
 #   include <syslog.h>
@@ -47,6 +48,20 @@ public:
 
     static void max_pri(int pri);
 
+    // Returns true if messages of priority 'pri' make it out.
+    static bool enabled(int pri)
+    {
+        return pri <= _max_pri;
+    }
+
+    // While buffered, messages are queued in a ring buffer rather than
+    // written out right away, so logging doesn't stall whatever we're
+    // in the middle of. Turning it off writes out what's queued.
+    static void buffered(bool enable);
+
+    // Writes out the messages queued while buffered.
+    static void drain();
+
     void flush();
 
     static bool verbosity(const std::string& name);
@@ -91,7 +106,42 @@ private:
 
     static int _max_pri;
 
+    // Queued messages, each stored as a priority byte, a two-byte
+    // length and the text. _head is where the next message goes, and
+    // _tail where the oldest one starts.
+    static std::vector<char> _ring;
+
+    static size_t _head, _tail, _used;
+
+    static bool _buffered;
+
+    // Number of messages that didn't fit since the last drain().
+    static unsigned _dropped;
+
+    static void ring_put(const char* data, size_t len);
 
+    static void ring_get(char* data, size_t len);
+
+    static void write(int pri, const std::string& msg);
 };
 
+// Logs a message at 'pri', without evaluating any of the arguments if
+// that priority is filtered out:
+//
+//     ND_LOG(LOG_INFO) << "taddr=" << taddr;
+//
+// Expands to a single statement, so it's safe as the body of an
+// unbraced if/else.
+#define ND_LOG(pri) \
+    for (bool nd_log_once_ = ::ndppd::logger::enabled(pri); nd_log_once_; nd_log_once_ = false) \
+        ::ndppd::logger(pri)
+
+// Debug messages, which NDPPD_NO_DEBUG_LOG leaves out of the binary
+// altogether.
+#ifdef NDPPD_NO_DEBUG_LOG
+#   define ND_DEBUG for (bool nd_log_once_ = false; nd_log_once_; ) ::ndppd::logger(LOG_DEBUG)
+#else
+#   define ND_DEBUG ND_LOG(LOG_DEBUG)
+#endif
+
 NDPPD_NS_END
@@ -19,140 +19,177 @@
 #include <sys/socket.h>
 #include <errno.h>
 #include <netlink/route/addr.h>
+#include <netlink/route/route.h>
+#include <netlink/route/neighbour.h>
 #include <arpa/inet.h>
+#include <net/if.h>
 #include "ndppd.h"
-#include <algorithm>
+#include "route.h"
+#include "addr_map.h"
+#include "stats.h"
+#include <map>
 
 NDPPD_NS_BEGIN
 
-pthread_mutex_t cs_mutex = PTHREAD_MUTEX_INITIALIZER;
+// Addresses assigned to one of the interfaces our rules refer to.
+class if_addrs {
+public:
+    std::string name;
 
-struct in6_addr*
-address_create_ipv6(struct in6_addr *local)
+    addr_map<bool> addrs;
+
+    // Neighbours the kernel has a link-layer address for, if the
+    // neighbour table is mirrored.
+    addr_map<bool> neighs;
+};
+
+// Keyed by interface index, which is what netlink reports.
+static std::map<int, ptr<if_addrs> > if_table;
+
+void
+if_add_to_list(const ptr<iface>& ifa)
 {
-    struct in6_addr *addr = (struct in6_addr *)calloc(1, sizeof(struct in6_addr));
-    memcpy(addr, local, sizeof(struct in6_addr));
-    return addr;
+    if (ifa->ifindex() <= 0 || if_table.count(ifa->ifindex()))
+        return;
+
+    ND_DEBUG << "rule::add_iface() if=" << ifa->name();
+
+    ptr<if_addrs> ia(new if_addrs());
+    ia->name = ifa->name();
+    if_table[ifa->ifindex()] = ia;
 }
 
-void if_add_to_list(int ifindex, const ptr<iface>& ifa)
+static if_addrs *
+if_lookup(int ifindex)
 {
-    bool found = false;
-
-    pthread_mutex_lock (&cs_mutex);
-    for (std::vector<interface>::iterator it = interfaces.begin();
-            it != interfaces.end(); it++) {
-        if ((*it).ifindex == ifindex) {
-            found = true;
-            break;
-        }
-    }
-    if (!found) {
-        logger::debug() << "rule::add_iface() if=" << ifa->name();
-        interface anInterface;
-        anInterface._name = ifa->name();
-        anInterface.ifindex = ifindex;
-        interfaces.push_back(anInterface);
-    }
-    pthread_mutex_unlock (&cs_mutex);
+    std::map<int, ptr<if_addrs> >::iterator it = if_table.find(ifindex);
+
+    return (it != if_table.end()) ? it->second.get_pointer() : NULL;
 }
 
-void
-if_addr_add(int ifindex, struct in6_addr *iaddr)
+static void
+if_addr_add(int ifindex, const struct in6_addr& iaddr)
 {
-    pthread_mutex_lock (&cs_mutex);
-    for (std::vector<interface>::iterator it = interfaces.begin();
-         it != interfaces.end(); it++) {
-        if ((*it).ifindex == ifindex) {
-            address addr = address(*iaddr);
-            logger::debug() << "Adding addr " << addr.to_string();
-            std::list<address>::iterator it_addr;
-            it_addr = std::find((*it).addresses.begin(), (*it).addresses.end(), addr);
-            if (it_addr == (*it).addresses.end()) {
-                (*it).addresses.push_back(addr);
-            }
-            break;
-        }
+    address::add_local(iaddr, ifindex);
+
+    if (if_addrs *ia = if_lookup(ifindex)) {
+        ND_DEBUG << "Adding addr " << address(iaddr).to_string();
+        ia->addrs.insert(iaddr) = true;
     }
-    free(iaddr);
-    pthread_mutex_unlock (&cs_mutex);
 }
 
-void
-if_addr_del(int ifindex, struct in6_addr *iaddr)
+static void
+if_addr_del(int ifindex, const struct in6_addr& iaddr)
 {
-    pthread_mutex_lock (&cs_mutex);
-    for (std::vector<interface>::iterator it = interfaces.begin();
-         it != interfaces.end(); it++) {
-        if ((*it).ifindex == ifindex) {
-            address addr = address(*iaddr);
-            logger::debug() << "Deleting addr " << addr.to_string();
-            (*it).addresses.remove(addr);
-            break;
-        }
+    address::remove_local(iaddr, ifindex);
+
+    if (if_addrs *ia = if_lookup(ifindex)) {
+        ND_DEBUG << "Deleting addr " << address(iaddr).to_string();
+        ia->addrs.erase(iaddr);
     }
-    free(iaddr);
-    pthread_mutex_unlock (&cs_mutex);
 }
 
 bool
-if_addr_find(std::string iface, const struct in6_addr *iaddr)
+if_addr_find(int ifindex, const struct in6_addr& iaddr)
 {
-    bool found = false;
-
-    pthread_mutex_lock (&cs_mutex);
-    for (std::vector<interface>::iterator it = interfaces.begin();
-         it != interfaces.end(); it++) {
-        if (iface.compare((*it)._name) == 0) {
-            address addr = address(*iaddr);
-            std::list<address>::iterator it_addr;
-            it_addr = std::find((*it).addresses.begin(), (*it).addresses.end(), addr);
-            if (it_addr != (*it).addresses.end()) {
-                found = true;
-                break;
-            }
-        }
-    }
-    pthread_mutex_unlock (&cs_mutex);
-    return found;
+    if_addrs *ia = if_lookup(ifindex);
+
+    return ia && ia->addrs.find(iaddr);
 }
 
+// the states in which the kernel has a usable link-layer address
+static const int NEIGH_KNOWN = NUD_REACHABLE | NUD_STALE | NUD_DELAY | NUD_PROBE | NUD_PERMANENT;
+
+static bool neigh_watched;
+
 static void
-nl_msg_newaddr(struct nlmsghdr *hdr)
+neigh_changed(int ifindex, const struct in6_addr& naddr, int state, bool add)
 {
-    struct ifaddrmsg *ifaddr =
-        (struct ifaddrmsg *)(((char *) hdr) + (sizeof(struct nlmsghdr)));
-    // parse the attributes
-    struct nlattr *attrs[IFA_MAX + 1];
-    struct nlattr *s = (struct nlattr *)(((char *) ifaddr) + (sizeof(struct ifaddrmsg)));
-    int len = nlmsg_datalen(hdr) - sizeof(struct ifinfomsg);
-    memset(&attrs, '\0', sizeof(attrs));
-    nla_parse(attrs, IFA_MAX, s, len, NULL);
+    if_addrs *ia = if_lookup(ifindex);
 
-    struct in6_addr* addr = NULL;
+    if (!ia)
+        return;
 
-    if (ifaddr->ifa_family == AF_INET6) {
-        addr = address_create_ipv6((struct in6_addr *)nla_data(attrs[IFA_ADDRESS]));
-        if_addr_add(ifaddr->ifa_index, addr);
+    if (add && (state & NEIGH_KNOWN)) {
+        ia->neighs.insert(naddr) = true;
+        return;
+    }
+
+    ia->neighs.erase(naddr);
+
+    // the kernel gave up on it, so there's no point in us trying
+    if (add && (state & NUD_FAILED)) {
+        ND_DEBUG << "Kernel failed to resolve " << address(naddr).to_string() << " on " << ia->name;
+        proxy::neigh_failed(naddr, ia->name);
     }
 }
 
+bool
+if_neigh_find(int ifindex, const struct in6_addr& naddr)
+{
+    if_addrs *ia = if_lookup(ifindex);
+
+    return ia && ia->neighs.find(naddr);
+}
+
 static void
-nl_msg_deladdr(struct nlmsghdr *hdr)
+nl_msg_neigh(struct nlmsghdr *hdr)
 {
-    struct ifaddrmsg *ifaddr =
-        (struct ifaddrmsg *)(((char *) hdr) + (sizeof(struct nlmsghdr)));
+    struct ndmsg *nd = (struct ndmsg *) nlmsg_data(hdr);
+    struct nlattr *attrs[NDA_MAX + 1];
+
+    if (nd->ndm_family != AF_INET6)
+        return;
+
+    if (nlmsg_parse(hdr, sizeof(struct ndmsg), attrs, NDA_MAX, NULL) < 0)
+        return;
+
+    if (!attrs[NDA_DST] || (nla_len(attrs[NDA_DST]) < (int) sizeof(struct in6_addr)))
+        return;
+
+    neigh_changed(nd->ndm_ifindex, *(const struct in6_addr *) nla_data(attrs[NDA_DST]),
+                  nd->ndm_state, hdr->nlmsg_type == RTM_NEWNEIGH);
+}
+
+static void
+new_neigh(struct nl_object *obj, void *p)
+{
+    struct rtnl_neigh *neigh = (struct rtnl_neigh *) obj;
+    struct nl_addr *dst = rtnl_neigh_get_dst(neigh);
+
+    if ((rtnl_neigh_get_family(neigh) != AF_INET6) || !dst ||
+        (nl_addr_get_len(dst) < sizeof(struct in6_addr)))
+        return;
+
+    // a failed entry left over from before we started says little
+    int state = rtnl_neigh_get_state(neigh);
+
+    if (state & NEIGH_KNOWN)
+        neigh_changed(rtnl_neigh_get_ifindex(neigh),
+                      *(const struct in6_addr *) nl_addr_get_binary_addr(dst), state, true);
+}
+
+static void
+nl_msg_addr(struct nlmsghdr *hdr)
+{
+    struct ifaddrmsg *ifaddr = (struct ifaddrmsg *) nlmsg_data(hdr);
     // parse the attributes
     struct nlattr *attrs[IFA_MAX + 1];
-    struct nlattr *s = (struct nlattr *)(((char *) ifaddr) + (sizeof(struct ifaddrmsg)));
-    int len = nlmsg_datalen(hdr) - sizeof(struct ifinfomsg);
-    memset(&attrs, '\0', sizeof(attrs));
-    nla_parse(attrs, IFA_MAX, s, len, NULL);
 
-    struct in6_addr* addr = NULL;
+    if (ifaddr->ifa_family != AF_INET6)
+        return;
+
+    if (nlmsg_parse(hdr, sizeof(struct ifaddrmsg), attrs, IFA_MAX, NULL) < 0)
+        return;
+
+    if (!attrs[IFA_ADDRESS] || (nla_len(attrs[IFA_ADDRESS]) < (int) sizeof(struct in6_addr)))
+        return;
 
-    if (ifaddr->ifa_family == AF_INET6) {
-        addr = address_create_ipv6((struct in6_addr *)nla_data(attrs[IFA_ADDRESS]));
+    const struct in6_addr& addr = *(const struct in6_addr *) nla_data(attrs[IFA_ADDRESS]);
+
+    if (hdr->nlmsg_type == RTM_NEWADDR) {
+        if_addr_add(ifaddr->ifa_index, addr);
+    } else {
         if_addr_del(ifaddr->ifa_index, addr);
     }
 }
@@ -162,37 +199,90 @@ new_addr(struct nl_object *obj, void *p)
 {
     struct rtnl_addr *addr = (struct rtnl_addr *) obj;
     struct nl_addr *local = rtnl_addr_get_local(addr);
-    int family = rtnl_addr_get_family(addr);
-    int ifindex = rtnl_addr_get_ifindex(addr);
-    struct in6_addr* in_addr = NULL;
 
-    char ipstr[INET6_ADDRSTRLEN];
-    inet_ntop(family, nl_addr_get_binary_addr(local), ipstr, INET6_ADDRSTRLEN);
+    if ((rtnl_addr_get_family(addr) != AF_INET6) || !local ||
+        (nl_addr_get_len(local) < sizeof(struct in6_addr)))
+        return;
 
-    switch (family) {
-    case AF_INET:
-        break;
-    case AF_INET6:
-        in_addr = address_create_ipv6((struct in6_addr *)nl_addr_get_binary_addr(local));
-        if_addr_add(ifindex, in_addr);
-        break;
-    default:
-        logger::error() << "Unknown message family: " << family;
+    if_addr_add(rtnl_addr_get_ifindex(addr),
+                *(const struct in6_addr *) nl_addr_get_binary_addr(local));
+}
+
+static void
+route_changed(struct rtnl_route *rt, bool add)
+{
+    // only unicast routes in the main table tell us where a target lives
+    if ((rtnl_route_get_family(rt) != AF_INET6) ||
+        (rtnl_route_get_table(rt) != RT_TABLE_MAIN) ||
+        (rtnl_route_get_type(rt) != RTN_UNICAST))
+        return;
+
+    struct nl_addr *dst = rtnl_route_get_dst(rt);
+    struct rtnl_nexthop *nh = rtnl_route_nexthop_n(rt, 0);
+
+    if (!dst || !nh)
+        return;
+
+    address addr;
+    memset(&addr.addr(), 0, sizeof(struct in6_addr));
+
+    unsigned int len = nl_addr_get_len(dst);
+    memcpy(&addr.addr(), nl_addr_get_binary_addr(dst),
+           (len < sizeof(struct in6_addr)) ? len : sizeof(struct in6_addr));
+    addr.prefix(nl_addr_get_prefixlen(dst));
+
+    char ifname[IF_NAMESIZE];
+
+    if (!if_indextoname(rtnl_route_nh_get_ifindex(nh), ifname)) {
+        // the interface is already gone; drop whatever it left behind
+        if (!add)
+            route::remove(addr, "");
+        return;
+    }
+
+    if (add) {
+        route::create(addr, ifname);
+    } else {
+        route::remove(addr, ifname);
     }
 }
 
+static void
+new_route(struct nl_object *obj, void *p)
+{
+    route_changed((struct rtnl_route *) obj, true);
+}
+
+static void
+nl_msg_route(struct nlmsghdr *hdr)
+{
+    struct rtnl_route *rt;
+
+    if (rtnl_route_parse(hdr, &rt) < 0)
+        return;
+
+    route_changed(rt, hdr->nlmsg_type == RTM_NEWROUTE);
+    rtnl_route_put(rt);
+}
+
 static int
 nl_msg_handler(struct nl_msg *msg, void *arg)
 {
-    logger::debug() << "nl_msg_handler";
+    ND_DEBUG << "nl_msg_handler";
     struct nlmsghdr *hdr = nlmsg_hdr(msg);
 
     switch (hdr->nlmsg_type) {
     case RTM_NEWADDR:
-        nl_msg_newaddr(hdr);
-        break;
     case RTM_DELADDR:
-        nl_msg_deladdr(hdr);
+        nl_msg_addr(hdr);
+        break;
+    case RTM_NEWROUTE:
+    case RTM_DELROUTE:
+        nl_msg_route(hdr);
+        break;
+    case RTM_NEWNEIGH:
+    case RTM_DELNEIGH:
+        nl_msg_neigh(hdr);
         break;
     default:
         logger::error() << "Unknown message type: " << hdr->nlmsg_type;
@@ -201,72 +291,402 @@ nl_msg_handler(struct nl_msg *msg, void *arg)
     return NL_OK;
 }
 
-static void *
-netlink_monitor(void *p)
+static struct nl_sock *monitor_sock;
+struct nl_sock *control_sock;
+
+static reactor::watch monitor_watch;
+
+static reactor::watch control_watch;
+
+// A route change that's waiting to be sent, or waiting for its ACK.
+struct route_op {
+    bool add;
+
+    address gw;
+
+    int ifindex;
+
+    // Sequence number it was sent with, or 0 while it's still queued.
+    uint32_t seq;
+
+    int tries;
+
+    // when it was first requested, in microseconds
+    int64_t since;
+};
+
+// The latest change requested for each destination. Sending a change
+// for a destination supersedes whatever was sent for it before.
+static addr_map<route_op> route_ops;
+
+// Destinations with a change that hasn't been sent yet.
+static std::vector<struct in6_addr> route_queue;
+
+// Destinations of the changes waiting for an ACK, by sequence number.
+static std::map<uint32_t, struct in6_addr> route_inflight;
+
+// Give up on a change after this many failed attempts.
+static const int ROUTE_MAX_TRIES = 3;
+
+// The most changes sent in a single message.
+static const size_t ROUTE_BATCH = 256;
+
+static void
+route_queue_op(const address& dst, bool add, const address& gw, int ifindex)
+{
+    route_op& op = route_ops.insert(dst.const_addr());
+
+    // if it's already queued, this simply replaces what will be sent
+    if ((op.seq != 0) || (op.ifindex == 0))
+        route_queue.push_back(dst.const_addr());
+
+    op.add     = add;
+    op.gw      = gw;
+    op.ifindex = ifindex;
+    op.seq     = 0;
+    op.tries   = 0;
+    op.since   = stats::now();
+}
+
+void
+netlink_route_replace(const address& dst, const address& gw, int ifindex)
 {
-    struct nl_sock *sock = (struct nl_sock *) p;
-    struct nl_cache *addr_cache;
+    route_queue_op(dst, true, gw, ifindex);
+}
 
-    // get all the current addresses
-    if (rtnl_addr_alloc_cache(sock, &addr_cache) < 0) {
-        perror("rtnl_addr_alloc_cache");
+void
+netlink_route_delete(const address& dst, const address& gw, int ifindex)
+{
+    route_queue_op(dst, false, gw, ifindex);
+}
+
+// Sends every change that's still waiting for an ACK again, after some
+// ACKs may have been lost. Replacing and deleting routes is idempotent.
+static void
+route_resend()
+{
+    for (std::map<uint32_t, struct in6_addr>::iterator it = route_inflight.begin();
+            it != route_inflight.end(); it++) {
+        route_op *op = route_ops.find(it->second);
+
+        if (op && (op->seq == it->first)) {
+            op->seq = 0;
+            route_queue.push_back(it->second);
+        }
+    }
+
+    route_inflight.clear();
+}
+
+static struct nl_msg *
+route_build(const struct in6_addr& dst, const route_op& op)
+{
+    int flags = NLM_F_REQUEST | NLM_F_ACK;
+
+    if (op.add)
+        flags |= NLM_F_CREATE | NLM_F_REPLACE;
+
+    struct nl_msg *msg = nlmsg_alloc_simple(op.add ? RTM_NEWROUTE : RTM_DELROUTE, flags);
+
+    if (!msg)
+        return NULL;
+
+    struct rtmsg rtm;
+    memset(&rtm, 0, sizeof(rtm));
+    rtm.rtm_family   = AF_INET6;
+    rtm.rtm_dst_len  = 128;
+    rtm.rtm_table    = RT_TABLE_MAIN;
+    rtm.rtm_protocol = RTPROT_BOOT;
+    rtm.rtm_scope    = op.add ? RT_SCOPE_UNIVERSE : RT_SCOPE_NOWHERE;
+    rtm.rtm_type     = RTN_UNICAST;
+
+    if ((nlmsg_append(msg, &rtm, sizeof(rtm), NLMSG_ALIGNTO) < 0) ||
+        (nla_put(msg, RTA_DST, sizeof(struct in6_addr), &dst) < 0) ||
+        (nla_put_u32(msg, RTA_OIF, op.ifindex) < 0) ||
+        (!op.gw.is_empty() &&
+         (nla_put(msg, RTA_GATEWAY, sizeof(struct in6_addr), &op.gw.const_addr()) < 0))) {
+        nlmsg_free(msg);
         return NULL;
     }
 
-    // add existing addresses
-    nl_cache_foreach(addr_cache, new_addr, NULL);
-    // destroy the cache
-    nl_cache_free(addr_cache);
+    nlmsg_hdr(msg)->nlmsg_seq = nl_socket_use_seq(control_sock);
+
+    return msg;
+}
+
+void
+netlink_flush()
+{
+    std::vector<uint8_t> buf;
+    size_t cnt = 0;
+    bool failed = false;
+
+    for (std::vector<struct in6_addr>::iterator it = route_queue.begin();
+            it != route_queue.end(); it++) {
+        route_op *op = route_ops.find(*it);
+
+        // superseded by a change that's already been sent
+        if (!op || (op->seq != 0))
+            continue;
+
+        struct nl_msg *msg = route_build(*it, *op);
+
+        if (!msg) {
+            logger::error() << "Failed to build route change for " << address(*it);
+            route_ops.erase(*it);
+            continue;
+        }
+
+        struct nlmsghdr *hdr = nlmsg_hdr(msg);
+
+        ND_DEBUG
+            << "netlink " << (op->add ? "replace " : "delete ") << address(*it)
+            << (op->gw.is_empty() ? "" : " via ") << (op->gw.is_empty() ? "" : op->gw.to_string())
+            << " ifindex=" << op->ifindex << " seq=" << hdr->nlmsg_seq;
+
+        op->seq = hdr->nlmsg_seq;
+        route_inflight[op->seq] = *it;
+
+        buf.insert(buf.end(), (uint8_t *)hdr, (uint8_t *)hdr + NLMSG_ALIGN(hdr->nlmsg_len));
+        nlmsg_free(msg);
+
+        // the kernel handles every message in a datagram in turn
+        if (++cnt == ROUTE_BATCH) {
+            failed |= nl_sendto(control_sock, &buf[0], buf.size()) < 0;
+            buf.clear();
+            cnt = 0;
+        }
+    }
+
+    if (!buf.empty()) {
+        failed |= nl_sendto(control_sock, &buf[0], buf.size()) < 0;
+    }
+
+    route_queue.clear();
+
+    // try again next time around
+    if (failed) {
+        logger::warning() << "Failed to send route changes: " << logger::err();
+        route_resend();
+    }
+}
+
+// Called with the outcome of the change sent with 'seq'.
+static void
+route_done(uint32_t seq, int error)
+{
+    std::map<uint32_t, struct in6_addr>::iterator it = route_inflight.find(seq);
 
-    // switch to notification mode
-    // disable sequence checking
-    nl_socket_disable_seq_check(sock);
-    // set the callback we want
-    nl_socket_modify_cb(sock, NL_CB_VALID, NL_CB_CUSTOM, nl_msg_handler, NULL);
+    if (it == route_inflight.end())
+        return;
 
-    // subscribe to the IPv6 address change callbacks
-    nl_socket_add_memberships(sock, RTNLGRP_IPV6_IFADDR, 0);
+    struct in6_addr dst = it->second;
+    route_inflight.erase(it);
 
-    while (1)
-    {
-        nl_recvmsgs_default(sock);
+    route_op *op = route_ops.find(dst);
+
+    // a newer change has been requested since
+    if (!op || (op->seq != seq))
+        return;
+
+    // deleting a route that's already gone is fine
+    if (!error || (!op->add && ((error == ESRCH) || (error == ENOENT)))) {
+        stats::inc(stats::ROUTE_CHANGES);
+        stats::record(stats::WIRING_LATENCY, stats::now() - op->since);
+        route_ops.erase(dst);
+        return;
+    }
+
+    if (++op->tries >= ROUTE_MAX_TRIES) {
+        logger::warning()
+            << "Failed to " << (op->add ? "add" : "remove") << " route to "
+            << address(dst) << ": " << strerror(error);
+        stats::inc(stats::ROUTE_FAILURES);
+        route_ops.erase(dst);
+        return;
     }
-    return NULL;
+
+    op->seq = 0;
+    route_queue.push_back(dst);
 }
 
-static pthread_t monitor_thread;
-static struct nl_sock *monitor_sock;
-struct nl_sock *control_sock;
+static int
+route_ack(struct nl_msg *msg, void *arg)
+{
+    route_done(nlmsg_hdr(msg)->nlmsg_seq, 0);
+    return NL_OK;
+}
+
+static int
+route_error(struct sockaddr_nl *nla, struct nlmsgerr *err, void *arg)
+{
+    route_done(err->msg.nlmsg_seq, -err->error);
+    return NL_SKIP;
+}
+
+// Reads and handles every message waiting on 'sock'. Returns false if
+// the kernel had to drop some of them.
+static bool
+netlink_drain(struct nl_sock *sock)
+{
+    struct nl_cb *cb = nl_socket_get_cb(sock);
+    int n;
+
+    // the socket is non-blocking, so this stops once it's drained
+    while ((n = nl_recvmsgs_report(sock, cb)) > 0)
+        ;
+
+    nl_cb_put(cb);
+
+    if (n < 0) {
+        logger::warning() << "nl_recvmsgs: " << nl_geterror(n);
+        return n != -NLE_NOMEM;
+    }
+
+    return true;
+}
+
+static void
+netlink_readable(reactor::watch *w, uint32_t events)
+{
+    netlink_drain(monitor_sock);
+}
+
+static void
+control_readable(reactor::watch *w, uint32_t events)
+{
+    if (!netlink_drain(control_sock))
+        route_resend();
+}
+
+bool
+netlink_neigh_update()
+{
+    // subscribe before taking the dump, as with the addresses below
+    if (!neigh_watched) {
+        nl_socket_add_memberships(monitor_sock, RTNLGRP_NEIGH, 0);
+        neigh_watched = true;
+    }
+
+    // the control socket is busy with route changes once we're up, so
+    // take the dump on a socket of its own
+    struct nl_sock *sock = nl_socket_alloc();
+    struct nl_cache *neigh_cache;
+
+    if (!sock || (nl_connect(sock, NETLINK_ROUTE) < 0) ||
+        (rtnl_neigh_alloc_cache(sock, &neigh_cache) < 0)) {
+        logger::error() << "Failed to dump neighbours from netlink";
+        nl_socket_free(sock);
+        return false;
+    }
+
+    // this also fills in interfaces whose rules were added since the
+    // last dump; the ones we had are kept up to date by notifications
+    nl_cache_foreach(neigh_cache, new_neigh, NULL);
+    nl_cache_free(neigh_cache);
+    nl_socket_free(sock);
+
+    return true;
+}
 
 bool
 netlink_setup()
 {
     // create a netlink socket
     control_sock = nl_socket_alloc();
-    nl_connect(control_sock, NETLINK_ROUTE);
 
-    // create a thread to run the netlink monitor in
-    // create a netlink socket
+    if (nl_connect(control_sock, NETLINK_ROUTE) < 0) {
+        logger::error() << "Failed to connect netlink control socket";
+        return false;
+    }
+
     monitor_sock = nl_socket_alloc();
-    nl_connect(monitor_sock, NETLINK_ROUTE);
+
+    if (nl_connect(monitor_sock, NETLINK_ROUTE) < 0) {
+        logger::error() << "Failed to connect netlink monitor socket";
+        return false;
+    }
+
     // increase the recv buffer size to capture all notifications
     nl_socket_set_buffer_size(monitor_sock, 2048000, 0);
 
-    pthread_create(&monitor_thread, NULL, netlink_monitor, monitor_sock);
-    pthread_setname_np(monitor_thread, "netlink");
-    if (pthread_setschedprio(monitor_thread, -10) < 0)
-    {
-        logger::warning() << "setschedprio: " << strerror(errno);
+    // notifications carry no sequence numbers we know of
+    nl_socket_disable_seq_check(monitor_sock);
+    nl_socket_modify_cb(monitor_sock, NL_CB_VALID, NL_CB_CUSTOM, nl_msg_handler, NULL);
+
+    // subscribe to the IPv6 address change callbacks before taking the
+    // dump below, so nothing that happens in between is missed
+    nl_socket_add_memberships(monitor_sock, RTNLGRP_IPV6_IFADDR, 0);
+
+    // get all the current addresses
+    struct nl_cache *addr_cache;
+    int64_t start = stats::now();
+
+    if (rtnl_addr_alloc_cache(control_sock, &addr_cache) < 0) {
+        logger::error() << "Failed to dump addresses from netlink";
+        return false;
     }
-    return true;
+
+    // add existing addresses
+    nl_cache_foreach(addr_cache, new_addr, NULL);
+    // destroy the cache
+    nl_cache_free(addr_cache);
+
+    stats::record(stats::ADDRESS_RELOAD, stats::now() - start);
+
+    // the route table is only needed for 'auto' rules, and can be very
+    // large, so leave it alone unless there are any
+    if (rule::any_auto()) {
+        nl_socket_add_memberships(monitor_sock, RTNLGRP_IPV6_ROUTE, 0);
+
+        struct nl_cache *route_cache;
+        start = stats::now();
+
+        if (rtnl_route_alloc_cache(control_sock, AF_INET6, 0, &route_cache) < 0) {
+            logger::error() << "Failed to dump routes from netlink";
+            return false;
+        }
+
+        nl_cache_foreach(route_cache, new_route, NULL);
+        nl_cache_free(route_cache);
+
+        stats::record(stats::ROUTE_RELOAD, stats::now() - start);
+    }
+
+    if (proxy::any_kernel_neigh() && !netlink_neigh_update())
+        return false;
+
+    nl_socket_set_nonblocking(monitor_sock);
+
+    monitor_watch.fd = nl_socket_get_fd(monitor_sock);
+    monitor_watch.fn = netlink_readable;
+
+    // from here on, the control socket only carries our route changes,
+    // several of which may be in flight at once
+    nl_socket_set_nonblocking(control_sock);
+    nl_socket_disable_seq_check(control_sock);
+    nl_socket_modify_cb(control_sock, NL_CB_ACK, NL_CB_CUSTOM, route_ack, NULL);
+    nl_socket_modify_err_cb(control_sock, NL_CB_CUSTOM, route_error, NULL);
+
+    control_watch.fd = nl_socket_get_fd(control_sock);
+    control_watch.fn = control_readable;
+
+    return reactor::add(&monitor_watch) && reactor::add(&control_watch);
 }
 
 bool
 netlink_teardown()
 {
-    void *res = 0;
-    pthread_cancel(monitor_thread);
-    pthread_join(monitor_thread, &res);
+    if (monitor_watch.fd >= 0) {
+        reactor::remove(&monitor_watch);
+        monitor_watch.fd = -1;
+    }
+
+    if (control_watch.fd >= 0) {
+        reactor::remove(&control_watch);
+        control_watch.fd = -1;
+    }
+
     nl_socket_free(monitor_sock);
     nl_socket_free(control_sock);
     return true;
@@ -22,7 +22,28 @@ NDPPD_NS_BEGIN
 
 bool netlink_teardown();
 bool netlink_setup();
-bool if_addr_find(std::string iface, const struct in6_addr *iaddr);
-void if_add_to_list(int ifindex, const ptr<iface>& ifa);
+// Returns true if 'iaddr' is assigned to the interface 'ifindex'. Only
+// interfaces passed to if_add_to_list() are tracked.
+bool if_addr_find(int ifindex, const struct in6_addr& iaddr);
+void if_add_to_list(const ptr<iface>& ifa);
+
+// Returns true if the kernel has a link-layer address for 'naddr' on the
+// interface 'ifindex', as long as netlink_neigh_update() has been called.
+bool if_neigh_find(int ifindex, const struct in6_addr& naddr);
+
+// Starts mirroring the kernel's IPv6 neighbour table, or reloads it so
+// interfaces added since are covered too.
+bool netlink_neigh_update();
+
+// Queues a host route to 'dst' through 'ifindex', via 'gw' unless it's
+// empty, replacing any route that's already there.
+void netlink_route_replace(const address& dst, const address& gw, int ifindex);
+
+// Queues the removal of the route above.
+void netlink_route_delete(const address& dst, const address& gw, int ifindex);
+
+// Sends every queued route change. The outcome is picked up from the
+// main loop as the ACKs arrive.
+void netlink_flush();
 
 NDPPD_NS_END
@@ -14,22 +14,31 @@
 // You should have received a copy of the GNU General Public License
 // along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include <cstdlib>
+#include <cstring>
 #include <csignal>
+#include <ctime>
 
 #include <iostream>
 #include <fstream>
 #include <string>
 #include <memory>
+#include <sstream>
+#include <vector>
 
 #include <getopt.h>
-#include <sys/time.h>
+#include <sched.h>
 
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
 
 #include "ndppd.h"
 #include "route.h"
+#include "reactor.h"
+#include "worker.h"
+#include "stats.h"
+#include "snapshot.h"
 
 using namespace ndppd;
 
@@ -133,7 +142,8 @@ static ptr<conf> load_config(const std::string& path)
     return cf;
 }
 
-static bool configure(ptr<conf>& cf)
+// Sets the options that aren't tied to a proxy.
+static void configure_globals(const ptr<conf>& cf)
 {
     ptr<conf> x_cf;
 
@@ -146,142 +156,519 @@ static bool configure(ptr<conf>& cf)
         address::ttl(30000);
     else
         address::ttl(*x_cf);
-    
-    std::list<ptr<rule> > myrules;
 
-    std::vector<ptr<conf> >::const_iterator p_it;
+    if (!(x_cf = cf->find("rx-batch")))
+        iface::rx_batch(32);
+    else
+        iface::rx_batch(*x_cf);
 
-    std::vector<ptr<conf> > proxies(cf->find_all("proxy"));
+    if (!(x_cf = cf->find("rx-ring")))
+        iface::rx_ring(false);
+    else
+        iface::rx_ring(*x_cf);
 
-    for (p_it = proxies.begin(); p_it != proxies.end(); p_it++) {
-        ptr<conf> pr_cf = *p_it;
+    if (!(x_cf = cf->find("max-sessions")))
+        session::max_sessions(0);
+    else
+        session::max_sessions(*x_cf);
 
-        if (pr_cf->empty()) {
-            return false;
-        }
-        
-        bool promiscuous = false;
-        if (!(x_cf = pr_cf->find("promiscuous")))
-            promiscuous = false;
-        else
-            promiscuous = *x_cf;
+    if (!(x_cf = cf->find("max-waiting")))
+        session::max_waiting(0);
+    else
+        session::max_waiting(*x_cf);
 
-        ptr<proxy> pr = proxy::open(*pr_cf, promiscuous);
-        if (!pr || pr.is_null() == true) {
-            return false;
+    if (!(x_cf = cf->find("max-probes")))
+        iface::max_probes(0);
+    else
+        iface::max_probes(*x_cf);
+
+    int rate = 0, burst = 0;
+
+    if (x_cf = cf->find("renew-rate"))
+        rate = *x_cf;
+
+    if (!(x_cf = cf->find("renew-burst")))
+        burst = rate;
+    else
+        burst = *x_cf;
+
+    iface::renew_rate(rate, burst);
+
+    if (!(x_cf = cf->find("busy-poll")))
+        iface::busy_poll(0);
+    else
+        iface::busy_poll(*x_cf);
+
+    if (!(x_cf = cf->find("spin")))
+        reactor::spin(0);
+    else
+        reactor::spin(*x_cf);
+
+    if (!(x_cf = cf->find("state-interval")))
+        snapshot::interval(60000);
+    else
+        snapshot::interval(*x_cf);
+
+    if (!(x_cf = cf->find("state-file"))) {
+        snapshot::path("");
+    } else {
+        std::string path = *x_cf;
+
+        // Workers track different targets, so each needs its own file.
+        if (worker::count() > 1) {
+            std::ostringstream ss;
+            ss << path << "." << worker::index();
+            path = ss.str();
         }
 
-        if (!(x_cf = pr_cf->find("router")))
-            pr->router(true);
-        else
-            pr->router(*x_cf);
-        
-        if (!(x_cf = pr_cf->find("autowire")))
-            pr->autowire(false);
-        else
-            pr->autowire(*x_cf);
-        
-        if (!(x_cf = pr_cf->find("keepalive")))
-            pr->keepalive(true);
-        else
-            pr->keepalive(*x_cf);
-        
-        if (!(x_cf = pr_cf->find("retries")))
-            pr->retries(3);
-        else
-            pr->retries(*x_cf);
+        snapshot::path(path);
+    }
+}
 
-        if (!(x_cf = pr_cf->find("ttl")))
-            pr->ttl(30000);
-        else
-            pr->ttl(*x_cf);
-        
-        if (!(x_cf = pr_cf->find("deadtime")))
-            pr->deadtime(pr->ttl());
-        else
-            pr->deadtime(*x_cf);
+// Builds the rules of 'pr' from its 'proxy' section, then sets its
+// options and swaps the rules in. If a rule can't be set up, 'pr' is
+// left as it was.
+static bool configure_proxy(const ptr<proxy>& pr, const ptr<conf>& pr_cf)
+{
+    ptr<conf> x_cf;
 
-        if (!(x_cf = pr_cf->find("timeout")))
-            pr->timeout(500);
-        else
-            pr->timeout(*x_cf);
+    std::list<ptr<rule> > rules;
 
-        std::vector<ptr<conf> >::const_iterator r_it;
+    std::vector<ptr<conf> >::const_iterator r_it;
 
-        std::vector<ptr<conf> > rules(pr_cf->find_all("rule"));
+    std::vector<ptr<conf> > rule_cfs(pr_cf->find_all("rule"));
 
-        for (r_it = rules.begin(); r_it != rules.end(); r_it++) {
-            ptr<conf> ru_cf =* r_it;
+    for (r_it = rule_cfs.begin(); r_it != rule_cfs.end(); r_it++) {
+        ptr<conf> ru_cf =* r_it;
 
-            address addr(*ru_cf);
-            
-            bool autovia = false;
-            if (!(x_cf = ru_cf->find("autovia")))
-                autovia = false;
-            else
-                autovia = *x_cf;
-
-            if (x_cf = ru_cf->find("iface"))
-            {
-                ptr<iface> ifa = iface::open_ifd(*x_cf);
-                if (!ifa || ifa.is_null() == true) {
-                    return false;
-                }
-                
-                ifa->add_parent(pr);
-                
-                myrules.push_back(pr->add_rule(addr, ifa, autovia));
-            } else if (ru_cf->find("auto")) {
-                myrules.push_back(pr->add_rule(addr, true));
-            } else {
-                myrules.push_back(pr->add_rule(addr, false));
+        address addr(*ru_cf);
+
+        bool autovia = false;
+        if (!(x_cf = ru_cf->find("autovia")))
+            autovia = false;
+        else
+            autovia = *x_cf;
+
+        if (x_cf = ru_cf->find("iface"))
+        {
+            ptr<iface> ifa = iface::open_ifd(*x_cf);
+            if (!ifa || ifa.is_null() == true) {
+                return false;
             }
+
+            ptr<rule> ru = rule::create(pr, addr, ifa);
+            ru->autovia(autovia);
+            rules.push_back(ru);
+        } else if (ru_cf->find("auto")) {
+            rules.push_back(rule::create(pr, addr, true));
+        } else {
+            rules.push_back(rule::create(pr, addr, false));
         }
     }
+
+    if (!(x_cf = pr_cf->find("router")))
+        pr->router(true);
+    else
+        pr->router(*x_cf);
+    
+    if (!(x_cf = pr_cf->find("autowire")))
+        pr->autowire(false);
+    else
+        pr->autowire(*x_cf);
+    
+    if (!(x_cf = pr_cf->find("keepalive")))
+        pr->keepalive(true);
+    else
+        pr->keepalive(*x_cf);
     
+    if (!(x_cf = pr_cf->find("unicast-renew")))
+        pr->unicast_renew(true);
+    else
+        pr->unicast_renew(*x_cf);
+
+    if (!(x_cf = pr_cf->find("first-responder")))
+        pr->first_responder(false);
+    else
+        pr->first_responder(*x_cf);
+
+    if (!(x_cf = pr_cf->find("kernel-neigh")))
+        pr->kernel_neigh(false);
+    else
+        pr->kernel_neigh(*x_cf);
+
+#ifndef WITH_ND_NETLINK
+    if (pr->kernel_neigh()) {
+        logger::warning() << "'kernel-neigh' needs ndppd built with WITH_ND_NETLINK, ignoring it";
+        pr->kernel_neigh(false);
+    }
+#endif
+
+    if (!(x_cf = pr_cf->find("retries")))
+        pr->retries(3);
+    else
+        pr->retries(*x_cf);
+
+    if (!(x_cf = pr_cf->find("ttl")))
+        pr->ttl(30000);
+    else
+        pr->ttl(*x_cf);
+    
+    if (!(x_cf = pr_cf->find("deadtime")))
+        pr->deadtime(pr->ttl());
+    else
+        pr->deadtime(*x_cf);
+
+    if (!(x_cf = pr_cf->find("max-deadtime")))
+        pr->max_deadtime(pr->deadtime() * 8);
+    else
+        pr->max_deadtime(*x_cf);
+
+    if (!(x_cf = pr_cf->find("timeout")))
+        pr->timeout(500);
+    else
+        pr->timeout(*x_cf);
+
+    if (!(x_cf = pr_cf->find("renew-jitter")))
+        pr->renew_jitter(10);
+    else
+        pr->renew_jitter(*x_cf);
+
+    int rate = 0, burst = 0, prefix = 64;
+
+    if (x_cf = pr_cf->find("solicit-rate"))
+        rate = *x_cf;
+
+    if (!(x_cf = pr_cf->find("solicit-burst")))
+        burst = rate;
+    else
+        burst = *x_cf;
+
+    pr->solicit_rate(rate, burst);
+
+    rate = 0;
+
+    if (x_cf = pr_cf->find("source-rate"))
+        rate = *x_cf;
+
+    if (!(x_cf = pr_cf->find("source-burst")))
+        burst = rate;
+    else
+        burst = *x_cf;
+
+    if (x_cf = pr_cf->find("source-prefix"))
+        prefix = *x_cf;
+
+    pr->source_rate(rate, burst, prefix);
+
+    pr->replace_rules(rules);
+
+    return true;
+}
+
+static bool promiscuous_option(const ptr<conf>& pr_cf)
+{
+    ptr<conf> x_cf;
+
+    if (!(x_cf = pr_cf->find("promiscuous")))
+        return false;
+
+    return *x_cf;
+}
+
+static void print_topology()
+{
     // Print out all the topology    
     for (std::map<std::string, weak_ptr<iface> >::iterator i_it = iface::_map.begin(); i_it != iface::_map.end(); i_it++) {
         ptr<iface> ifa = i_it->second;
         
-        logger::debug() << "iface " << ifa->name() << " {";
+        ND_DEBUG << "iface " << ifa->name() << " {";
         
         for (std::list<weak_ptr<proxy> >::iterator pit = ifa->serves_begin(); pit != ifa->serves_end(); pit++) {
             ptr<proxy> pr = (*pit);
             if (!pr) continue;
             
-            logger::debug() << "  " << "proxy " << logger::format("%x", pr.get_pointer()) << " {";
+            ND_DEBUG << "  " << "proxy " << logger::format("%x", pr.get_pointer()) << " {";
             
              for (std::list<ptr<rule> >::iterator rit = pr->rules_begin(); rit != pr->rules_end(); rit++) {
                 ptr<rule> ru = *rit;
                 
-                logger::debug() << "    " << "rule " << logger::format("%x", ru.get_pointer()) << " {";
-                logger::debug() << "      " << "taddr " << ru->addr()<< ";";
+                ND_DEBUG << "    " << "rule " << logger::format("%x", ru.get_pointer()) << " {";
+                ND_DEBUG << "      " << "taddr " << ru->addr()<< ";";
                 if (ru->is_auto())
-                    logger::debug() << "      " << "auto;";
+                    ND_DEBUG << "      " << "auto;";
                 else if (!ru->daughter())
-                    logger::debug() << "      " << "static;";
+                    ND_DEBUG << "      " << "static;";
                 else
-                    logger::debug() << "      " << "iface " << ru->daughter()->name() << ";";
-                logger::debug() << "    }";
+                    ND_DEBUG << "      " << "iface " << ru->daughter()->name() << ";";
+                ND_DEBUG << "    }";
              }
             
-            logger::debug() << "  }";
+            ND_DEBUG << "  }";
         }
         
-        logger::debug() << "  " << "parents {";
+        ND_DEBUG << "  " << "parents {";
         for (std::list<weak_ptr<proxy> >::iterator pit = ifa->parents_begin(); pit != ifa->parents_end(); pit++) {
             ptr<proxy> pr = (*pit);
             
-            logger::debug() << "    " << "parent " << logger::format("%x", pr.get_pointer()) << ";";
+            ND_DEBUG << "    " << "parent " << logger::format("%x", pr.get_pointer()) << ";";
         }
-        logger::debug() << "  }";
+        ND_DEBUG << "  }";
         
-        logger::debug() << "}";
+        ND_DEBUG << "}";
     }
-    
+}
+
+static bool configure(ptr<conf>& cf)
+{
+    ptr<conf> x_cf;
+
+    configure_globals(cf);
+
+    if (x_cf = cf->find("stats-socket")) {
+        std::string path = *x_cf;
+
+        // Each worker gets a socket of its own.
+        if (worker::count() > 1) {
+            std::ostringstream ss;
+            ss << path << "." << worker::index();
+            path = ss.str();
+        }
+
+        if (!stats::listen_unix(path))
+            return false;
+    }
+
+    if (x_cf = cf->find("stats-http")) {
+        if (!stats::listen_http(*x_cf, worker::index()))
+            return false;
+    }
+
+    std::vector<ptr<conf> >::const_iterator p_it;
+
+    std::vector<ptr<conf> > proxies(cf->find_all("proxy"));
+
+    for (p_it = proxies.begin(); p_it != proxies.end(); p_it++) {
+        ptr<conf> pr_cf = *p_it;
+
+        if (pr_cf->empty()) {
+            return false;
+        }
+
+        ptr<proxy> pr = proxy::open(*pr_cf, promiscuous_option(pr_cf));
+        if (!pr || pr.is_null() == true) {
+            return false;
+        }
+
+        if (!configure_proxy(pr, pr_cf))
+            return false;
+    }
+
+    print_topology();
+
+    return true;
+}
+
+// Parses a list of CPUs such as "0,2-3" into 'cpus'.
+static bool parse_cpus(const std::string& str, std::vector<int>& cpus)
+{
+    const char* p = str.c_str();
+
+    while (*p) {
+        char* e;
+
+        long lo = strtol(p, &e, 10), hi = lo;
+
+        if ((e == p) || (lo < 0))
+            return false;
+
+        if (*e == '-') {
+            p  = e + 1;
+            hi = strtol(p, &e, 10);
+
+            if ((e == p) || (hi < lo))
+                return false;
+        }
+
+        if ((*e != ',') && *e)
+            return false;
+
+        for (long i = lo; i <= hi; i++) {
+            if (i >= CPU_SETSIZE)
+                return false;
+
+            cpus.push_back((int)i);
+        }
+
+        p = *e ? e + 1 : e;
+    }
+
+    return !cpus.empty();
+}
+
+// Applies the options that trade resources for latency. These affect the
+// whole process, so they're only looked at on startup.
+static bool configure_process(const ptr<conf>& cf)
+{
+    ptr<conf> x_cf;
+
+    if (x_cf = cf->find("cpu-affinity")) {
+        std::vector<int> cpus;
+
+        if (!parse_cpus(x_cf->as_str(), cpus)) {
+            logger::error() << "Invalid cpu-affinity '" << x_cf->as_str() << "'";
+            return false;
+        }
+
+        cpu_set_t set;
+        CPU_ZERO(&set);
+
+        // Each worker gets a CPU of its own, the rest of the time the
+        // process may run on any of them.
+        if (worker::count() > 1) {
+            CPU_SET(cpus[worker::index() % cpus.size()], &set);
+        } else {
+            for (std::vector<int>::const_iterator it = cpus.begin(); it != cpus.end(); it++)
+                CPU_SET(*it, &set);
+        }
+
+        if (sched_setaffinity(0, sizeof(set), &set) < 0) {
+            logger::error() << "Failed to set cpu-affinity: " << logger::err();
+            return false;
+        }
+    }
+
+    int prio = 0;
+
+    if (x_cf = cf->find("sched-priority"))
+        prio = *x_cf;
+
+    if (prio > 0) {
+        struct sched_param sp;
+        memset(&sp, 0, sizeof(sp));
+
+        sp.sched_priority = prio;
+
+        if (sched_setscheduler(0, SCHED_FIFO, &sp) < 0) {
+            logger::error() << "Failed to switch to SCHED_FIFO: " << logger::err();
+            return false;
+        }
+    }
+
+    if ((x_cf = cf->find("lock-memory")) && x_cf->as_bool()) {
+        // Have the sessions we're allowed ready, so that answering for
+        // a new target doesn't have to wait for the heap to grow.
+        if (session::max_sessions() > 0)
+            session::reserve(session::max_sessions());
+
+        if (mlockall(MCL_CURRENT | MCL_FUTURE) < 0) {
+            logger::error() << "Failed to lock memory: " << logger::err();
+            return false;
+        }
+    }
+
     return true;
 }
 
+static std::string config_path("/etc/ndppd.conf");
+
+// Loads the configuration file again and applies it to what's running.
+// Proxies that are still there keep their sockets and the sessions the
+// new rules still cover; only what changed is opened or closed.
+static void reload()
+{
+    logger::notice() << "Reloading configuration file '" << config_path << "'";
+
+    ptr<conf> cf = load_config(config_path);
+
+    if (cf.is_null()) {
+        logger::error() << "Keeping the current configuration";
+        return;
+    }
+
+    int before = session::count();
+
+    configure_globals(cf);
+
+    std::vector<ptr<conf> > sections(cf->find_all("proxy"));
+
+    std::vector<ptr<proxy> > proxies(sections.size());
+
+    std::list<ptr<proxy> > unclaimed(proxy::list());
+
+    // A proxy carries on if it's still listening on the same interface
+    // in the same way.
+    for (size_t i = 0; i < sections.size(); i++) {
+        const std::string& ifname = *sections[i];
+        bool promiscuous = promiscuous_option(sections[i]);
+
+        for (std::list<ptr<proxy> >::iterator it = unclaimed.begin(); it != unclaimed.end(); it++) {
+            if (((*it)->ifa()->name() == ifname) && ((*it)->promiscuous() == promiscuous)) {
+                proxies[i] = *it;
+                unclaimed.erase(it);
+                break;
+            }
+        }
+    }
+
+    for (std::list<ptr<proxy> >::iterator it = unclaimed.begin(); it != unclaimed.end(); it++) {
+        logger::notice() << "Removing proxy for '" << (*it)->ifa()->name() << "'";
+        proxy::remove(*it);
+    }
+
+    unclaimed.clear();
+
+    for (size_t i = 0; i < sections.size(); i++) {
+        const std::string& ifname = *sections[i];
+
+        if (!proxies[i]) {
+            logger::notice() << "Adding proxy for '" << ifname << "'";
+
+            if (!(proxies[i] = proxy::open(ifname, promiscuous_option(sections[i])))) {
+                logger::error() << "Failed to open proxy for '" << ifname << "'";
+                continue;
+            }
+        }
+
+        if (!configure_proxy(proxies[i], sections[i])) {
+            logger::error()
+                << "Failed to set up the rules of proxy '" << ifname
+                << "', keeping its current rules and options";
+        }
+    }
+
+    int after = session::count();
+
+    logger::notice()
+        << "Configuration reloaded, kept " << after << " sessions and dropped "
+        << (before - after);
+
+    print_topology();
+
+#ifndef WITH_ND_NETLINK
+    // With netlink, the route and address tables are always up to date.
+    if (rule::any_auto())
+        route::update();
+
+    if (rule::any_iface())
+        address::update();
+#else
+    // Picks up the neighbours of interfaces the new rules brought in.
+    if (proxy::any_kernel_neigh())
+        netlink_neigh_update();
+#endif
+}
+
+static void write_pidfile(const std::string& path)
+{
+    if (path.empty())
+        return;
+
+    std::ofstream pf;
+    pf.open(path.c_str(), std::ios::out | std::ios::trunc);
+    pf << getpid() << std::endl;
+    pf.close();
+}
+
 static bool running = true;
 
 static void exit_ndppd(int sig)
@@ -290,12 +677,25 @@ static void exit_ndppd(int sig)
     running = 0;
 }
 
+static bool reload_pending = false;
+
+static void handle_signal(int sig)
+{
+    if (sig != SIGHUP) {
+        exit_ndppd(sig);
+        return;
+    }
+
+    // Sockets may be opened and closed, so leave it until the reactor is
+    // done dispatching.
+    reload_pending = true;
+}
+
 int main(int argc, char* argv[], char* env[])
 {
     signal(SIGINT, exit_ndppd);
     signal(SIGTERM, exit_ndppd);
 
-    std::string config_path("/etc/ndppd.conf");
     std::string pidfile;
     std::string verbosity;
     bool daemon = false;
@@ -358,57 +758,113 @@ int main(int argc, char* argv[], char* env[])
             return 1;
     }
 
-    if (!configure(cf))
-        return -1;
+    ptr<conf> x_cf;
+
+    int workers = 0;
 
-    if (!pidfile.empty()) {
-        std::ofstream pf;
-        pf.open(pidfile.c_str(), std::ios::out | std::ios::trunc);
-        pf << getpid() << std::endl;
-        pf.close();
+    if (x_cf = cf->find("workers"))
+        workers = *x_cf;
+
+    if ((workers > 1) && worker::start(workers)) {
+        write_pidfile(pidfile);
+        return worker::supervise();
     }
 
-    // Time stuff.
+    // Renewals are spread out at random; workers shouldn't all pick the
+    // same numbers.
+    srand(getpid() ^ time(NULL));
+
+    // Interfaces register their sockets with the reactor as they're
+    // opened, so it has to exist before we configure anything.
+    if (!reactor::open(handle_signal))
+        return -1;
+
+    // Workers hand each other the reverse adverts of solicits whose
+    // sender belongs to someone else.
+    if (!worker::listen(iface::handle_worker_message))
+        return -1;
+
+    if (!configure(cf) || !configure_process(cf))
+        return -1;
+
+    if (workers <= 1)
+        write_pidfile(pidfile);
 
-    struct timeval t1, t2;
+#ifdef WITH_ND_NETLINK
+    // This also loads the route and address tables and keeps them up to
+    // date.
+    if (!netlink_setup())
+        return -1;
+#else
+    if (rule::any_auto())
+        route::update();
+
+    if (rule::any_iface())
+        address::update();
+#endif
 
-    gettimeofday(&t1, 0);
+    // Needs the routes and addresses above to wire routes again.
+    snapshot::load();
 
 #ifdef WITH_ND_NETLINK
-    netlink_setup();
+    netlink_flush();
 #endif
 
+    worker::ready();
+
+    // From here on, messages are written out at the end of each pass
+    // through the loop rather than while handling packets.
+    logger::buffered(true);
+
     while (running) {
-        if (iface::poll_all() < 0) {
+        // Pick up rule and address changes before going back to sleep.
+        iface::update_filters();
+
+        // Sleep until a packet arrives, a timer is due, or a signal is
+        // delivered.
+        if (reactor::run_once() < 0) {
             if (running) {
-                logger::error() << "iface::poll_all() failed";
+                logger::error() << "reactor::run_once() failed";
             }
             break;
         }
 
-        int elapsed_time;
-        gettimeofday(&t2, 0);
+        if (reload_pending) {
+            reload_pending = false;
+            reload();
 
-        elapsed_time =
-            ((t2.tv_sec  - t1.tv_sec)*   1000) +
-            ((t2.tv_usec - t1.tv_usec) / 1000);
+            // The next worker may reload now that any new sockets of
+            // ours have joined their fanout groups.
+            worker::reloaded();
+        }
 
-        t1.tv_sec  = t2.tv_sec;
-        t1.tv_usec = t2.tv_usec;
+        // Send everything the packets and timers above have queued.
+        iface::flush_all();
 
-        if (rule::any_auto())
-            route::update(elapsed_time);
-        
-        if (rule::any_iface())
-            address::update(elapsed_time);
+#ifdef WITH_ND_NETLINK
+        netlink_flush();
+#endif
 
-        session::update_all(elapsed_time);
+        logger::drain();
     }
 
+    logger::buffered(false);
+
+    snapshot::save();
+
 #ifdef WITH_ND_NETLINK
+    // Let the sessions remove their routes while we can still send the
+    // requests.
+    proxy::drop_sessions();
+    netlink_flush();
+
     netlink_teardown();
 #endif
 
+    stats::close();
+
+    reactor::close();
+
     logger::notice() << "Bye";
 
     return 0;
@@ -29,6 +29,7 @@
 
 #include "logger.h"
 #include "conf.h"
+#include "timer.h"
 #include "address.h"
 
 #include "iface.h"
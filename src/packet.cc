@@ -0,0 +1,183 @@
+// ndppd - NDP Proxy Daemon
+// Copyright (C) 2011  Daniel Adolfsson <daniel@priv.nu>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+#include <cstring>
+
+#include <netinet/in.h>
+#include <netinet/ip6.h>
+#include <netinet/icmp6.h>
+#include <net/ethernet.h>
+
+#include "ndppd.h"
+#include "packet.h"
+
+NDPPD_NS_BEGIN
+
+// 802.1ad service tags aren't in every libc's headers.
+#ifndef ETHERTYPE_QINQ
+#define ETHERTYPE_QINQ 0x88a8
+#endif
+
+// Size of a VLAN tag, not counting the ether_type following it.
+static const size_t VLAN_TAG_LEN = 4;
+
+// Upper bound on the number of extension headers we'll walk through.
+static const int MAX_EXT_HEADERS = 8;
+
+static uint16_t get16(const uint8_t* p)
+{
+    return (uint16_t)((p[0] << 8) | p[1]);
+}
+
+packet::packet() :
+    _type(0), _flags(0), _opts(0), _opts_len(0)
+{
+}
+
+bool packet::parse_frame(const uint8_t* frame, size_t len)
+{
+    if (len < ETH_HLEN)
+        return false;
+
+    size_t off = ETH_HLEN;
+    uint16_t type = get16(frame + offsetof(struct ether_header, ether_type));
+
+    while ((type == ETHERTYPE_VLAN) || (type == ETHERTYPE_QINQ)) {
+        if (len < off + VLAN_TAG_LEN)
+            return false;
+
+        type = get16(frame + off + 2);
+        off += VLAN_TAG_LEN;
+    }
+
+    if (type != ETHERTYPE_IPV6)
+        return false;
+
+    if (len < off + sizeof(struct ip6_hdr))
+        return false;
+
+    const uint8_t* ip6 = frame + off;
+
+    // The version lives in the top nibble of the first byte.
+    if ((ip6[0] >> 4) != 6)
+        return false;
+
+    // ND messages must not have been forwarded by a router.
+    if (ip6[offsetof(struct ip6_hdr, ip6_hlim)] != 255)
+        return false;
+
+    size_t plen = get16(ip6 + offsetof(struct ip6_hdr, ip6_plen));
+
+    off += sizeof(struct ip6_hdr);
+
+    // Frames may be padded to the minimum Ethernet size, but must not
+    // be shorter than the payload length says.
+    if (len < off + plen)
+        return false;
+
+    len = off + plen;
+
+    memcpy(&_saddr, ip6 + offsetof(struct ip6_hdr, ip6_src), sizeof(in6_addr));
+    memcpy(&_daddr, ip6 + offsetof(struct ip6_hdr, ip6_dst), sizeof(in6_addr));
+
+    uint8_t nxt = ip6[offsetof(struct ip6_hdr, ip6_nxt)];
+
+    for (int i = 0; nxt != IPPROTO_ICMPV6; i++) {
+        // Fragmented ND messages are invalid, so only the headers that
+        // may come before the payload of an unfragmented packet are
+        // skipped.
+        if ((i == MAX_EXT_HEADERS) ||
+            ((nxt != IPPROTO_HOPOPTS) && (nxt != IPPROTO_ROUTING) && (nxt != IPPROTO_DSTOPTS)))
+            return false;
+
+        if (len < off + 8)
+            return false;
+
+        size_t hlen = (frame[off + 1] + 1) * 8;
+
+        if (len < off + hlen)
+            return false;
+
+        nxt  = frame[off];
+        off += hlen;
+    }
+
+    return parse_nd(frame + off, len - off);
+}
+
+bool packet::parse_icmp(const uint8_t* msg, size_t len, const in6_addr& saddr)
+{
+    _saddr = saddr;
+    memset(&_daddr, 0, sizeof(in6_addr));
+
+    return parse_nd(msg, len);
+}
+
+bool packet::parse_nd(const uint8_t* msg, size_t len)
+{
+    if (len < sizeof(struct icmp6_hdr))
+        return false;
+
+    _type = msg[offsetof(struct icmp6_hdr, icmp6_type)];
+
+    if (msg[offsetof(struct icmp6_hdr, icmp6_code)] != 0)
+        return false;
+
+    size_t hlen;
+
+    switch (_type) {
+    case ND_NEIGHBOR_SOLICIT:
+        hlen = sizeof(struct nd_neighbor_solicit);
+        _flags = 0;
+        break;
+
+    case ND_NEIGHBOR_ADVERT:
+        hlen = sizeof(struct nd_neighbor_advert);
+        memcpy(&_flags, msg + offsetof(struct nd_neighbor_advert, nd_na_flags_reserved), sizeof(_flags));
+        break;
+
+    default:
+        return false;
+    }
+
+    if (len < hlen)
+        return false;
+
+    // nd_ns_target and nd_na_target are at the same offset.
+    memcpy(&_taddr, msg + offsetof(struct nd_neighbor_solicit, nd_ns_target), sizeof(in6_addr));
+
+    if (IN6_IS_ADDR_MULTICAST(&_taddr))
+        return false;
+
+    _opts     = msg + hlen;
+    _opts_len = len - hlen;
+
+    // Every option has a non-zero length, and they must add up.
+    for (size_t off = 0; off < _opts_len; ) {
+        if (_opts_len - off < 2)
+            return false;
+
+        size_t olen = _opts[off + 1] * 8;
+
+        if (!olen || (olen > _opts_len - off))
+            return false;
+
+        off += olen;
+    }
+
+    return true;
+}
+
+NDPPD_NS_END
@@ -0,0 +1,100 @@
+// ndppd - NDP Proxy Daemon
+// Copyright (C) 2011  Daniel Adolfsson <daniel@priv.nu>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+#pragma once
+
+#include <cstddef>
+#include <stdint.h>
+
+#include <netinet/in.h>
+
+#include "ndppd.h"
+
+NDPPD_NS_BEGIN
+
+// A validated view of a Neighbor Solicitation or Advertisement in a
+// receive buffer. Parsing walks the headers in place, without assuming
+// fixed offsets, and only copies out the addresses - received frames
+// give no alignment guarantees, so they're never accessed in place.
+// The ND options are left in the buffer, and are only valid for as
+// long as it is.
+
+class packet {
+public:
+    packet();
+
+    // Parses an Ethernet frame as read from a PF_PACKET socket. Skips
+    // any 802.1Q/802.1ad tags and IPv6 extension headers, and checks
+    // the message is a well-formed ND message as per RFC 4861, 7.1.
+    bool parse_frame(const uint8_t* frame, size_t len);
+
+    // Parses an ICMPv6 message as read from a raw ICMPv6 socket. The
+    // kernel has already checked the IPv6 header and the checksum.
+    bool parse_icmp(const uint8_t* msg, size_t len, const in6_addr& saddr);
+
+    // Returns ND_NEIGHBOR_SOLICIT or ND_NEIGHBOR_ADVERT.
+    int type() const
+    {
+        return _type;
+    }
+
+    const in6_addr& saddr() const
+    {
+        return _saddr;
+    }
+
+    // Returns the destination address, which is only known for frames.
+    const in6_addr& daddr() const
+    {
+        return _daddr;
+    }
+
+    const in6_addr& taddr() const
+    {
+        return _taddr;
+    }
+
+    // Flags of an advert.
+    uint32_t flags() const
+    {
+        return _flags;
+    }
+
+    const uint8_t* options() const
+    {
+        return _opts;
+    }
+
+    size_t options_len() const
+    {
+        return _opts_len;
+    }
+
+private:
+    in6_addr _saddr, _daddr, _taddr;
+
+    int _type;
+
+    uint32_t _flags;
+
+    const uint8_t* _opts;
+
+    size_t _opts_len;
+
+    // Parses the ICMPv6 part, starting with its header.
+    bool parse_nd(const uint8_t* msg, size_t len);
+};
+
+NDPPD_NS_END
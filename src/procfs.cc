@@ -0,0 +1,202 @@
+// ndppd - NDP Proxy Daemon
+// Copyright (C) 2011  Daniel Adolfsson <daniel@priv.nu>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+#include <cstring>
+#include <string>
+#include <vector>
+#include <list>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "ndppd.h"
+#include "procfs.h"
+
+NDPPD_NS_BEGIN
+
+std::list<std::string> procfs::_names;
+
+// The value of each hex digit, or -1.
+static const signed char hexval[256] = {
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+     0,  1,  2,  3,  4,  5,  6,  7,  8,  9, -1, -1, -1, -1, -1, -1,
+    -1, 10, 11, 12, 13, 14, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, 10, 11, 12, 13, 14, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1
+};
+
+#if defined(__SSE2__)
+
+// Turns 16 hex digits into their values, one per byte. Returns false if
+// any of them isn't a hex digit.
+static inline bool hex_nibbles(__m128i c, __m128i& out)
+{
+    // Anything outside of ASCII is negative, and fails both tests.
+    __m128i digit = _mm_and_si128(_mm_cmpgt_epi8(c, _mm_set1_epi8('0' - 1)),
+                                  _mm_cmpgt_epi8(_mm_set1_epi8('9' + 1), c));
+
+    __m128i lc = _mm_or_si128(c, _mm_set1_epi8(0x20));
+
+    __m128i alpha = _mm_and_si128(_mm_cmpgt_epi8(lc, _mm_set1_epi8('a' - 1)),
+                                  _mm_cmpgt_epi8(_mm_set1_epi8('f' + 1), lc));
+
+    if (_mm_movemask_epi8(_mm_or_si128(digit, alpha)) != 0xffff)
+        return false;
+
+    out = _mm_or_si128(_mm_and_si128(digit, _mm_sub_epi8(c, _mm_set1_epi8('0'))),
+                       _mm_andnot_si128(digit, _mm_sub_epi8(lc, _mm_set1_epi8('a' - 10))));
+    return true;
+}
+
+// Decodes 32 hex digits into 16 bytes.
+static inline bool hex16(const char* str, unsigned char* out)
+{
+    __m128i a, b;
+
+    if (!hex_nibbles(_mm_loadu_si128((const __m128i* )str), a) ||
+        !hex_nibbles(_mm_loadu_si128((const __m128i* )(str + 16)), b))
+        return false;
+
+    // Each 16-bit lane holds the high nibble in its low byte and the low
+    // nibble in its high byte; put them together and pack the lanes.
+    __m128i lo = _mm_set1_epi16(0x00ff);
+
+    a = _mm_or_si128(_mm_slli_epi16(_mm_and_si128(a, lo), 4), _mm_srli_epi16(a, 8));
+    b = _mm_or_si128(_mm_slli_epi16(_mm_and_si128(b, lo), 4), _mm_srli_epi16(b, 8));
+
+    _mm_storeu_si128((__m128i* )out, _mm_packus_epi16(a, b));
+    return true;
+}
+
+#endif
+
+procfs::procfs(const std::string& path) :
+    _path(path), _size(0)
+{
+}
+
+const std::string& procfs::path() const
+{
+    return _path;
+}
+
+int procfs::read()
+{
+    int fd = ::open(_path.c_str(), O_RDONLY | O_CLOEXEC);
+
+    if (fd < 0) {
+        logger::warning() << "Failed to open '" << _path << "': " << logger::err();
+        return -1;
+    }
+
+    // Leave room for the file to grow a bit since last time, so it
+    // normally takes a single read plus the one that finds the end.
+    if (_next.size() < _size + 4096)
+        _next.resize(_size + 4096);
+
+    size_t len = 0;
+
+    for (;;) {
+        if (len + 1 >= _next.size())
+            _next.resize(_next.size() * 2);
+
+        ssize_t n = pread(fd, &_next[len], _next.size() - len - 1, len);
+
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+
+            logger::warning() << "Failed to read '" << _path << "': " << logger::err();
+            close(fd);
+            return -1;
+        }
+
+        if (n == 0)
+            break;
+
+        len += n;
+    }
+
+    close(fd);
+
+    _next[len] = '\0';
+
+    if (!_data.empty() && (len == _size) && !memcmp(&_next[0], &_data[0], len))
+        return 0;
+
+    _data.swap(_next);
+    _size = len;
+    return 1;
+}
+
+const char* procfs::data() const
+{
+    return _data.empty() ? "" : &_data[0];
+}
+
+size_t procfs::size() const
+{
+    return _size;
+}
+
+bool procfs::hex(const char* str, unsigned char* out, size_t size)
+{
+#if defined(__SSE2__)
+    for (; size >= 16; size -= 16, str += 32, out += 16) {
+        if (!hex16(str, out))
+            return false;
+    }
+#endif
+
+    for (size_t i = 0; i < size; i++) {
+        int hi = hexval[(unsigned char)str[i * 2]], lo = hexval[(unsigned char)str[i * 2 + 1]];
+
+        if ((hi < 0) || (lo < 0))
+            return false;
+
+        out[i] = (hi << 4) | lo;
+    }
+
+    return true;
+}
+
+const std::string& procfs::intern(const char* name, size_t len)
+{
+    for (std::list<std::string>::iterator it = _names.begin(); it != _names.end(); it++) {
+        if ((it->size() == len) && !memcmp(it->data(), name, len))
+            return *it;
+    }
+
+    _names.push_back(std::string(name, len));
+    return _names.back();
+}
+
+NDPPD_NS_END
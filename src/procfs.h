@@ -0,0 +1,65 @@
+// ndppd - NDP Proxy Daemon
+// Copyright (C) 2011  Daniel Adolfsson <daniel@priv.nu>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+#pragma once
+
+#include <string>
+#include <vector>
+#include <list>
+
+#include "ndppd.h"
+
+NDPPD_NS_BEGIN
+
+// One of the tables the kernel publishes under /proc/net, which we read
+// when netlink isn't available. The whole file is read in one go into a
+// buffer that's kept between reads, and a read that finds the same
+// contents as last time says so, so the caller can skip parsing it.
+class procfs {
+public:
+    procfs(const std::string& path);
+
+    const std::string& path() const;
+
+    // Reads the file again. Returns 1 if it changed since the last read,
+    // 0 if it didn't, and -1 if it couldn't be read.
+    int read();
+
+    // The contents found by the last read(), followed by a '\0'.
+    const char* data() const;
+
+    size_t size() const;
+
+    // Decodes the 2 * 'size' hex digits at 'str' into 'out'. Returns
+    // false if there's anything but hex digits there.
+    static bool hex(const char* str, unsigned char* out, size_t size);
+
+    // Returns a copy of the 'len' characters at 'name' that's shared by
+    // every caller asking for the same name, so the interface names of a
+    // table don't have to be allocated again for every line.
+    static const std::string& intern(const char* name, size_t len);
+
+private:
+    std::string _path;
+
+    // What the last read() found, and the buffer for the next one.
+    std::vector<char> _data, _next;
+
+    size_t _size;
+
+    static std::list<std::string> _names;
+};
+
+NDPPD_NS_END
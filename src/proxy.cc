@@ -17,6 +17,8 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include <algorithm>
+
 #include "ndppd.h"
 
 #include "proxy.h"
@@ -24,6 +26,8 @@
 #include "iface.h"
 #include "rule.h"
 #include "session.h"
+#include "timer.h"
+#include "stats.h"
 
 NDPPD_NS_BEGIN
         
@@ -31,9 +35,105 @@ static address all_nodes = address("ff02::1");
         
 std::list<ptr<proxy> > proxy::_list;
 
+// Number of targets each proxy remembers in its negative cache.
+static const size_t NEGATIVE_CACHE_SLOTS = 4096;
+
 proxy::proxy() :
-    _router(true), _ttl(30000), _deadtime(3000), _timeout(500), _autowire(false), _keepalive(true), _promiscuous(false), _retries(3)
+    _promiscuous(false), _router(true), _autowire(false), _retries(3), _keepalive(true), _unicast_renew(true), _kernel_neigh(false), _first_responder(false),
+    _ttl(30000), _deadtime(3000), _timeout(500), _renew_jitter(0),
+    _solicit_rate(0), _solicit_burst(0), _rate_drops(0),
+    _max_deadtime(0), _negative_hits(0),
+    _solicits_received(0), _solicits_ignored(0), _solicits_handled(0)
+{
+}
+
+void proxy::drop_sessions()
+{
+    for (std::list<ptr<proxy> >::iterator sit = _list.begin();
+            sit != _list.end(); sit++) {
+        (*sit)->_sessions.clear();
+    }
+}
+
+const std::list<ptr<proxy> >& proxy::list()
+{
+    return _list;
+}
+
+void proxy::neigh_failed(const address& taddr, const std::string& ifname)
+{
+    for (std::list<ptr<proxy> >::iterator it = _list.begin(); it != _list.end(); it++) {
+        const ptr<proxy>& pr = *it;
+
+        if (!pr->_kernel_neigh || pr->_sessions.find(taddr.const_addr()))
+            continue;
+
+        if (pr->find_rule(taddr, ifname))
+            pr->add_failure(taddr, false);
+    }
+}
+
+void proxy::bind_route(const ptr<route>& rt)
+{
+    for (std::list<ptr<proxy> >::iterator it = _list.begin(); it != _list.end(); it++) {
+        const ptr<proxy>& pr = *it;
+
+        if (rt->ifname() == pr->_ifa->name())
+            continue;
+
+        for (rule_vector::iterator r_it = pr->_auto_rules.begin(); r_it != pr->_auto_rules.end(); r_it++) {
+            const address& ra = (*r_it)->addr();
+
+            // Some of the targets of the rule go that way if the two
+            // prefixes overlap.
+            if (address::common_prefix(ra.const_addr(), rt->addr().const_addr()) <
+                    std::min(ra.prefix(), rt->addr().prefix()))
+                continue;
+
+            if (ptr<iface> ifa = rt->ifa())
+                ifa->add_parent(pr);
+
+            break;
+        }
+    }
+}
+
+static void bind_routes_of(const in6_addr& addr, int len, route::route_vector& routes, void* data)
 {
+    for (route::route_vector::iterator it = routes.begin(); it != routes.end(); it++)
+        proxy::bind_route(*it);
+}
+
+void proxy::bind_routes()
+{
+    if (!_auto_rules.empty())
+        route::walk(bind_routes_of, NULL);
+}
+
+bool proxy::any_kernel_neigh()
+{
+    for (std::list<ptr<proxy> >::iterator it = _list.begin(); it != _list.end(); it++) {
+        if ((*it)->_kernel_neigh)
+            return true;
+    }
+
+    return false;
+}
+
+void proxy::remove(const ptr<proxy>& pr)
+{
+    // 'pr' may well be the reference held by _list.
+    ptr<proxy> keep = pr;
+
+    keep->_sessions.clear();
+    keep->replace_rules(std::list<ptr<rule> >());
+
+    keep->_ifa->remove_serves(keep);
+    keep->_ifa->update_daughters();
+
+    _list.remove(keep);
+
+    ND_DEBUG << "proxy::remove() if=" << keep->_ifa->name();
 }
 
 ptr<proxy> proxy::find_aunt(const std::string& ifname, const address& taddr)
@@ -41,23 +141,9 @@ ptr<proxy> proxy::find_aunt(const std::string& ifname, const address& taddr)
     for (std::list<ptr<proxy> >::iterator sit = _list.begin();
             sit != _list.end(); sit++)
     {
-        ptr<proxy> pr = (*sit);
-        
-        bool has_addr = false;
-        for (std::list<ptr<rule> >::iterator it = pr->_rules.begin(); it != pr->_rules.end(); it++) {
-            ptr<rule> ru = *it;
-            
-            if (ru->addr() == taddr) {
-                has_addr = true;
-                break;
-            }
-        }
-        
-        if (has_addr == false) {
-            continue;
-        }
-        
-        if (pr->ifa() && pr->ifa()->name() == ifname)
+        const ptr<proxy>& pr = *sit;
+
+        if (pr->ifa() && pr->ifa()->name() == ifname && pr->find_rule(taddr))
             return pr;
     }
     
@@ -75,7 +161,7 @@ ptr<proxy> proxy::create(const ptr<iface>& ifa, bool promiscuous)
 
     ifa->add_serves(pr);
 
-    logger::debug() << "proxy::create() if=" << ifa->name();
+    ND_DEBUG << "proxy::create() if=" << ifa->name();
 
     return pr;
 }
@@ -93,37 +179,45 @@ ptr<proxy> proxy::open(const std::string& ifname, bool promiscuous)
 
 ptr<session> proxy::find_or_create_session(const address& taddr)
 {
-    // Let's check this proxy's list of sessions to see if we can
-    // find one with the same target address.
+    // Let's check this proxy's sessions to see if we can find one
+    // with the same target address.
 
-    for (std::list<ptr<session> >::iterator sit = _sessions.begin();
-            sit != _sessions.end(); sit++) {
-        
-        if ((*sit)->taddr() == taddr)
-            return (*sit);
-    }
+    ptr<session>* sp = _sessions.find(taddr.const_addr());
+
+    if (sp)
+        return *sp;
     
     ptr<session> se;
     
     // Since we couldn't find a session that matched, we'll try to find
-    // a matching rule instead, and then set up a new session.
-    
-    for (std::list<ptr<rule> >::iterator it = _rules.begin();
-            it != _rules.end(); it++) {
-        ptr<rule> ru = *it;
+    // the rules covering the target instead - most specific prefix first -
+    // and then set up a new session.
+
+    rule_vector* matches[129];
 
-        logger::debug() << "checking " << ru->addr() << " against " << taddr;
+    int cnt = _rule_index.lookup_all(taddr.const_addr(), matches, 129);
+
+    for (int i = 0; i < cnt; i++) {
+        for (rule_vector::iterator it = matches[i]->begin();
+                it != matches[i]->end(); it++) {
+            const ptr<rule>& ru = *it;
+
+            ND_DEBUG << "matched " << ru->addr() << " for " << taddr;
 
-        if (ru->addr() == taddr) {
             if (!se) {
                 se = session::create(_ptr, taddr, _autowire, _keepalive, _retries);
+
+                if (!se)
+                    return se;
             }
             
             if (ru->is_auto()) {
                 ptr<route> rt = route::find(taddr);
 
-                if (rt->ifname() == _ifa->name()) {
-                    logger::debug() << "skipping route since it's using interface " << rt->ifname();
+                if (!rt) {
+                    ND_DEBUG << "no route to " << taddr;
+                } else if (rt->ifname() == _ifa->name()) {
+                    ND_DEBUG << "skipping route since it's using interface " << rt->ifname();
                 } else {
                     ptr<iface> ifa = rt->ifa();
 
@@ -143,10 +237,16 @@ ptr<session> proxy::find_or_create_session(const address& taddr)
                 se->add_iface(ifa);
      
                 #ifdef WITH_ND_NETLINK
-                if (if_addr_find(ifa->name(), &taddr.const_addr())) {
-                    logger::debug() << "Sending NA out " << ifa->name();
+                if (if_addr_find(ifa->ifindex(), taddr.const_addr())) {
+                    ND_DEBUG << "Sending NA out " << ifa->name();
                     se->add_iface(_ifa);
                     se->handle_advert();
+                } else if (_kernel_neigh && if_neigh_find(ifa->ifindex(), taddr.const_addr())) {
+                    // The kernel has already done the work for us, so
+                    // treat its entry as the target's advert.
+                    ND_DEBUG << "kernel knows " << taddr << " on " << ifa->name();
+                    stats::inc(stats::KERNEL_NEIGH_HITS);
+                    se->handle_advert(taddr, ifa->name(), false);
                 }
                 #endif
             }
@@ -154,7 +254,7 @@ ptr<session> proxy::find_or_create_session(const address& taddr)
     }
     
     if (se) {
-        _sessions.push_back(se);
+        _sessions.insert(taddr.const_addr()) = se;
     }
     
     return se;
@@ -162,22 +262,24 @@ ptr<session> proxy::find_or_create_session(const address& taddr)
 
 void proxy::handle_advert(const address& saddr, const address& taddr, const std::string& ifname, bool use_via)
 {
+    // The target is alive after all.
+    _failures.erase(taddr.const_addr());
+
     // If a session exists then process the advert in the context of the session
-    for (std::list<ptr<session> >::iterator s_it = _sessions.begin();
-            s_it != _sessions.end(); s_it++)
-    {
-        const ptr<session> sess = *s_it;
+    ptr<session>* sp = _sessions.find(taddr.const_addr());
 
-        if ((sess->taddr() == taddr)) {
-            sess->handle_advert(saddr, ifname, use_via);
-        }
+    if (sp) {
+        ptr<session> se = *sp;
+        se->handle_advert(saddr, ifname, use_via);
     }
 }
 
 void proxy::handle_stateless_advert(const address& saddr, const address& taddr, const std::string& ifname, bool use_via)
 {
-    logger::debug()
+    ND_DEBUG
         << "proxy::handle_stateless_advert() proxy=" << (ifa() ? ifa()->name() : "null") << ", taddr=" << taddr.to_string() << ", ifname=" << ifname;
+
+    _failures.erase(taddr.const_addr());
     
     ptr<session> se = find_or_create_session(taddr);
     if (!se) return;
@@ -189,12 +291,28 @@ void proxy::handle_stateless_advert(const address& saddr, const address& taddr,
 
 void proxy::handle_solicit(const address& saddr, const address& taddr, const std::string& ifname)
 {
-    logger::debug()
+    ND_DEBUG
         << "proxy::handle_solicit()";
     
+    // Solicits for targets we're already tracking are cheap to answer,
+    // so only new targets count against the rate limits.
+    _solicits_received++;
+
+    if (!_sessions.find(taddr.const_addr())) {
+        if (suppressed(taddr) || !admit(saddr)) {
+            _solicits_ignored++;
+            return;
+        }
+    }
+
     // Otherwise find or create a session to scan for this address
     ptr<session> se = find_or_create_session(taddr);
-    if (!se) return;
+    if (!se) {
+        _solicits_ignored++;
+        return;
+    }
+
+    _solicits_handled++;
     
     // Touching the session will cause an NDP advert to be transmitted to all
     // the daughters
@@ -211,7 +329,7 @@ void proxy::handle_solicit(const address& saddr, const address& taddr, const std
 
             case session::VALID:
             case session::RENEWING:
-                se->send_advert(saddr);
+                se->send_advert(saddr, stats::rx_time());
                 break;
         }
      }
@@ -221,7 +339,10 @@ ptr<rule> proxy::add_rule(const address& addr, const ptr<iface>& ifa, bool autov
 {
     ptr<rule> ru(rule::create(_ptr, addr, ifa));
     ru->autovia(autovia);
+    _ifa->add_daughter(ifa);
     _rules.push_back(ru);
+    _rule_index.insert(addr.const_addr(), addr.prefix()).push_back(ru);
+    iface::filters_changed();
     return ru;
 }
 
@@ -229,9 +350,161 @@ ptr<rule> proxy::add_rule(const address& addr, bool aut)
 {
     ptr<rule> ru(rule::create(_ptr, addr, aut));
     _rules.push_back(ru);
+    _rule_index.insert(addr.const_addr(), addr.prefix()).push_back(ru);
+
+    if (aut) {
+        _auto_rules.push_back(ru);
+        bind_routes();
+    }
+
+    iface::filters_changed();
     return ru;
 }
 
+ptr<rule> proxy::find_rule(const address& addr) const
+{
+    rule_vector* rules = _rule_index.lookup(addr.const_addr());
+
+    if (!rules || rules->empty())
+        return ptr<rule>();
+
+    return rules->front();
+}
+
+ptr<rule> proxy::find_rule(const address& addr, const std::string& ifname) const
+{
+    rule_vector* matches[129];
+
+    int cnt = _rule_index.lookup_all(addr.const_addr(), matches, 129);
+
+    ptr<route> rt;
+
+    for (int i = 0; i < cnt; i++) {
+        for (rule_vector::const_iterator it = matches[i]->begin();
+                it != matches[i]->end(); it++) {
+            if ((*it)->daughter() && (*it)->daughter()->name() == ifname)
+                return *it;
+
+            if ((*it)->is_auto()) {
+                if (!rt && !(rt = route::find(addr)))
+                    continue;
+
+                if (rt->ifname() == ifname)
+                    return *it;
+            }
+        }
+    }
+
+    return ptr<rule>();
+}
+
+static void collect_session(const in6_addr& key, ptr<session>& se, void* data)
+{
+    ((std::vector<ptr<session> >* )data)->push_back(se);
+}
+
+void proxy::collect_sessions(std::vector<ptr<session> >& sessions)
+{
+    _sessions.walk(collect_session, &sessions);
+}
+
+void proxy::replace_rules(const std::list<ptr<rule> >& rules)
+{
+    // Build the new index on the side, so lookups never see a mix of
+    // old and new rules.
+    prefix_trie<rule_vector> index;
+
+    for (std::list<ptr<rule> >::const_iterator it = rules.begin(); it != rules.end(); it++)
+        index.insert((*it)->addr().const_addr(), (*it)->addr().prefix()).push_back(*it);
+
+    for (std::list<ptr<rule> >::iterator it = _rules.begin(); it != _rules.end(); it++) {
+        if ((*it)->daughter())
+            (*it)->daughter()->remove_parent(_ptr);
+    }
+
+    _rules = rules;
+    _rule_index.swap(index);
+    _auto_rules.clear();
+
+    for (std::list<ptr<rule> >::iterator it = _rules.begin(); it != _rules.end(); it++) {
+        if ((*it)->is_auto())
+            _auto_rules.push_back(*it);
+    }
+
+    // Interfaces the old rules bound to are left to the sessions using
+    // them; find_rule() no longer lets their adverts through.
+    bind_routes();
+
+    for (std::list<ptr<rule> >::iterator it = _rules.begin(); it != _rules.end(); it++) {
+        if ((*it)->daughter())
+            (*it)->daughter()->add_parent(_ptr);
+    }
+
+    _ifa->update_daughters();
+
+    std::vector<ptr<session> > sessions;
+    collect_sessions(sessions);
+
+    for (std::vector<ptr<session> >::iterator it = sessions.begin(); it != sessions.end(); it++) {
+        if (!still_covers(*it))
+            _sessions.erase((*it)->taddr().const_addr());
+    }
+
+    ND_DEBUG << "proxy::replace_rules() if=" << _ifa->name() << ", rules=" << _rules.size()
+             << ", sessions=" << _sessions.size();
+}
+
+bool proxy::still_covers(const ptr<session>& se) const
+{
+    rule_vector* matches[129];
+
+    int cnt = _rule_index.lookup_all(se->taddr().const_addr(), matches, 129);
+
+    bool any_auto = false, any_static = false;
+
+    for (int i = 0; i < cnt; i++) {
+        for (rule_vector::iterator it = matches[i]->begin(); it != matches[i]->end(); it++) {
+            if ((*it)->is_auto())
+                any_auto = true;
+            else if (!(*it)->daughter())
+                any_static = true;
+        }
+    }
+
+    if (!cnt)
+        return false;
+
+    const std::list<ptr<iface> >& ifaces = se->ifaces();
+
+    if (ifaces.empty())
+        return any_static || any_auto;
+
+    // Auto rules may have picked any interface.
+    if (any_auto)
+        return true;
+
+    for (std::list<ptr<iface> >::const_iterator i_it = ifaces.begin(); i_it != ifaces.end(); i_it++) {
+        if (*i_it == _ifa)
+            continue;
+
+        bool found = false;
+
+        for (int i = 0; !found && (i < cnt); i++) {
+            for (rule_vector::iterator it = matches[i]->begin(); it != matches[i]->end(); it++) {
+                if ((*it)->daughter() == *i_it) {
+                    found = true;
+                    break;
+                }
+            }
+        }
+
+        if (!found)
+            return false;
+    }
+
+    return true;
+}
+
 std::list<ptr<rule> >::iterator proxy::rules_begin()
 {
     return _rules.begin();
@@ -242,9 +515,114 @@ std::list<ptr<rule> >::iterator proxy::rules_end()
     return _rules.end();
 }
 
+bool proxy::admit(const address& saddr)
+{
+    if (!_solicit_rate && !_source_limit.enabled())
+        return true;
+
+    int64_t now = timer::now();
+
+    if (!_source_limit.admit(saddr.const_addr(), now)) {
+        ND_DEBUG << "proxy::admit() source limit exceeded, saddr=" << saddr;
+        return false;
+    }
+
+    if (_solicit_rate && !_solicit_bucket.take(_solicit_rate, _solicit_burst, now)) {
+        ND_DEBUG << "proxy::admit() solicit limit exceeded, saddr=" << saddr;
+        _rate_drops++;
+        return false;
+    }
+
+    return true;
+}
+
+bool proxy::suppressed(const address& taddr)
+{
+    if (!_failures.enabled())
+        return false;
+
+    int64_t now = timer::now();
+
+    failure* f = _failures.find(taddr.const_addr(), now);
+
+    if (!f || (now >= f->until))
+        return false;
+
+    ND_DEBUG << "proxy::suppressed() taddr=" << taddr << ", strikes=" << f->strikes;
+
+    _negative_hits++;
+    return true;
+}
+
+void proxy::add_failure(const address& taddr, bool held)
+{
+    if (!_failures.enabled())
+        return;
+
+    int64_t now = timer::now();
+
+    failure& f = _failures.insert(taddr.const_addr(), now);
+
+    if (f.strikes && (now < f.forget)) {
+        f.strikes++;
+    } else {
+        f.strikes = 1;
+    }
+
+    // The session was already INVALID for 'deadtime' this time around,
+    // so a single failure doesn't hold the target any longer than
+    // before; after that, the hold doubles up to max-deadtime.
+    int64_t hold = (int64_t)_deadtime * ((1LL << ((f.strikes < 16) ? f.strikes - 1 : 15)) - 1);
+
+    if (hold > _max_deadtime)
+        hold = _max_deadtime;
+
+    if (!held)
+        hold += _deadtime;
+
+    f.until  = now + hold;
+    f.forget = f.until + _max_deadtime;
+
+    ND_DEBUG << "proxy::add_failure() taddr=" << taddr << ", strikes=" << f.strikes << ", hold=" << hold;
+}
+
 void proxy::remove_session(const ptr<session>& se)
 {
-    _sessions.remove(se);
+    ptr<session>* sp = _sessions.find(se->taddr().const_addr());
+
+    if (sp && (*sp == se)) {
+        if (se->status() == session::INVALID)
+            add_failure(se->taddr());
+
+        _sessions.erase(se->taddr().const_addr());
+    }
+}
+
+ptr<session> proxy::restore_session(const address& taddr, const std::list<ptr<iface> >& ifaces, int ttl, bool wired, const address& via)
+{
+    if (_sessions.find(taddr.const_addr()))
+        return ptr<session>();
+
+    // We don't know which of several interfaces a route went through.
+    if (wired && _autowire && (ifaces.size() != 1))
+        return ptr<session>();
+
+    ptr<session> se = session::create(_ptr, taddr, _autowire, _keepalive, _retries);
+
+    if (!se)
+        return se;
+
+    for (std::list<ptr<iface> >::const_iterator it = ifaces.begin(); it != ifaces.end(); it++)
+        se->add_iface(*it);
+
+    if (!still_covers(se))
+        return ptr<session>();
+
+    se->restore(ttl, wired, via);
+
+    _sessions.insert(taddr.const_addr()) = se;
+
+    return se;
 }
 
 const ptr<iface>& proxy::ifa() const
@@ -287,6 +665,36 @@ void proxy::retries(int val)
     _retries = val;
 }
 
+bool proxy::unicast_renew() const
+{
+    return _unicast_renew;
+}
+
+void proxy::unicast_renew(bool val)
+{
+    _unicast_renew = val;
+}
+
+bool proxy::kernel_neigh() const
+{
+    return _kernel_neigh;
+}
+
+void proxy::kernel_neigh(bool val)
+{
+    _kernel_neigh = val;
+}
+
+bool proxy::first_responder() const
+{
+    return _first_responder;
+}
+
+void proxy::first_responder(bool val)
+{
+    _first_responder = val;
+}
+
 bool proxy::keepalive() const
 {
     return _keepalive;
@@ -307,6 +715,26 @@ void proxy::ttl(int val)
     _ttl = (val >= 0) ? val : 30000;
 }
 
+int proxy::renew_jitter() const
+{
+    return _renew_jitter;
+}
+
+void proxy::renew_jitter(int val)
+{
+    _renew_jitter = (val < 0) ? 0 : ((val > 50) ? 50 : val);
+}
+
+int proxy::jittered_ttl() const
+{
+    int spread = (int)((int64_t)_ttl * _renew_jitter / 100);
+
+    if (spread <= 0)
+        return _ttl;
+
+    return _ttl - rand() % (spread + 1);
+}
+
 int proxy::deadtime() const
 {
     return _deadtime;
@@ -327,5 +755,81 @@ void proxy::timeout(int val)
     _timeout = (val >= 0) ? val : 500;
 }
 
-NDPPD_NS_END
+void proxy::solicit_rate(int rate, int burst)
+{
+    rate  = (rate < 0) ? 0 : rate;
+    burst = (burst < 1) ? 1 : burst;
+
+    // Keep the bucket as it is across reloads that don't change it.
+    if ((rate == _solicit_rate) && (burst == _solicit_burst))
+        return;
+
+    _solicit_rate  = rate;
+    _solicit_burst = burst;
+    _solicit_bucket = token_bucket();
+}
+
+void proxy::source_rate(int rate, int burst, int prefix)
+{
+    _source_limit.configure(rate, burst, prefix);
+}
+
+int proxy::max_deadtime() const
+{
+    return _max_deadtime;
+}
+
+void proxy::max_deadtime(int val)
+{
+    _max_deadtime = (val >= 0) ? val : 0;
+
+    // Keep what the cache knows across reloads that leave it on.
+    if (_failures.enabled() != (_max_deadtime != 0))
+        _failures.reset(_max_deadtime ? NEGATIVE_CACHE_SLOTS : 0);
+}
 
+void proxy::write_stats(std::ostream& os)
+{
+    static const char* names[] = {
+        "ndppd_proxy_solicits_received_total",
+        "ndppd_proxy_solicits_ignored_total",
+        "ndppd_proxy_solicits_handled_total",
+        "ndppd_proxy_rate_drops_total",
+        "ndppd_proxy_source_drops_total",
+        "ndppd_proxy_negative_hits_total",
+        "ndppd_proxy_sessions"
+    };
+
+    for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+        os << "# TYPE " << names[i] << ((i == 6) ? " gauge" : " counter") << "\n";
+
+        for (std::list<ptr<proxy> >::iterator it = _list.begin(); it != _list.end(); it++) {
+            const ptr<proxy>& pr = *it;
+
+            uint64_t values[] = {
+                pr->_solicits_received, pr->_solicits_ignored, pr->_solicits_handled,
+                pr->_rate_drops, pr->source_drops(), pr->_negative_hits,
+                pr->_sessions.size()
+            };
+
+            os << names[i] << "{proxy=\"" << pr->_ifa->name() << "\"} " << values[i] << "\n";
+        }
+    }
+}
+
+uint64_t proxy::negative_hits() const
+{
+    return _negative_hits;
+}
+
+uint64_t proxy::rate_drops() const
+{
+    return _rate_drops;
+}
+
+uint64_t proxy::source_drops() const
+{
+    return _source_limit.drops();
+}
+
+NDPPD_NS_END
@@ -18,10 +18,15 @@
 #include <string>
 #include <vector>
 #include <map>
+#include <ostream>
 
 #include <sys/poll.h>
 
 #include "ndppd.h"
+#include "trie.h"
+#include "addr_map.h"
+#include "limiter.h"
+#include "addr_cache.h"
 
 NDPPD_NS_BEGIN
 
@@ -46,14 +51,56 @@ public:
 
     void remove_session(const ptr<session>& se);
 
+    // Sets up a session saved by an earlier run, looking for 'taddr' on
+    // 'ifaces'. Returns NULL if the rules no longer cover it that way.
+    ptr<session> restore_session(const address& taddr, const std::list<ptr<iface> >& ifaces, int ttl, bool wired, const address& via);
+
+    // Appends every session of this proxy to 'sessions'.
+    void collect_sessions(std::vector<ptr<session> >& sessions);
+
+    // Drops the sessions of every proxy, unwiring any routes they added.
+    static void drop_sessions();
+
+    static const std::list<ptr<proxy> >& list();
+
+    // Called when the kernel failed to resolve 'taddr' on the interface
+    // 'ifname'. Proxies mirroring the neighbour table that aren't
+    // already looking for it ignore solicits for it for 'deadtime'.
+    static void neigh_failed(const address& taddr, const std::string& ifname);
+
+    // Returns true if any proxy has 'kernel-neigh' turned on.
+    static bool any_kernel_neigh();
+
+    // Opens the interface of 'rt' and hands the adverts arriving on it
+    // to every proxy with an 'auto' rule that may send solicits that
+    // way, so none of this waits for the first solicit.
+    static void bind_route(const ptr<route>& rt);
+
+    // Takes the proxy out of service, dropping its sessions and rules.
+    // Its interfaces are closed once nothing else uses them.
+    static void remove(const ptr<proxy>& pr);
+
     ptr<rule> add_rule(const address& addr, const ptr<iface>& ifa, bool autovia);
 
     ptr<rule> add_rule(const address& addr, bool aut = false);
     
+    // Swaps in 'rules' in place of the current ones, and drops the
+    // sessions whose targets they no longer send to the same places.
+    // The other sessions carry on as they are.
+    void replace_rules(const std::list<ptr<rule> >& rules);
+
     std::list<ptr<rule> >::iterator rules_begin();
     
     std::list<ptr<rule> >::iterator rules_end();
 
+    // Returns the most specific rule covering addr, or NULL.
+    ptr<rule> find_rule(const address& addr) const;
+
+    // Returns the most specific rule covering addr that forwards to the
+    // interface 'ifname', either directly or, for 'auto' rules, through
+    // the route to addr. Returns NULL if there's none.
+    ptr<rule> find_rule(const address& addr, const std::string& ifname) const;
+
     const ptr<iface>& ifa() const;
     
     bool promiscuous() const;
@@ -74,6 +121,24 @@ public:
 
     void keepalive(bool val);
 
+    // Whether renewals first ask the neighbor that answered last,
+    // rather than the whole segment.
+    bool unicast_renew() const;
+
+    void unicast_renew(bool val);
+
+    // Whether targets the kernel already has a neighbour entry for on
+    // a rule's interface are answered for right away.
+    bool kernel_neigh() const;
+
+    void kernel_neigh(bool val);
+
+    // Whether a session looking for its target on several interfaces
+    // sticks to the first one that answers.
+    bool first_responder() const;
+
+    void first_responder(bool val);
+
     int timeout() const;
 
     void timeout(int val);
@@ -82,10 +147,46 @@ public:
 
     void ttl(int val);
     
+    // How much earlier than 'ttl' sessions may be renewed, in percent,
+    // so the ones that became valid together don't all renew together.
+    int renew_jitter() const;
+
+    void renew_jitter(int val);
+
+    // Returns the time until a session that was just confirmed should
+    // be renewed: 'ttl', less a random part of renew_jitter().
+    int jittered_ttl() const;
+
     int deadtime() const;
 
     void deadtime(int val);
 
+    // Upper bound for how long a target that keeps failing is ignored.
+    // 0 turns off the negative cache.
+    int max_deadtime() const;
+
+    void max_deadtime(int val);
+
+    // Number of solicits ignored because their target was recently
+    // found to be unreachable.
+    uint64_t negative_hits() const;
+
+    // Limits how many solicits for new targets this proxy handles per
+    // second, with room for bursts of up to 'burst'. 0 means no limit.
+    void solicit_rate(int rate, int burst);
+
+    // Limits how many solicits for new targets each source prefix of
+    // length 'prefix' may send per second.
+    void source_rate(int rate, int burst, int prefix);
+
+    // Number of solicits dropped by the per-proxy and per-source limits.
+    uint64_t rate_drops() const;
+
+    uint64_t source_drops() const;
+
+    // Writes the counters of every proxy in the Prometheus text format.
+    static void write_stats(std::ostream& os);
+
 private:
     static std::list<ptr<proxy> > _list;
 
@@ -95,7 +196,20 @@ private:
 
     std::list<ptr<rule> > _rules;
 
-    std::list<ptr<session> > _sessions;
+    typedef std::vector<ptr<rule> > rule_vector;
+
+    // Rules indexed by prefix. Rules sharing the same prefix are kept
+    // in the order they were added.
+    prefix_trie<rule_vector> _rule_index;
+
+    // The 'auto' rules of _rules.
+    rule_vector _auto_rules;
+
+    // Binds every known route to the 'auto' rules.
+    void bind_routes();
+
+    // Sessions owned by this proxy, keyed by target address.
+    addr_map<ptr<session> > _sessions;
     
     bool _promiscuous;
 
@@ -107,8 +221,63 @@ private:
     
     bool _keepalive;
 
+    bool _unicast_renew;
+
+    bool _kernel_neigh;
+
+    bool _first_responder;
+
     int _ttl, _deadtime, _timeout;
 
+    int _renew_jitter;
+
+    token_bucket _solicit_bucket;
+
+    int _solicit_rate, _solicit_burst;
+
+    uint64_t _rate_drops;
+
+    limiter _source_limit;
+
+    // Returns true if the current rules would have set up 'se' the
+    // same way.
+    bool still_covers(const ptr<session>& se) const;
+
+    // Checks the limits above before we start looking for a new target.
+    bool admit(const address& saddr);
+
+    // A target whose session went INVALID and expired. 'strikes' counts
+    // how many times in a row that has happened.
+    struct failure {
+        int strikes;
+
+        // Solicits are ignored until 'until'. If the target fails again
+        // before 'forget', the next hold is twice as long.
+        int64_t until, forget;
+
+        failure() :
+            strikes(0), until(0), forget(0)
+        {
+        }
+    };
+
+    // The negative cache.
+    addr_cache<failure> _failures;
+
+    int _max_deadtime;
+
+    uint64_t _negative_hits;
+
+    uint64_t _solicits_received, _solicits_ignored, _solicits_handled;
+
+    // Returns true if solicits for 'taddr' should be ignored for now.
+    bool suppressed(const address& taddr);
+
+    // Counts a failure to find 'taddr'. Unless 'held', the target hasn't
+    // been ignored as an INVALID session yet, and is held for 'deadtime'
+    // on top of the usual.
+    void add_failure(const address& taddr, bool held = true);
+
     proxy();
 };
 
@@ -42,8 +42,40 @@ class ptr {
     struct ptr_ref {
         T* ptr;
         int wc, sc;
+
+        // Next block on the free list.
+        ptr_ref* next;
     };
 
+    // Control blocks are recycled through a per-type free list instead
+    // of going back to the heap, since sessions come and go all the time.
+    static ptr_ref*& free_refs()
+    {
+        static ptr_ref* head = 0;
+        return head;
+    }
+
+    static ptr_ref* alloc_ref()
+    {
+        ptr_ref*& head = free_refs();
+
+        if (!head) {
+            return new ptr_ref();
+        }
+
+        ptr_ref* ref = head;
+        head = ref->next;
+        return ref;
+    }
+
+    static void free_ref(ptr_ref* ref)
+    {
+        ptr_ref*& head = free_refs();
+
+        ref->next = head;
+        head = ref;
+    }
+
 protected:
     bool _weak;
 
@@ -72,7 +104,7 @@ protected:
     {
         if (!ptr) return;
 
-        _ref      = new ptr_ref();
+        _ref      = alloc_ref();
         _ref->ptr = (T*)ptr;
         _ref->wc  = !!_weak;
         _ref->sc  = !_weak;
@@ -110,7 +142,7 @@ protected:
         }*/
 
         if (!_ref->sc && !_ref->wc) {
-            delete _ref;
+            free_ref(_ref);
         }
 
         _ref = 0;
@@ -0,0 +1,263 @@
+// ndppd - NDP Proxy Daemon
+// Copyright (C) 2011  Daniel Adolfsson <daniel@priv.nu>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+#include <cstring>
+#include <csignal>
+
+#include <errno.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/signalfd.h>
+
+#include "ndppd.h"
+#include "reactor.h"
+#include "stats.h"
+
+NDPPD_NS_BEGIN
+
+int reactor::_epfd = -1;
+
+int reactor::_tfd = -1;
+
+int reactor::_sfd = -1;
+
+reactor::signal_handler reactor::_signal_fn;
+
+int64_t reactor::_armed = -1;
+
+reactor::watch reactor::_tfd_watch;
+
+reactor::watch reactor::_sfd_watch;
+
+struct epoll_event* reactor::_events;
+
+int reactor::_nevents;
+
+int reactor::_spin;
+
+// The most events handled per epoll_wait().
+static const int MAX_EVENTS = 64;
+
+bool reactor::open(signal_handler fn)
+{
+    if ((_epfd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+        logger::error() << "Failed to create epoll set: " << logger::err();
+        return false;
+    }
+
+    if ((_tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)) < 0) {
+        logger::error() << "Failed to create timerfd: " << logger::err();
+        return false;
+    }
+
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    sigaddset(&mask, SIGHUP);
+
+    if (sigprocmask(SIG_BLOCK, &mask, NULL) < 0) {
+        logger::error() << "Failed to block signals: " << logger::err();
+        return false;
+    }
+
+    if ((_sfd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC)) < 0) {
+        logger::error() << "Failed to create signalfd: " << logger::err();
+        return false;
+    }
+
+    _signal_fn = fn;
+    _armed     = -1;
+
+    _tfd_watch.fd = _tfd;
+    _tfd_watch.fn = &reactor::handle_timer;
+
+    _sfd_watch.fd = _sfd;
+    _sfd_watch.fn = &reactor::handle_signal;
+
+    return add(&_tfd_watch) && add(&_sfd_watch);
+}
+
+void reactor::close()
+{
+    if (_sfd >= 0) {
+        ::close(_sfd);
+        _sfd = -1;
+    }
+
+    if (_tfd >= 0) {
+        ::close(_tfd);
+        _tfd = -1;
+    }
+
+    if (_epfd >= 0) {
+        ::close(_epfd);
+        _epfd = -1;
+    }
+}
+
+bool reactor::add(watch* w)
+{
+    if (_epfd < 0)
+        return false;
+
+    struct epoll_event ev;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events   = EPOLLIN;
+    ev.data.ptr = w;
+
+    if (epoll_ctl(_epfd, EPOLL_CTL_ADD, w->fd, &ev) < 0) {
+        logger::error() << "reactor::add() failed! fd=" << w->fd << ", error=" << logger::err();
+        return false;
+    }
+
+    return true;
+}
+
+bool reactor::modify(watch* w, uint32_t events)
+{
+    struct epoll_event ev;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events   = events;
+    ev.data.ptr = w;
+
+    if (epoll_ctl(_epfd, EPOLL_CTL_MOD, w->fd, &ev) < 0) {
+        logger::error() << "reactor::modify() failed! fd=" << w->fd << ", error=" << logger::err();
+        return false;
+    }
+
+    return true;
+}
+
+void reactor::remove(watch* w)
+{
+    if ((_epfd >= 0) && (w->fd >= 0))
+        epoll_ctl(_epfd, EPOLL_CTL_DEL, w->fd, NULL);
+
+    // Make sure we don't hand out events for it later in this round.
+    for (int i = 0; i < _nevents; i++) {
+        if (_events[i].data.ptr == w)
+            _events[i].data.ptr = NULL;
+    }
+}
+
+void reactor::arm_timer()
+{
+    int64_t next = timer::next_deadline();
+
+    if (next == _armed)
+        return;
+
+    struct itimerspec its;
+
+    memset(&its, 0, sizeof(its));
+
+    if (next >= 0) {
+        its.it_value.tv_sec  = next / 1000;
+        its.it_value.tv_nsec = (next % 1000) * 1000000;
+
+        // A zero it_value would disarm the timer instead.
+        if (!its.it_value.tv_sec && !its.it_value.tv_nsec)
+            its.it_value.tv_nsec = 1;
+    }
+
+    if (timerfd_settime(_tfd, TFD_TIMER_ABSTIME, &its, NULL) < 0) {
+        logger::error() << "Failed to arm timerfd: " << logger::err();
+        return;
+    }
+
+    _armed = next;
+}
+
+void reactor::handle_timer(watch* w, uint32_t events)
+{
+    uint64_t expirations;
+
+    while (::read(w->fd, &expirations, sizeof(expirations)) > 0)
+        ;
+
+    _armed = -1;
+}
+
+void reactor::handle_signal(watch* w, uint32_t events)
+{
+    struct signalfd_siginfo si;
+
+    while (::read(w->fd, &si, sizeof(si)) == sizeof(si)) {
+        if (_signal_fn)
+            _signal_fn(si.ssi_signo);
+    }
+}
+
+void reactor::spin(int usec)
+{
+    _spin = (usec < 0) ? 0 : usec;
+}
+
+int reactor::spin()
+{
+    return _spin;
+}
+
+int reactor::run_once()
+{
+    struct epoll_event events[MAX_EVENTS];
+
+    arm_timer();
+
+    int n = 0;
+
+    if (_spin > 0) {
+        int64_t until = stats::now() + _spin;
+
+        while (!(n = epoll_wait(_epfd, events, MAX_EVENTS, 0))) {
+            if (stats::now() >= until)
+                break;
+        }
+    }
+
+    if (!n)
+        n = epoll_wait(_epfd, events, MAX_EVENTS, -1);
+
+    if (n < 0) {
+        if (errno == EINTR)
+            return 0;
+
+        logger::error() << "Failed to wait for events: " << logger::err();
+        return -1;
+    }
+
+    _events  = events;
+    _nevents = n;
+
+    for (int i = 0; i < n; i++) {
+        watch* w = (watch* )events[i].data.ptr;
+
+        if (w && w->fn)
+            w->fn(w, events[i].events);
+    }
+
+    _events  = NULL;
+    _nevents = 0;
+
+    timer::run_expired();
+
+    return 0;
+}
+
+NDPPD_NS_END
@@ -0,0 +1,113 @@
+// ndppd - NDP Proxy Daemon
+// Copyright (C) 2011  Daniel Adolfsson <daniel@priv.nu>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+#pragma once
+
+#include <stdint.h>
+
+#include "ndppd.h"
+
+struct epoll_event;
+
+NDPPD_NS_BEGIN
+
+// The main event loop. Every file descriptor we read from is registered
+// with a single epoll set, together with one timerfd that is kept armed
+// for the earliest pending timer, and one signalfd for the signals we
+// care about. The cost of a wakeup depends only on what is ready.
+
+class reactor {
+public:
+    struct watch;
+
+    typedef void (*handler)(watch* w, uint32_t events);
+
+    typedef void (*signal_handler)(int sig);
+
+    // A file descriptor registered with the reactor. The watch itself
+    // is what epoll hands back, so 'data' and 'role' tell the handler
+    // which object and which of its sockets became ready.
+    struct watch {
+        int fd;
+
+        handler fn;
+
+        void* data;
+
+        int role;
+
+        watch() :
+            fd(-1), fn(0), data(0), role(0)
+        {
+        }
+    };
+
+    // Sets up the epoll set, the timerfd and the signalfd. The signals
+    // SIGINT, SIGTERM and SIGHUP are blocked and delivered to 'fn'.
+    static bool open(signal_handler fn);
+
+    static void close();
+
+    // Starts calling w->fn whenever w->fd becomes readable.
+    static bool add(watch* w);
+
+    static void remove(watch* w);
+
+    // Changes which epoll events w->fn is called for, such as EPOLLOUT
+    // to find out when a socket has room again.
+    static bool modify(watch* w, uint32_t events);
+
+    // Waits for file descriptors, timers and signals, and handles them.
+    static int run_once();
+
+    // Makes run_once() keep polling for up to 'usec' microseconds before
+    // it goes to sleep, trading CPU time for not having to be woken up
+    // when packets come in back to back. 0 turns it off.
+    static void spin(int usec);
+
+    static int spin();
+
+private:
+    static int _epfd;
+
+    static int _tfd;
+
+    static int _sfd;
+
+    static signal_handler _signal_fn;
+
+    // The deadline _tfd is currently armed for, or -1.
+    static int64_t _armed;
+
+    static watch _tfd_watch;
+
+    static watch _sfd_watch;
+
+    // Events returned by the current epoll_wait(), so remove() can
+    // cancel the ones that haven't been handled yet.
+    static struct epoll_event* _events;
+
+    static int _nevents;
+
+    static int _spin;
+
+    static void arm_timer();
+
+    static void handle_timer(watch* w, uint32_t events);
+
+    static void handle_signal(watch* w, uint32_t events);
+};
+
+NDPPD_NS_END
@@ -15,141 +15,216 @@
 // along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include <list>
 #include <memory>
-#include <fstream>
+#include <vector>
+#include <algorithm>
+#include <cstring>
+#include <cctype>
+
+#include <net/if.h>
+#include <net/route.h>
 
 #include "ndppd.h"
 #include "route.h"
+#include "stats.h"
+#include "procfs.h"
 
 NDPPD_NS_BEGIN
 
-std::list<ptr<route> > route::_routes;
+prefix_trie<route::route_vector> route::_routes;
 
 int route::_ttl;
 
-int route::_c_ttl;
+static void update_expired(void* data)
+{
+    route::update();
+}
+
+timer route::_timer(&update_expired);
 
 route::route(const address& addr, const std::string& ifname) :
     _addr(addr), _ifname(ifname)
 {
 }
 
-size_t route::hexdec(const char* str, unsigned char* buf, size_t size)
-{
-    for (size_t i = 0; ; i++) {
-        if (i >= size) {
-            return i;
-        }
+// A route as /proc/net/ipv6_route lists it.
+struct route_entry {
+    in6_addr addr;
 
-        char c1 = tolower(str[i*  2]), c2 = tolower(str[i*  2 + 1]);
+    int prefix;
 
-        if (!isxdigit(c1) || !isxdigit(c2)) {
-            return i;
-        }
+    // Interned by procfs::intern(), so comparing pointers will do.
+    const std::string* ifname;
 
-        if ((c1 >= '0') && (c1 <= '9')) {
-            buf[i] = (c1 - '0') << 4;
-        } else {
-            buf[i] = ((c1 - 'a') + 10) << 4;
-        }
+    bool operator<(const route_entry& e) const
+    {
+        if (int d = memcmp(&addr, &e.addr, sizeof(addr)))
+            return d < 0;
 
-        if ((c2 >= '0') && (c2 <= '9')) {
-            buf[i] |= c2 - '0';
-        } else {
-            buf[i] |= (c2 - 'a') + 10;
-        }
+        if (prefix != e.prefix)
+            return prefix < e.prefix;
+
+        return ifname < e.ifname;
     }
-}
+};
+
+static procfs route_file("");
+
+// The routes the file listed last time, sorted, and the ones it lists
+// now.
+static std::vector<route_entry> route_entries, route_next;
 
-std::string route::token(const char* str)
+void route::load(const std::string& path)
 {
-    while (*str && isspace(*str)) {
-        str++;
-    }
+    ND_DEBUG << "reading routes";
 
-    if (!*str) {
-        return "";
-    }
+    // The entries are what the table holds, whichever file they came
+    // from, so switching files is just another change.
+    if (route_file.path() != path)
+        route_file = procfs(path);
 
-    std::stringstream ss;
+    int changed = route_file.read();
 
-    while (*str && !isspace(*str)) {
-        ss <<* str++;
+    if (changed < 0) {
+        logger::warning() << "Failed to load IPv6 routing data from '" << path << "'";
+        return;
     }
 
-    return ss.str();
-}
+    if (!changed)
+        return;
 
-void route::load(const std::string& path)
-{
-    // Hack to make sure the interfaces are not freed prematurely.
-    std::list<ptr<route> > tmp_routes(_routes);
-    _routes.clear();
+    route_next.clear();
 
-    logger::debug() << "reading routes";
+    for (const char* line = route_file.data(); *line; ) {
+        const char* end = strchr(line, '\n');
 
-    try {
-        std::ifstream ifs;
-        ifs.exceptions(std::ifstream::badbit | std::ifstream::failbit);
-        ifs.open(path.c_str(), std::ios::in);
-        ifs.exceptions(std::ifstream::badbit);
+        if (!end)
+            end = line + strlen(line);
 
-        while (!ifs.eof()) {
-            char buf[1024];
-            ifs.getline(buf, sizeof(buf));
+        const char* next = *end ? end + 1 : end;
 
-            if (ifs.gcount() < 149) {
-                continue;
-            }
+        route_entry e;
 
-            address addr;
+        unsigned char pfx, flags[4];
 
-            unsigned char pfx;
+        // The fields are all of fixed width, up to the interface name.
+        if (((end - line) < 149) ||
+            !procfs::hex(line, e.addr.s6_addr, 16) ||
+            !procfs::hex(line + 33, &pfx, 1) ||
+            !procfs::hex(line + 132, flags, 4)) {
+            line = next;
+            continue;
+        }
 
-            if (route::hexdec(buf, (unsigned char* )&addr.addr(), 16) != 16) {
-                // TODO: Warn here?
-                continue;
-            }
+        // Unreachable and prohibit routes don't lead anywhere.
+        if (flags[2] & (RTF_REJECT >> 8)) {
+            line = next;
+            continue;
+        }
+
+        const char* name = line + 141;
+
+        while ((name < end) && isspace(*name))
+            name++;
+
+        const char* name_end = name;
+
+        while ((name_end < end) && !isspace(*name_end))
+            name_end++;
+
+        e.prefix = (pfx > 128) ? 128 : pfx;
+        e.ifname = &procfs::intern(name, name_end - name);
+
+        route_next.push_back(e);
+        line = next;
+    }
 
-            if (route::hexdec(buf + 33,& pfx, 1) != 1) {
-                // TODO: Warn here?
-                continue;
-            }
+    std::sort(route_next.begin(), route_next.end());
 
-            addr.prefix((int)pfx);
+    // Only the routes that came or went since last time touch the table.
+    std::vector<route_entry>::iterator o_it = route_entries.begin(), n_it = route_next.begin();
 
-            route::create(addr, route::token(buf + 141));
+    int added = 0, removed = 0;
+
+    while ((o_it != route_entries.end()) || (n_it != route_next.end())) {
+        if ((n_it == route_next.end()) || ((o_it != route_entries.end()) && (*o_it < *n_it))) {
+            remove(address(o_it->addr, o_it->prefix), *o_it->ifname);
+            o_it++;
+            removed++;
+        } else if ((o_it == route_entries.end()) || (*n_it < *o_it)) {
+            create(address(n_it->addr, n_it->prefix), *n_it->ifname);
+            n_it++;
+            added++;
+        } else {
+            o_it++;
+            n_it++;
         }
-    } catch (std::ifstream::failure e) {
-        logger::warning() << "Failed to parse IPv6 routing data from '" << path << "'";
-        logger::error() << e.what();
     }
+
+    route_entries.swap(route_next);
+
+    ND_DEBUG << "routes loaded, added=" << added << ", removed=" << removed;
 }
 
-void route::update(int elapsed_time)
+void route::update()
 {
-    if ((_c_ttl -= elapsed_time) <= 0) {
-        load("/proc/net/ipv6_route");
-        _c_ttl = _ttl;
-    }
+    int64_t start = stats::now();
+
+    load("/proc/net/ipv6_route");
+
+    stats::record(stats::ROUTE_RELOAD, stats::now() - start);
+    _timer.start(_ttl);
 }
 
 ptr<route> route::create(const address& addr, const std::string& ifname)
 {
+    // ND_DEBUG << "route::create() addr=" << addr << ", ifname=" << ifname;
+    route_vector& rv = _routes.insert(addr.const_addr(), addr.prefix());
+
+    for (route_vector::iterator it = rv.begin(); it != rv.end(); it++) {
+        if ((*it)->_ifname == ifname)
+            return *it;
+    }
+
     ptr<route> rt(new route(addr, ifname));
-    // logger::debug() << "route::create() addr=" << addr << ", ifname=" << ifname;
-    _routes.push_back(rt);
+    proxy::bind_route(rt);
+
+    rv.push_back(rt);
     return rt;
 }
 
-ptr<route> route::find(const address& addr)
+void route::remove(const address& addr, const std::string& ifname)
 {
-    for (std::list<ptr<route> >::iterator it = _routes.begin();
-            it != _routes.end(); it++) {
-        if ((*it)->addr() == addr)
-            return *it;
+    route_vector* rv = _routes.find(addr.const_addr(), addr.prefix());
+
+    if (!rv)
+        return;
+
+    for (route_vector::iterator it = rv->begin(); it != rv->end(); ) {
+        if (ifname.empty() ? !if_nametoindex((*it)->_ifname.c_str()) : ((*it)->_ifname == ifname)) {
+            it = rv->erase(it);
+        } else {
+            it++;
+        }
     }
 
-    return ptr<route>();
+    if (rv->empty()) {
+        _routes.erase(addr.const_addr(), addr.prefix());
+    }
+}
+
+ptr<route> route::find(const address& addr)
+{
+    route_vector* rv = _routes.lookup(addr.const_addr());
+
+    if (!rv || rv->empty())
+        return ptr<route>();
+
+    return rv->front();
+}
+
+void route::walk(prefix_trie<route_vector>::visitor fn, void* data)
+{
+    _routes.walk(fn, data);
 }
 
 ptr<iface> route::find_and_open(const address& addr)
@@ -171,11 +246,11 @@ const std::string& route::ifname() const
 ptr<iface> route::ifa()
 {
     if (!_ifa) {
-        logger::debug() << "router::ifa() opening interface '" << _ifname << "'";
-        return _ifa = iface::open_ifd(_ifname);
+        ND_DEBUG << "router::ifa() opening interface '" << _ifname << "'";
+        _ifa = iface::open_ifd(_ifname);
     }
 
-    return ptr<iface>();
+    return _ifa;
 }
 
 const address& route::addr() const
@@ -16,24 +16,44 @@
 #pragma once
 
 #include <string>
-#include <list>
+#include <vector>
 #include <memory>
 
 #include "ndppd.h"
+#include "timer.h"
+#include "trie.h"
 
 NDPPD_NS_BEGIN
 
 class route {
 public:
+    // Routes sharing the same prefix, in the order they were added.
+    typedef std::vector<ptr<route> > route_vector;
+
+    // Adds a route for 'addr' through 'ifname', or returns the existing one.
     static ptr<route> create(const address& addr, const std::string& ifname);
 
+    // Removes the route for 'addr' through 'ifname'. An empty 'ifname'
+    // removes the routes for 'addr' through interfaces that no longer
+    // exist.
+    static void remove(const address& addr, const std::string& ifname);
+
+    // Returns the route with the longest prefix covering 'addr'.
     static ptr<route> find(const address& addr);
 
     static ptr<iface> find_and_open(const address& addr);
 
+    // Calls 'fn' for the routes of every prefix in the table.
+    static void walk(prefix_trie<route_vector>::visitor fn, void* data);
+
+    // Brings the table up to date with 'path', in the format of
+    // /proc/net/ipv6_route, only touching the routes that were added or
+    // removed since it was last loaded.
     static void load(const std::string& path);
 
-    static void update(int elapsed_time);
+    // Reloads the table now, and schedules the next reload 'ttl'
+    // milliseconds from now.
+    static void update();
 
     static int ttl();
 
@@ -47,14 +67,10 @@ public:
     
     route(const address& addr, const std::string& ifname);
 
-    static size_t hexdec(const char* str, unsigned char* buf, size_t size);
-
-    static std::string token(const char* str);
-
 private:
     static int _ttl;
 
-    static int _c_ttl;
+    static timer _timer;
 
     address _addr;
 
@@ -62,8 +78,7 @@ private:
 
     ptr<iface> _ifa;
 
-    static std::list<ptr<route> > _routes;
-
+    static prefix_trie<route_vector> _routes;
 };
 
 NDPPD_NS_END
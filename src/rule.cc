@@ -25,8 +25,6 @@
 
 NDPPD_NS_BEGIN
 
-std::vector<interface> interfaces;
-
 bool rule::_any_aut = false;
 
 bool rule::_any_iface = false;
@@ -46,18 +44,13 @@ ptr<rule> rule::create(const ptr<proxy>& pr, const address& addr, const ptr<ifac
     ru->_addr = addr;
     ru->_aut  = false;
     _any_iface = true;
-    unsigned int ifindex;
 
-    ifindex = if_nametoindex(pr->ifa()->name().c_str());
-#ifdef WITH_ND_NETLINK
-    if_add_to_list(ifindex, pr->ifa());
-#endif
-    ifindex = if_nametoindex(ifa->name().c_str());
 #ifdef WITH_ND_NETLINK
-    if_add_to_list(ifindex, ifa);
+    if_add_to_list(pr->ifa());
+    if_add_to_list(ifa);
 #endif
 
-    logger::debug() << "rule::create() if=" << pr->ifa()->name() << ", slave=" << ifa->name() << ", addr=" << addr;
+    ND_DEBUG << "rule::create() if=" << pr->ifa()->name() << ", slave=" << ifa->name() << ", addr=" << addr;
 
     return ru;
 }
@@ -74,7 +67,7 @@ ptr<rule> rule::create(const ptr<proxy>& pr, const address& addr, bool aut)
     if (aut == false)
         _any_static = true;
 
-    logger::debug()
+    ND_DEBUG
         << "rule::create() if=" << pr->ifa()->name().c_str() << ", addr=" << addr
         << ", auto=" << (aut ? "yes" : "no");
 
@@ -75,19 +75,4 @@ private:
     rule();
 };
 
-class interface {
-public:
-    // List of IPv6 addresses on this interface
-    std::list<address> addresses;
-
-    // Index of this interface
-    int ifindex;
-
-    // Name of this interface.
-    std::string _name;
-
-};
-
-extern std::vector<interface> interfaces;
-
 NDPPD_NS_END
@@ -14,94 +14,275 @@
 // You should have received a copy of the GNU General Public License
 // along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include <algorithm>
+#include <cassert>
+#include <cstdlib>
 #include <sstream>
 
+#include <net/if.h>
+
 #include "ndppd.h"
 #include "proxy.h"
 #include "iface.h"
 #include "session.h"
+#include "stats.h"
 
 NDPPD_NS_BEGIN
 
-std::list<weak_ptr<session> > session::_sessions;
-
 static address all_nodes = address("ff02::1");
 
-void session::update_all(int elapsed_time)
+#ifndef WITH_ND_NETLINK
+// Runs an ip(8) command changing a route, and keeps track of how long
+// it took.
+static void run_route_cmd(const std::string& cmd)
 {
-    for (std::list<weak_ptr<session> >::iterator it = _sessions.begin();
-            it != _sessions.end(); ) {
-        if (!*it) {
-            _sessions.erase(it++);
-            continue;
-        }
+    ND_DEBUG << "session::system(" << cmd << ")";
 
-        ptr<session> se = *it++;
+    int64_t start = stats::now();
 
-        if ((se->_ttl -= elapsed_time) >= 0) {
-            continue;
-        }
+    if (system(cmd.c_str()) != 0) {
+        stats::inc(stats::ROUTE_FAILURES);
+    } else {
+        stats::inc(stats::ROUTE_CHANGES);
+    }
+
+    stats::record(stats::WIRING_LATENCY, stats::now() - start);
+}
+#endif
+
+session* session::_inv_head;
+
+session* session::_inv_tail;
+
+int session::_count;
+
+int session::_max;
+
+int session::_waiting;
+
+int session::_max_waiting;
+
+uint64_t session::_full_drops;
+
+uint64_t session::_waiting_drops;
+
+void* session::_free;
+
+size_t session::_blocks;
+
+// Number of sessions allocated at a time when the free list runs dry.
+static const size_t SLAB_SESSIONS = 256;
+
+session::session() :
+    _autowire(false), _keepalive(false), _wired(false), _responder_ifa(0), _touched(false),
+    _npending(0), _timer(&session::expired, this), _fails(0), _retries(0),
+    _status(WAITING), _inv_prev(0), _inv_next(0)
+{
+    _count++;
+    _waiting++;
+
+    stats::inc(stats::SESSIONS_WAITING);
+}
+
+void* session::operator new(size_t size)
+{
+    assert(size == sizeof(session));
 
-        switch (se->_status) {
+    if (!_free)
+        grow(SLAB_SESSIONS);
+
+    void* p = _free;
+    _free = *(void** )p;
+    return p;
+}
+
+void session::operator delete(void* p)
+{
+    if (!p)
+        return;
+
+    *(void** )p = _free;
+    _free = p;
+}
+
+void session::grow(size_t n)
+{
+    char* slab = (char* )::operator new(n * sizeof(session));
+
+    for (size_t i = 0; i < n; i++) {
+        void* p = slab + i * sizeof(session);
+        *(void** )p = _free;
+        _free = p;
+    }
+
+    _blocks += n;
+}
+
+void session::reserve(size_t n)
+{
+    if (n > _blocks)
+        grow(n - _blocks);
+}
+
+void session::max_sessions(int n)
+{
+    _max = (n < 0) ? 0 : n;
+}
+
+int session::max_sessions()
+{
+    return _max;
+}
+
+int session::count()
+{
+    return _count;
+}
+
+void session::max_waiting(int n)
+{
+    _max_waiting = (n < 0) ? 0 : n;
+}
+
+int session::max_waiting()
+{
+    return _max_waiting;
+}
+
+int session::waiting()
+{
+    return _waiting;
+}
+
+uint64_t session::full_drops()
+{
+    return _full_drops;
+}
+
+uint64_t session::waiting_drops()
+{
+    return _waiting_drops;
+}
+
+void session::link_invalid()
+{
+    if (_inv_prev || (_inv_head == this))
+        return;
+
+    _inv_prev = _inv_tail;
+    _inv_next = 0;
+
+    if (_inv_tail) {
+        _inv_tail->_inv_next = this;
+    } else {
+        _inv_head = this;
+    }
+
+    _inv_tail = this;
+}
+
+void session::unlink_invalid()
+{
+    if (!_inv_prev && (_inv_head != this))
+        return;
+
+    if (_inv_prev) {
+        _inv_prev->_inv_next = _inv_next;
+    } else {
+        _inv_head = _inv_next;
+    }
+
+    if (_inv_next) {
+        _inv_next->_inv_prev = _inv_prev;
+    } else {
+        _inv_tail = _inv_prev;
+    }
+
+    _inv_prev = _inv_next = 0;
+}
+
+void session::expired(void* data)
+{
+    // Hold a reference, since we may remove the last one below.
+    ptr<session> se = ((session* )data)->_ptr;
+
+    switch (se->_status) {
+        
+    case session::WAITING:
+        if (se->_fails < se->_retries) {
+            ND_DEBUG << "session will keep trying [taddr=" << se->_taddr << "]";
             
-        case session::WAITING:
-            if (se->_fails < se->_retries) {
-                logger::debug() << "session will keep trying [taddr=" << se->_taddr << "]";
-                
-                se->_ttl     = se->_pr->timeout();
+            // Send another solicit, unless there's no room for it yet,
+            // in which case this try doesn't count.
+            if (se->send_solicit()) {
+                se->_timer.start(se->_pr->timeout());
                 se->_fails++;
-                
-                // Send another solicit
-                se->send_solicit();
             } else {
-                
-                logger::debug() << "session is now invalid [taddr=" << se->_taddr << "]";
-                
-                se->_status = session::INVALID;
-                se->_ttl    = se->_pr->deadtime();
+                se->_timer.start(se->probe_delay());
             }
-            break;
+        } else {
             
-        case session::RENEWING:
-            logger::debug() << "session is became invalid [taddr=" << se->_taddr << "]";
+            ND_DEBUG << "session is now invalid [taddr=" << se->_taddr << "]";
             
-            if (se->_fails < se->_retries) {
-                se->_ttl     = se->_pr->timeout();
-                se->_fails++;
-                
-                // Send another solicit
-                se->send_solicit();
-            } else {            
-                se->_pr->remove_session(se);
-            }
-            break;
+            se->status(session::INVALID);
+            se->_timer.start(se->_pr->deadtime());
+        }
+        break;
+        
+    case session::RENEWING:
+        ND_DEBUG << "session is became invalid [taddr=" << se->_taddr << "]";
+        
+        if (se->_fails < se->_retries) {
+            se->_timer.start(se->_pr->timeout());
+            se->_fails++;
             
-        case session::VALID:            
-            if (se->touched() == true ||
-                se->keepalive() == true)
-            {
-                logger::debug() << "session is renewing [taddr=" << se->_taddr << "]";
-                se->_status  = session::RENEWING;
-                se->_ttl     = se->_pr->timeout();
-                se->_fails   = 0;
-                se->_touched = false;
-
-                // Send another solicit to make sure the route is still valid
-                se->send_solicit();
-            } else {
-                se->_pr->remove_session(se);
-            }            
-            break;
-
-        default:
+            // Send another solicit
+            se->send_solicit();
+        } else {
+            // The target stopped answering, which counts as a failure.
+            se->status(session::INVALID);
             se->_pr->remove_session(se);
         }
+        break;
+        
+    case session::VALID:            
+        if (se->touched() == true ||
+            se->keepalive() == true)
+        {
+            // Sessions nobody asked about are only renewed because of
+            // 'keepalive', so they give way to the ones in use.
+            if (int delay = se->renew_delay(!se->touched())) {
+                se->_timer.start(delay);
+                break;
+            }
+
+            ND_DEBUG << "session is renewing [taddr=" << se->_taddr << "]";
+            se->status(session::RENEWING);
+            se->_timer.start(se->_pr->timeout());
+            se->_fails   = 0;
+            se->_touched = false;
+
+            // Send another solicit to make sure the route is still valid
+            se->send_solicit();
+        } else {
+            se->_pr->remove_session(se);
+        }            
+        break;
+
+    default:
+        se->_pr->remove_session(se);
     }
 }
 
 session::~session()
 {
-    logger::debug() << "session::~session() this=" << logger::format("%x", this);
+    ND_DEBUG << "session::~session() this=" << logger::format("%x", this);
+
+    unlink_invalid();
+    release_probes();
+    _count--;
+
+    if (_status == WAITING)
+        _waiting--;
     
     if (_wired == true) {
         for (std::list<ptr<iface> >::iterator it = _ifaces.begin();
@@ -113,6 +294,29 @@ session::~session()
 
 ptr<session> session::create(const ptr<proxy>& pr, const address& taddr, bool auto_wire, bool keepalive, int retries)
 {
+    if (_max_waiting && (_waiting >= _max_waiting)) {
+        ND_DEBUG << "session::create() at max-waiting, dropping taddr=" << taddr;
+        _waiting_drops++;
+        return ptr<session>();
+    }
+
+    if (_max && (_count >= _max)) {
+        if (!_inv_head) {
+            ND_DEBUG << "session::create() at max-sessions, dropping taddr=" << taddr;
+            _full_drops++;
+            return ptr<session>();
+        }
+
+        // Make room by giving up on the target that has been failing
+        // the longest.
+        ptr<session> old = _inv_head->_ptr;
+
+        ND_DEBUG << "session::create() at max-sessions, evicting taddr=" << old->_taddr;
+
+        old->unlink_invalid();
+        old->_pr->remove_session(old);
+    }
+
     ptr<session> se(new session());
 
     se->_ptr       = se;
@@ -122,12 +326,11 @@ ptr<session> session::create(const ptr<proxy>& pr, const address& taddr, bool au
     se->_keepalive = keepalive;
     se->_retries   = retries;
     se->_wired     = false;
-    se->_ttl       = pr->ttl();
     se->_touched   = false;
 
-    _sessions.push_back(se);
+    se->_timer.start(pr->ttl());
 
-    logger::debug()
+    ND_DEBUG
         << "session::create() pr=" << logger::format("%x", (proxy* )pr) << ", proxy=" << ((pr->ifa()) ? pr->ifa()->name() : "null")
         << ", taddr=" << taddr << " =" << logger::format("%x", (session* )se);
 
@@ -142,25 +345,107 @@ void session::add_iface(const ptr<iface>& ifa)
     _ifaces.push_back(ifa);
 }
 
+int session::renew_delay(bool background)
+{
+    std::list<ptr<iface> >::iterator it;
+
+    // Only take slots once every interface has one, or the ones we got
+    // would be used up while we wait for the rest.
+    for (it = _ifaces.begin(); it != _ifaces.end(); it++) {
+        if (int delay = (*it)->renew_delay(background))
+            return delay;
+    }
+
+    for (it = _ifaces.begin(); it != _ifaces.end(); it++)
+        (*it)->take_renewal(background);
+
+    return 0;
+}
+
+void session::release_probes()
+{
+    for (std::vector<iface*>::iterator it = _probing.begin(); it != _probing.end(); it++)
+        (*it)->release_probe();
+
+    _probing.clear();
+}
+
+int session::probe_delay() const
+{
+    int gap = _pr->timeout() / 4;
+
+    if (gap < 1)
+        gap = 1;
+
+    return gap + rand() % gap;
+}
+
+const std::list<ptr<iface> >& session::ifaces() const
+{
+    return _ifaces;
+}
+
 void session::add_pending(const address& addr)
 {
-    for (std::list<ptr<address> >::iterator ad = _pending.begin(); ad != _pending.end(); ad++) {
-        if (addr == (*ad))
+    for (int i = 0; i < _npending; i++) {
+        if (address::equal(addr.const_addr(), _pending[i].addr))
+            return;
+    }
+
+    for (std::vector<requester>::iterator rq = _more_pending.begin(); rq != _more_pending.end(); rq++) {
+        if (address::equal(addr.const_addr(), rq->addr))
             return;
     }
 
-    _pending.push_back(new address(addr));
+    requester rq;
+    rq.addr  = addr.const_addr();
+    rq.since = stats::rx_time();
+
+    if (_npending < (int)(sizeof(_pending) / sizeof(_pending[0]))) {
+        _pending[_npending++] = rq;
+    } else {
+        _more_pending.push_back(rq);
+    }
 }
 
-void session::send_solicit()
+bool session::send_solicit()
 {
-    logger::debug() << "session::send_solicit() (_ifaces.size() = " << _ifaces.size() << ")";
+    // Renewals start out asking whoever answered last, like NUD does,
+    // so the rest of the segment doesn't have to hear about it. If they
+    // don't answer, the retries go to everyone.
+    if ((_status == RENEWING) && (_fails == 0) && _responder_ifa && _pr->unicast_renew()) {
+        ND_DEBUG << "session::send_solicit() unicast to " << address(_responder) << " on " << _responder_ifa->name();
+        _responder_ifa->write_solicit(_taddr, _responder);
+        return true;
+    }
+
+    ND_DEBUG << "session::send_solicit() (_ifaces.size() = " << _ifaces.size() << ")";
+
+    bool sent = false;
 
     for (std::list<ptr<iface> >::iterator it = _ifaces.begin();
             it != _ifaces.end(); it++) {
-        logger::debug() << " - " << (*it)->name();
-        (*it)->write_solicit(_taddr);
+        iface* ifa = it->get_pointer();
+
+        // New targets hold a probe slot on each interface until they're
+        // found or given up on. Interfaces without a free slot are tried
+        // again on the next retry.
+        if ((_status == WAITING) &&
+                (std::find(_probing.begin(), _probing.end(), ifa) == _probing.end())) {
+            if (!ifa->take_probe()) {
+                ND_DEBUG << " - " << ifa->name() << " has no probe slot free";
+                continue;
+            }
+
+            _probing.push_back(ifa);
+        }
+
+        ND_DEBUG << " - " << ifa->name();
+        ifa->write_solicit(_taddr);
+        sent = true;
     }
+
+    return sent || _ifaces.empty();
 }
 
 void session::touch()
@@ -170,18 +455,20 @@ void session::touch()
         _touched = true;
         
         if (status() == session::WAITING || status() == session::INVALID) {
-            _ttl = _pr->timeout();
+            ND_DEBUG << "session is now probing [taddr=" << _taddr << "]";
             
-            logger::debug() << "session is now probing [taddr=" << _taddr << "]";
-            
-            send_solicit();
+            if (send_solicit()) {
+                _timer.start(_pr->timeout());
+            } else {
+                _timer.start(probe_delay());
+            }
         }
     }
 }
 
-void session::send_advert(const address& daddr)
+void session::send_advert(const address& daddr, int64_t since)
 {
-    _pr->ifa()->write_advert(daddr, _taddr, _pr->router());
+    _pr->ifa()->write_advert(daddr, _taddr, _pr->router(), since);
 }
 
 void session::handle_auto_wire(const address& saddr, const std::string& ifname, bool use_via)
@@ -189,14 +476,26 @@ void session::handle_auto_wire(const address& saddr, const std::string& ifname,
     if (_wired == true && (_wired_via.is_empty() || _wired_via == saddr))
         return;
     
-    logger::debug()
+    ND_DEBUG
         << "session::handle_auto_wire() taddr=" << _taddr << ", ifname=" << ifname;
+
+#ifdef WITH_ND_NETLINK
+    int ifindex = if_nametoindex(ifname.c_str());
+
+    if (!ifindex) {
+        logger::warning() << "Not wiring " << _taddr << ", interface '" << ifname << "' is gone";
+        return;
+    }
+#endif
     
     if (use_via == true &&
         _taddr != saddr &&
         saddr.is_unicast() == true &&
         saddr.is_multicast() == false)
     {
+#ifdef WITH_ND_NETLINK
+        netlink_route_replace(saddr, address(), ifindex);
+#else
         std::stringstream route_cmd;
         route_cmd << "ip";
         route_cmd << " " << "-6";
@@ -206,16 +505,17 @@ void session::handle_auto_wire(const address& saddr, const std::string& ifname,
         route_cmd << " " << "dev";
         route_cmd << " " << ifname;
 
-        logger::debug()
-            << "session::system(" << route_cmd.str() << ")";
-        
-        system(route_cmd.str().c_str());
+        run_route_cmd(route_cmd.str());
+#endif
         
         _wired_via = saddr;
     }
     else
         _wired_via.reset();
     
+#ifdef WITH_ND_NETLINK
+    netlink_route_replace(_taddr, _wired_via, ifindex);
+#else
     {
         std::stringstream route_cmd;
         route_cmd << "ip";
@@ -230,20 +530,27 @@ void session::handle_auto_wire(const address& saddr, const std::string& ifname,
         route_cmd << " " << "dev";
         route_cmd << " " << ifname;
 
-        logger::debug()
-            << "session::system(" << route_cmd.str() << ")";
-
-        system(route_cmd.str().c_str());
+        run_route_cmd(route_cmd.str());
     }
+#endif
     
     _wired = true;
 }
 
 void session::handle_auto_unwire(const std::string& ifname)
 {
-    logger::debug()
+    ND_DEBUG
         << "session::handle_auto_unwire() taddr=" << _taddr << ", ifname=" << ifname;
-    
+
+#ifdef WITH_ND_NETLINK
+    // If the interface is gone, so are its routes.
+    if (int ifindex = if_nametoindex(ifname.c_str())) {
+        netlink_route_delete(_taddr, _wired_via, ifindex);
+
+        if (_wired_via.is_empty() == false)
+            netlink_route_delete(_wired_via, address(), ifindex);
+    }
+#else
     {
         std::stringstream route_cmd;
         route_cmd << "ip";
@@ -258,10 +565,7 @@ void session::handle_auto_unwire(const std::string& ifname)
         route_cmd << " " << "dev";
         route_cmd << " " << ifname;
 
-        logger::debug()
-            << "session::system(" << route_cmd.str() << ")";
-
-        system(route_cmd.str().c_str());
+        run_route_cmd(route_cmd.str());
     }
     
     if (_wired_via.is_empty() == false) {
@@ -274,11 +578,9 @@ void session::handle_auto_unwire(const std::string& ifname)
         route_cmd << " " << "dev";
         route_cmd << " " << ifname;
 
-        logger::debug()
-            << "session::system(" << route_cmd.str() << ")";
-
-        system(route_cmd.str().c_str());
+        run_route_cmd(route_cmd.str());
     }
+#endif
     
     _wired = false;
     _wired_via.reset();
@@ -286,6 +588,31 @@ void session::handle_auto_unwire(const std::string& ifname)
 
 void session::handle_advert(const address& saddr, const std::string& ifname, bool use_via)
 {
+    _responder_ifa = 0;
+
+    ptr<iface> from;
+
+    for (std::list<ptr<iface> >::iterator it = _ifaces.begin(); it != _ifaces.end(); it++) {
+        if ((*it)->name() == ifname) {
+            from = *it;
+            break;
+        }
+    }
+
+    if (from && saddr.is_unicast()) {
+        _responder     = saddr.const_addr();
+        _responder_ifa = from;
+    }
+
+    // The first interface to answer is where the target lives, so the
+    // other interfaces are left alone from here on, renewals included.
+    if (from && (_status == WAITING) && _pr->first_responder() && (_ifaces.size() > 1)) {
+        ND_DEBUG << "session::handle_advert() keeping only " << ifname << " [taddr=" << _taddr << "]";
+        release_probes();
+        _ifaces.clear();
+        _ifaces.push_back(from);
+    }
+
     if (_autowire == true && _status == WAITING) {
         handle_auto_wire(saddr, ifname, use_via);
     }
@@ -296,29 +623,33 @@ void session::handle_advert(const address& saddr, const std::string& ifname, boo
 
 void session::handle_advert()
 {
-    logger::debug()
+    ND_DEBUG
         << "session::handle_advert() taddr=" << _taddr << ", ttl=" << _pr->ttl();
     
     if (_status != VALID) {
-        _status = VALID;
+        status(VALID);
         
-        logger::debug() << "session is active [taddr=" << _taddr << "]";
+        ND_DEBUG << "session is active [taddr=" << _taddr << "]";
     }
     
-    _ttl    = _pr->ttl();
+    _timer.start(_pr->jittered_ttl());
     _fails  = 0;
     
-    if (!_pending.empty()) {
-        for (std::list<ptr<address> >::iterator ad = _pending.begin();
-                ad != _pending.end(); ad++) {
-            ptr<address> addr = (*ad);
-            logger::debug() << " - forward to " << addr;
+    for (int i = 0; i < _npending; i++) {
+        ND_DEBUG << " - forward to " << address(_pending[i].addr);
 
-            send_advert(addr);
-        }
+        send_advert(_pending[i].addr, _pending[i].since);
+    }
 
-        _pending.clear();
+    for (std::vector<requester>::iterator rq = _more_pending.begin();
+            rq != _more_pending.end(); rq++) {
+        ND_DEBUG << " - forward to " << address(rq->addr);
+
+        send_advert(rq->addr, rq->since);
     }
+
+    _npending = 0;
+    _more_pending.clear();
 }
 
 const address& session::taddr() const
@@ -351,6 +682,27 @@ bool session::wired() const
     return _wired;
 }
 
+const address& session::wired_via() const
+{
+    return _wired_via;
+}
+
+int session::ttl_left() const
+{
+    return _timer.remaining();
+}
+
+void session::restore(int ttl, bool wired, const address& via)
+{
+    status(RENEWING);
+    _fails = 0;
+    _timer.start(ttl);
+
+    if (wired && _autowire && !_ifaces.empty()) {
+        handle_auto_wire(via.is_empty() ? _taddr : via, _ifaces.front()->name(), !via.is_empty());
+    }
+}
+
 bool session::touched() const
 {
     return _touched;
@@ -363,6 +715,27 @@ int session::status() const
 
 void session::status(int val)
 {
+    if (val == INVALID) {
+        link_invalid();
+    } else {
+        unlink_invalid();
+    }
+
+    if ((_status == WAITING) != (val == WAITING))
+        _waiting += (val == WAITING) ? 1 : -1;
+
+    if (val != WAITING)
+        release_probes();
+
+    if (_status != val) {
+        switch (val) {
+        case WAITING:  stats::inc(stats::SESSIONS_WAITING); break;
+        case RENEWING: stats::inc(stats::SESSIONS_RENEWING); break;
+        case VALID:    stats::inc(stats::SESSIONS_VALID); break;
+        case INVALID:  stats::inc(stats::SESSIONS_INVALID); break;
+        }
+    }
+
     _status = val;
 }
 
@@ -19,6 +19,7 @@
 #include <string>
 
 #include "ndppd.h"
+#include "timer.h"
 
 NDPPD_NS_BEGIN
 
@@ -31,7 +32,7 @@ private:
 
     weak_ptr<proxy> _pr;
 
-    address _saddr, _daddr, _taddr;
+    address _taddr;
     
     bool _autowire;
     
@@ -40,18 +41,40 @@ private:
     bool _wired;
     
     address _wired_via;
+
+    // Who answered for the target last, and on which of _ifaces. The
+    // first solicit of a renewal goes straight to them.
+    in6_addr _responder;
+
+    iface* _responder_ifa;
     
     bool _touched;
 
     // An array of interfaces this session is monitoring for
     // ND_NEIGHBOR_ADVERT on.
     std::list<ptr<iface> > _ifaces;
+
+    // The interfaces of _ifaces we hold a probe slot on while WAITING.
+    std::vector<iface*> _probing;
     
-    std::list<ptr<address> > _pending;
+    // A host waiting for this session to become valid, and when its
+    // solicit arrived.
+    struct requester {
+        in6_addr addr;
+
+        int64_t since;
+    };
 
-    // The remaining time in miliseconds the object will stay in the
-    // interface's session array or cache.
-    int _ttl;
+    // Requesters waiting for this session to become valid. The first
+    // few are kept inline, so most sessions never allocate for them.
+    requester _pending[2];
+
+    int _npending;
+
+    std::vector<requester> _more_pending;
+
+    // Expires when the session has to probe again, renew or go away.
+    timer _timer;
     
     int _fails;
     
@@ -59,7 +82,49 @@ private:
 
     int _status;
 
-    static std::list<weak_ptr<session> > _sessions;
+    // Links in the list of INVALID sessions, oldest first.
+    session* _inv_prev, * _inv_next;
+
+    static session* _inv_head, * _inv_tail;
+
+    // Number of live sessions, and how many we allow (0 for no limit).
+    static int _count, _max;
+
+    // Number of WAITING sessions, and how many we allow (0 for no limit).
+    static int _waiting, _max_waiting;
+
+    // Number of sessions we refused to create because of the limits.
+    static uint64_t _full_drops, _waiting_drops;
+
+    // Unused session-sized blocks, threaded through their first bytes.
+    static void* _free;
+
+    // Number of session-sized blocks carved out so far.
+    static size_t _blocks;
+
+    // Carves out another 'n' blocks and puts them on _free.
+    static void grow(size_t n);
+
+    // Called by _timer.
+    static void expired(void* data);
+
+    // Returns 0, and takes a slot on each of them, if every interface we
+    // renew through has room for another solicit. Otherwise takes none,
+    // and returns how long to wait before trying again.
+    int renew_delay(bool background);
+
+    // Gives back the probe slots in _probing.
+    void release_probes();
+
+    // How long to wait before trying again when no interface had a
+    // probe slot free.
+    int probe_delay() const;
+
+    void link_invalid();
+
+    void unlink_invalid();
+
+    session();
 
 public:
     enum
@@ -70,14 +135,45 @@ public:
         INVALID   // Invalid;
     };
 
-    static void update_all(int elapsed_time);
-
     // Destructor.
     ~session();
 
+    // Returns NULL if we're at max_sessions() and there's no INVALID
+    // session we could evict to make room.
     static ptr<session> create(const ptr<proxy>& pr, const address& taddr, bool autowire, bool keepalive, int retries);
 
+    // Sessions are carved out of slabs, and freed sessions are reused
+    // rather than returned to the heap.
+    static void* operator new(size_t size);
+
+    static void operator delete(void* p);
+
+    // Carves out room for at least 'n' sessions up front, so creating
+    // that many later doesn't have to touch the heap.
+    static void reserve(size_t n);
+
+    static void max_sessions(int n);
+
+    static int max_sessions();
+
+    static int count();
+
+    static void max_waiting(int n);
+
+    static int max_waiting();
+
+    static int waiting();
+
+    // Returns the number of sessions refused because of max_sessions()
+    // and max_waiting().
+    static uint64_t full_drops();
+
+    static uint64_t waiting_drops();
+
     void add_iface(const ptr<iface>& ifa);
+
+    // The interfaces we're looking for the target on.
+    const std::list<ptr<iface> >& ifaces() const;
     
     void add_pending(const address& addr);
 
@@ -96,6 +192,17 @@ public:
     bool keepalive() const;
     
     bool wired() const;
+
+    // The router the target was wired through, if any.
+    const address& wired_via() const;
+
+    // Milliseconds left before the session has to do something again.
+    int ttl_left() const;
+
+    // Makes this a session for a target that was valid when an earlier
+    // run saved it: it's RENEWING, and probes again in 'ttl' ms. If it
+    // was wired, the route is put back.
+    void restore(int ttl, bool wired, const address& via);
     
     bool touched() const;
 
@@ -113,9 +220,13 @@ public:
     
     void touch();
 
-    void send_advert(const address& daddr);
+    // Sends an advert for our target to 'daddr'. 'since' is when the
+    // solicit it answers arrived, or 0.
+    void send_advert(const address& daddr, int64_t since = 0);
 
-    void send_solicit();
+    // Returns false if nothing was sent because every interface we're
+    // looking through already has as many probes out as it may.
+    bool send_solicit();
 
     void refesh();
 };
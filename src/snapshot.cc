@@ -0,0 +1,342 @@
+// ndppd - NDP Proxy Daemon
+// Copyright (C) 2011  Daniel Adolfsson <daniel@priv.nu>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+#include <cstring>
+#include <cstdio>
+#include <vector>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <errno.h>
+
+#include <net/if.h>
+
+#include "ndppd.h"
+#include "snapshot.h"
+#include "proxy.h"
+#include "iface.h"
+#include "session.h"
+#include "worker.h"
+
+NDPPD_NS_BEGIN
+
+std::string snapshot::_path;
+
+int snapshot::_interval;
+
+timer snapshot::_timer(&snapshot::expired, 0);
+
+// Bump this whenever the layout below changes; older files are then
+// ignored rather than misread.
+static const uint32_t SNAPSHOT_VERSION = 1;
+
+static const char SNAPSHOT_MAGIC[8] = { 'n', 'd', 'p', 'p', 'd', 's', 't', 0 };
+
+struct snapshot_header {
+    char magic[8];
+
+    uint32_t version;
+
+    uint32_t count;
+
+    // Wall clock time of the save, in milliseconds.
+    int64_t saved;
+};
+
+// Followed by 'nifaces' interface names of IFNAMSIZ bytes each.
+struct snapshot_record {
+    struct in6_addr taddr;
+
+    struct in6_addr via;
+
+    // Milliseconds left before the session had to be renewed.
+    int32_t ttl;
+
+    uint8_t wired;
+
+    uint8_t nifaces;
+
+    uint8_t pad[2];
+
+    char proxy[IFNAMSIZ];
+};
+
+static int64_t wall_clock()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void copy_name(char* dst, const std::string& src)
+{
+    memset(dst, 0, IFNAMSIZ);
+    strncpy(dst, src.c_str(), IFNAMSIZ - 1);
+}
+
+void snapshot::path(const std::string& path)
+{
+    _path = path;
+    interval(_interval);
+}
+
+const std::string& snapshot::path()
+{
+    return _path;
+}
+
+void snapshot::interval(int ms)
+{
+    _interval = (ms < 0) ? 0 : ms;
+
+    if (_interval && !_path.empty()) {
+        if (!_timer.pending())
+            _timer.start(_interval);
+    } else {
+        _timer.stop();
+    }
+}
+
+void snapshot::expired(void* data)
+{
+    save();
+    _timer.start(_interval);
+}
+
+bool snapshot::save()
+{
+    if (_path.empty())
+        return true;
+
+    std::vector<uint8_t> buf(sizeof(snapshot_header));
+
+    uint32_t count = 0;
+
+    for (std::list<ptr<proxy> >::const_iterator p_it = proxy::list().begin();
+            p_it != proxy::list().end(); p_it++) {
+        const ptr<proxy>& pr = *p_it;
+
+        std::vector<ptr<session> > sessions;
+        pr->collect_sessions(sessions);
+
+        for (std::vector<ptr<session> >::iterator s_it = sessions.begin(); s_it != sessions.end(); s_it++) {
+            const ptr<session>& se = *s_it;
+
+            // Restored sessions stay RENEWING until they're checked, and
+            // should survive another restart before that.
+            if ((se->status() != session::VALID) && (se->status() != session::RENEWING))
+                continue;
+
+            const std::list<ptr<iface> >& ifaces = se->ifaces();
+
+            if (ifaces.size() > 255)
+                continue;
+
+            snapshot_record rec;
+            memset(&rec, 0, sizeof(rec));
+
+            rec.taddr   = se->taddr().const_addr();
+            rec.via     = se->wired_via().const_addr();
+            rec.ttl     = se->ttl_left();
+            rec.wired   = se->wired();
+            rec.nifaces = ifaces.size();
+            copy_name(rec.proxy, pr->ifa()->name());
+
+            size_t off = buf.size();
+            buf.resize(off + sizeof(rec) + ifaces.size() * IFNAMSIZ);
+            memcpy(&buf[off], &rec, sizeof(rec));
+            off += sizeof(rec);
+
+            for (std::list<ptr<iface> >::const_iterator i_it = ifaces.begin(); i_it != ifaces.end(); i_it++) {
+                copy_name((char* )&buf[off], (*i_it)->name());
+                off += IFNAMSIZ;
+            }
+
+            count++;
+        }
+    }
+
+    snapshot_header hdr;
+    memcpy(hdr.magic, SNAPSHOT_MAGIC, sizeof(hdr.magic));
+    hdr.version = SNAPSHOT_VERSION;
+    hdr.count   = count;
+    hdr.saved   = wall_clock();
+    memcpy(&buf[0], &hdr, sizeof(hdr));
+
+    std::string tmp = _path + ".tmp";
+
+    int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+
+    if (fd < 0) {
+        logger::error() << "Failed to create '" << tmp << "': " << logger::err();
+        return false;
+    }
+
+    size_t done = 0;
+
+    while (done < buf.size()) {
+        ssize_t n = write(fd, &buf[done], buf.size() - done);
+
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+
+            logger::error() << "Failed to write '" << tmp << "': " << logger::err();
+            close(fd);
+            unlink(tmp.c_str());
+            return false;
+        }
+
+        done += n;
+    }
+
+    if ((fsync(fd) < 0) || (close(fd) < 0)) {
+        logger::error() << "Failed to write '" << tmp << "': " << logger::err();
+        unlink(tmp.c_str());
+        return false;
+    }
+
+    if (rename(tmp.c_str(), _path.c_str()) < 0) {
+        logger::error() << "Failed to replace '" << _path << "': " << logger::err();
+        unlink(tmp.c_str());
+        return false;
+    }
+
+    ND_DEBUG << "snapshot::save() path=" << _path << ", sessions=" << count;
+
+    return true;
+}
+
+static ptr<proxy> find_proxy(const std::string& ifname)
+{
+    for (std::list<ptr<proxy> >::const_iterator it = proxy::list().begin();
+            it != proxy::list().end(); it++) {
+        if ((*it)->ifa()->name() == ifname)
+            return *it;
+    }
+
+    return ptr<proxy>();
+}
+
+int snapshot::load()
+{
+    if (_path.empty())
+        return 0;
+
+    int fd = open(_path.c_str(), O_RDONLY | O_CLOEXEC);
+
+    if (fd < 0) {
+        if (errno != ENOENT)
+            logger::warning() << "Failed to open '" << _path << "': " << logger::err();
+        return 0;
+    }
+
+    std::vector<uint8_t> buf;
+    uint8_t chunk[65536];
+    ssize_t n;
+
+    while ((n = read(fd, chunk, sizeof(chunk))) != 0) {
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+
+            logger::warning() << "Failed to read '" << _path << "': " << logger::err();
+            close(fd);
+            return 0;
+        }
+
+        buf.insert(buf.end(), chunk, chunk + n);
+    }
+
+    close(fd);
+
+    snapshot_header hdr;
+
+    if (buf.size() < sizeof(hdr)) {
+        logger::warning() << "Ignoring truncated snapshot '" << _path << "'";
+        return 0;
+    }
+
+    memcpy(&hdr, &buf[0], sizeof(hdr));
+
+    if (memcmp(hdr.magic, SNAPSHOT_MAGIC, sizeof(hdr.magic)) || (hdr.version != SNAPSHOT_VERSION)) {
+        logger::warning() << "Ignoring '" << _path << "', not a snapshot of this version";
+        return 0;
+    }
+
+    // Time spent down counts against what was left of each TTL.
+    int64_t down = wall_clock() - hdr.saved;
+
+    if (down < 0)
+        down = 0;
+
+    size_t off = sizeof(hdr);
+    int restored = 0, skipped = 0;
+
+    for (uint32_t i = 0; i < hdr.count; i++) {
+        snapshot_record rec;
+
+        if (buf.size() - off < sizeof(rec))
+            break;
+
+        memcpy(&rec, &buf[off], sizeof(rec));
+        off += sizeof(rec);
+
+        if (buf.size() - off < (size_t)rec.nifaces * IFNAMSIZ)
+            break;
+
+        std::list<ptr<iface> > ifaces;
+        bool missing = false;
+
+        for (int j = 0; j < rec.nifaces; j++) {
+            char name[IFNAMSIZ];
+            memcpy(name, &buf[off], IFNAMSIZ);
+            name[IFNAMSIZ - 1] = 0;
+            off += IFNAMSIZ;
+
+            if (missing)
+                continue;
+
+            ptr<iface> ifa = iface::open_ifd(name);
+
+            if (!ifa)
+                missing = true;
+            else
+                ifaces.push_back(ifa);
+        }
+
+        rec.proxy[IFNAMSIZ - 1] = 0;
+
+        ptr<proxy> pr = find_proxy(rec.proxy);
+
+        if (missing || !pr || (rec.ttl <= down) || !worker::owns(rec.taddr)) {
+            skipped++;
+            continue;
+        }
+
+        if (pr->restore_session(rec.taddr, ifaces, (int)(rec.ttl - down), rec.wired, rec.via))
+            restored++;
+        else
+            skipped++;
+    }
+
+    logger::notice()
+        << "Restored " << restored << " sessions from '" << _path << "', skipped " << skipped;
+
+    return restored;
+}
+
+NDPPD_NS_END
@@ -0,0 +1,58 @@
+// ndppd - NDP Proxy Daemon
+// Copyright (C) 2011  Daniel Adolfsson <daniel@priv.nu>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+#pragma once
+
+#include <string>
+
+#include "ndppd.h"
+#include "timer.h"
+
+NDPPD_NS_BEGIN
+
+// Saves the valid sessions to a file, so that a restarted ndppd can
+// pick up where the last one left off instead of probing for every
+// target again. Restored sessions start out RENEWING: they're answered
+// for right away, and checked with a solicit once their TTL runs out.
+class snapshot {
+public:
+    // Sets the file to use, or "" to turn snapshots off.
+    static void path(const std::string& path);
+
+    static const std::string& path();
+
+    // Sets how often the snapshot is written, in milliseconds. 0 means
+    // it's only written by save(), on shutdown.
+    static void interval(int ms);
+
+    // Writes the snapshot. The file is replaced in one go, so a crash
+    // half-way through leaves the previous one in place.
+    static bool save();
+
+    // Sets up sessions from the snapshot, skipping the ones the rules
+    // no longer cover. Returns the number of sessions restored.
+    static int load();
+
+private:
+    static std::string _path;
+
+    static int _interval;
+
+    static timer _timer;
+
+    static void expired(void* data);
+};
+
+NDPPD_NS_END
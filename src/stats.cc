@@ -0,0 +1,450 @@
+// ndppd - NDP Proxy Daemon
+// Copyright (C) 2011  Daniel Adolfsson <daniel@priv.nu>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+#include <cstring>
+#include <cstdlib>
+#include <sstream>
+
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "ndppd.h"
+#include "stats.h"
+#include "proxy.h"
+#include "session.h"
+
+NDPPD_NS_BEGIN
+
+const int64_t histogram::_bounds[BUCKETS] = {
+    10, 25, 50, 100, 250, 500,
+    1000, 2500, 5000, 10000, 25000, 50000,
+    100000, 250000, 500000, 1000000, 2500000, 5000000,
+    10000000
+};
+
+histogram::histogram() :
+    _count(0), _sum(0)
+{
+    memset(_buckets, 0, sizeof(_buckets));
+}
+
+void histogram::record(int64_t us)
+{
+    if (us < 0)
+        us = 0;
+
+    int i = 0;
+
+    while ((i < BUCKETS) && (us > _bounds[i]))
+        i++;
+
+    _buckets[i]++;
+    _count++;
+    _sum += us;
+}
+
+void histogram::write(std::ostream& os, const char* name, const std::string& labels) const
+{
+    std::string sep = labels.empty() ? "" : ",";
+    uint64_t cum = 0;
+
+    os << "# TYPE " << name << " histogram\n";
+
+    for (int i = 0; i < BUCKETS; i++) {
+        cum += _buckets[i];
+
+        os << name << "_bucket{" << labels << sep << "le=\"" << (double)_bounds[i] / 1000000 << "\"} " << cum << "\n";
+    }
+
+    os << name << "_bucket{" << labels << sep << "le=\"+Inf\"} " << _count << "\n";
+
+    std::string braces = labels.empty() ? "" : "{" + labels + "}";
+
+    os << name << "_sum" << braces << " " << (double)_sum / 1000000 << "\n";
+    os << name << "_count" << braces << " " << _count << "\n";
+}
+
+uint64_t stats::_counters[COUNTERS];
+
+histogram stats::_timings[TIMINGS];
+
+int64_t stats::_rx_time;
+
+reactor::watch stats::_unix_watch;
+
+reactor::watch stats::_http_watch;
+
+std::string stats::_unix_path;
+
+std::list<stats::client*> stats::_clients;
+
+struct stats::client {
+    reactor::watch watch;
+
+    // The request as read so far, and then the response.
+    std::string buf;
+
+    // How much of the response has been sent.
+    size_t sent;
+
+    // True once 'buf' holds the response, and once we're waiting for
+    // EPOLLOUT to send the rest of it.
+    bool replying, writing;
+
+    // Drops the connection if it's still around by then.
+    timer expiry;
+
+    client() :
+        sent(0), replying(false), writing(false)
+    {
+    }
+};
+
+// How much of an HTTP request we're willing to look at.
+static const size_t MAX_REQUEST = 4096;
+
+// How many connections we serve at once, and for how long, in
+// milliseconds.
+static const size_t MAX_CLIENTS = 16;
+
+static const int CLIENT_TIMEOUT = 5000;
+
+int64_t stats::now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int listen_on(int fd, const struct sockaddr* sa, socklen_t len, const std::string& what)
+{
+    if ((bind(fd, sa, len) < 0) || (listen(fd, 16) < 0)) {
+        logger::error() << "Failed to listen on " << what << ": " << logger::err();
+        ::close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+bool stats::listen_unix(const std::string& path)
+{
+    struct sockaddr_un sun;
+
+    if (path.size() >= sizeof(sun.sun_path)) {
+        logger::error() << "stats-socket path is too long: " << path;
+        return false;
+    }
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+
+    if (fd < 0) {
+        logger::error() << "Failed to create stats socket: " << logger::err();
+        return false;
+    }
+
+    memset(&sun, 0, sizeof(sun));
+    sun.sun_family = AF_UNIX;
+    strcpy(sun.sun_path, path.c_str());
+
+    // Left behind by an earlier instance.
+    unlink(path.c_str());
+
+    if ((fd = listen_on(fd, (struct sockaddr* )&sun, sizeof(sun), path)) < 0)
+        return false;
+
+    _unix_path = path;
+
+    _unix_watch.fd   = fd;
+    _unix_watch.fn   = &stats::handle_io;
+    _unix_watch.role = UNIX_LISTENER;
+
+    return reactor::add(&_unix_watch);
+}
+
+bool stats::listen_http(const std::string& addr, int offset)
+{
+    struct sockaddr_in6 sin6;
+
+    memset(&sin6, 0, sizeof(sin6));
+    sin6.sin6_family = AF_INET6;
+    sin6.sin6_addr   = in6addr_loopback;
+
+    std::string port = addr;
+
+    if (!addr.empty() && (addr[0] == '[')) {
+        std::string::size_type end = addr.find("]:");
+
+        if ((end == std::string::npos) ||
+            (inet_pton(AF_INET6, addr.substr(1, end - 1).c_str(), &sin6.sin6_addr) != 1)) {
+            logger::error() << "Invalid stats-http address: " << addr;
+            return false;
+        }
+
+        port = addr.substr(end + 2);
+    }
+
+    int p = atoi(port.c_str());
+
+    if ((p <= 0) || (p + offset > 65535)) {
+        logger::error() << "Invalid stats-http port: " << addr;
+        return false;
+    }
+
+    sin6.sin6_port = htons(p + offset);
+
+    int fd = socket(AF_INET6, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+
+    if (fd < 0) {
+        logger::error() << "Failed to create stats socket: " << logger::err();
+        return false;
+    }
+
+    int on = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+    if ((fd = listen_on(fd, (struct sockaddr* )&sin6, sizeof(sin6), addr)) < 0)
+        return false;
+
+    _http_watch.fd   = fd;
+    _http_watch.fn   = &stats::handle_io;
+    _http_watch.role = HTTP_LISTENER;
+
+    return reactor::add(&_http_watch);
+}
+
+void stats::close()
+{
+    while (!_clients.empty())
+        drop_client(_clients.front());
+
+    if (_unix_watch.fd >= 0) {
+        reactor::remove(&_unix_watch);
+        ::close(_unix_watch.fd);
+        unlink(_unix_path.c_str());
+        _unix_watch.fd = -1;
+    }
+
+    if (_http_watch.fd >= 0) {
+        reactor::remove(&_http_watch);
+        ::close(_http_watch.fd);
+        _http_watch.fd = -1;
+    }
+}
+
+void stats::drop_client(client* c)
+{
+    _clients.remove(c);
+    reactor::remove(&c->watch);
+    ::close(c->watch.fd);
+    delete c;
+}
+
+void stats::client_expired(void* data)
+{
+    client* c = (client* )data;
+
+    ND_DEBUG << "stats::client_expired() fd=" << c->watch.fd;
+
+    drop_client(c);
+}
+
+void stats::add_client(int fd, bool http)
+{
+    // Anyone who can reach the port can connect, so don't let them pile
+    // up.
+    if (_clients.size() >= MAX_CLIENTS) {
+        ND_DEBUG << "stats::add_client() too many clients";
+        ::close(fd);
+        return;
+    }
+
+    client* c = new client();
+    c->watch.fd   = fd;
+    c->watch.fn   = &stats::handle_io;
+    c->watch.data = c;
+    c->watch.role = CLIENT;
+
+    c->expiry.set_handler(&stats::client_expired, c);
+    c->expiry.start(CLIENT_TIMEOUT);
+
+    _clients.push_back(c);
+
+    if (!reactor::add(&c->watch)) {
+        drop_client(c);
+        return;
+    }
+
+    if (!http) {
+        std::ostringstream os;
+        write(os);
+        reply(c, os.str());
+    }
+}
+
+void stats::reply(client* c, const std::string& data)
+{
+    c->buf      = data;
+    c->sent     = 0;
+    c->replying = true;
+
+    flush(c);
+}
+
+void stats::flush(client* c)
+{
+    while (c->sent < c->buf.size()) {
+        ssize_t len = send(c->watch.fd, c->buf.data() + c->sent, c->buf.size() - c->sent, MSG_NOSIGNAL);
+
+        if (len >= 0) {
+            c->sent += len;
+            continue;
+        }
+
+        if (errno == EINTR)
+            continue;
+
+        // Come back once there's room, as long as the timer allows.
+        if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) {
+            if (!c->writing) {
+                if (!reactor::modify(&c->watch, EPOLLOUT))
+                    break;
+
+                c->writing = true;
+            }
+
+            return;
+        }
+
+        ND_DEBUG << "stats::flush() failed: " << logger::err();
+        break;
+    }
+
+    drop_client(c);
+}
+
+void stats::handle_request(client* c)
+{
+    std::string& req = c->buf;
+    char buf[1024];
+    ssize_t len;
+
+    while ((len = recv(c->watch.fd, buf, sizeof(buf), 0)) > 0) {
+        req.append(buf, len);
+
+        if (req.size() > MAX_REQUEST)
+            break;
+    }
+
+    // The other end went away before finishing its request.
+    if (!len && (req.find("\r\n\r\n") == std::string::npos)) {
+        drop_client(c);
+        return;
+    }
+
+    if ((len < 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK)) &&
+        (req.find("\r\n\r\n") == std::string::npos) && (req.size() <= MAX_REQUEST))
+        return;
+
+    std::ostringstream body, os;
+
+    if ((req.compare(0, 13, "GET /metrics ") == 0) || (req.compare(0, 6, "GET / ") == 0)) {
+        write(body);
+
+        os << "HTTP/1.0 200 OK\r\n"
+           << "Content-Type: text/plain; version=0.0.4\r\n";
+    } else {
+        body << "Not found\n";
+
+        os << "HTTP/1.0 404 Not Found\r\n"
+           << "Content-Type: text/plain\r\n";
+    }
+
+    os << "Content-Length: " << body.str().size() << "\r\n"
+       << "Connection: close\r\n\r\n"
+       << body.str();
+
+    reply(c, os.str());
+}
+
+void stats::handle_io(reactor::watch* w, uint32_t events)
+{
+    if (w->role == CLIENT) {
+        client* c = (client* )w->data;
+
+        if (c->replying)
+            flush(c);
+        else
+            handle_request(c);
+
+        return;
+    }
+
+    int fd;
+
+    while ((fd = accept4(w->fd, 0, 0, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0)
+        add_client(fd, w->role == HTTP_LISTENER);
+}
+
+static void write_counter(std::ostream& os, const char* name, const char* type, uint64_t value)
+{
+    os << "# TYPE " << name << " " << type << "\n"
+       << name << " " << value << "\n";
+}
+
+void stats::write(std::ostream& os)
+{
+    write_counter(os, "ndppd_solicits_received_total", "counter", _counters[SOLICITS_RECEIVED]);
+    write_counter(os, "ndppd_solicits_invalid_total", "counter", _counters[SOLICITS_INVALID]);
+    write_counter(os, "ndppd_solicits_sent_total", "counter", _counters[SOLICITS_SENT]);
+    write_counter(os, "ndppd_solicits_unicast_total", "counter", _counters[SOLICITS_UNICAST]);
+    write_counter(os, "ndppd_adverts_received_total", "counter", _counters[ADVERTS_RECEIVED]);
+    write_counter(os, "ndppd_adverts_invalid_total", "counter", _counters[ADVERTS_INVALID]);
+    write_counter(os, "ndppd_adverts_sent_total", "counter", _counters[ADVERTS_SENT]);
+    write_counter(os, "ndppd_route_changes_total", "counter", _counters[ROUTE_CHANGES]);
+    write_counter(os, "ndppd_route_failures_total", "counter", _counters[ROUTE_FAILURES]);
+    write_counter(os, "ndppd_renewals_deferred_total", "counter", _counters[RENEWALS_DEFERRED]);
+    write_counter(os, "ndppd_kernel_neigh_hits_total", "counter", _counters[KERNEL_NEIGH_HITS]);
+    write_counter(os, "ndppd_probes_deferred_total", "counter", _counters[PROBES_DEFERRED]);
+
+    os << "# TYPE ndppd_session_transitions_total counter\n"
+       << "ndppd_session_transitions_total{state=\"waiting\"} " << _counters[SESSIONS_WAITING] << "\n"
+       << "ndppd_session_transitions_total{state=\"renewing\"} " << _counters[SESSIONS_RENEWING] << "\n"
+       << "ndppd_session_transitions_total{state=\"valid\"} " << _counters[SESSIONS_VALID] << "\n"
+       << "ndppd_session_transitions_total{state=\"invalid\"} " << _counters[SESSIONS_INVALID] << "\n";
+
+    write_counter(os, "ndppd_sessions", "gauge", session::count());
+    write_counter(os, "ndppd_sessions_waiting", "gauge", session::waiting());
+    write_counter(os, "ndppd_sessions_full_drops_total", "counter", session::full_drops());
+    write_counter(os, "ndppd_sessions_waiting_drops_total", "counter", session::waiting_drops());
+
+    proxy::write_stats(os);
+
+    _timings[RESPONSE_LATENCY].write(os, "ndppd_response_latency_seconds");
+    _timings[WIRING_LATENCY].write(os, "ndppd_wiring_latency_seconds");
+    _timings[ROUTE_RELOAD].write(os, "ndppd_route_reload_seconds");
+    _timings[ADDRESS_RELOAD].write(os, "ndppd_address_reload_seconds");
+}
+
+NDPPD_NS_END
@@ -0,0 +1,172 @@
+// ndppd - NDP Proxy Daemon
+// Copyright (C) 2011  Daniel Adolfsson <daniel@priv.nu>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+#pragma once
+
+#include <string>
+#include <list>
+#include <ostream>
+
+#include <stdint.h>
+
+#include "ndppd.h"
+#include "reactor.h"
+#include "timer.h"
+
+NDPPD_NS_BEGIN
+
+// A latency histogram with fixed buckets, from 10us to 10s.
+class histogram {
+public:
+    histogram();
+
+    void record(int64_t us);
+
+    // Writes the histogram in the Prometheus text format.
+    void write(std::ostream& os, const char* name, const std::string& labels = "") const;
+
+private:
+    enum { BUCKETS = 19 };
+
+    static const int64_t _bounds[BUCKETS];
+
+    uint64_t _buckets[BUCKETS + 1];
+
+    uint64_t _count;
+
+    int64_t _sum;
+};
+
+// Counters for the events we care about, and a small server that hands
+// them out in the Prometheus text format over a UNIX socket, HTTP, or
+// both. Everything runs in the main loop, so the counters are plain
+// integers.
+
+class stats {
+public:
+    enum counter {
+        SOLICITS_RECEIVED,
+        SOLICITS_INVALID,
+        SOLICITS_SENT,
+        SOLICITS_UNICAST,
+        ADVERTS_RECEIVED,
+        ADVERTS_INVALID,
+        ADVERTS_SENT,
+        SESSIONS_WAITING,
+        SESSIONS_RENEWING,
+        SESSIONS_VALID,
+        SESSIONS_INVALID,
+        ROUTE_CHANGES,
+        ROUTE_FAILURES,
+        RENEWALS_DEFERRED,
+        KERNEL_NEIGH_HITS,
+        PROBES_DEFERRED,
+        COUNTERS
+    };
+
+    enum timing {
+        // From the arrival of a solicit to the advert answering it.
+        RESPONSE_LATENCY,
+        // From asking for a route to be changed to it being done.
+        WIRING_LATENCY,
+        ROUTE_RELOAD,
+        ADDRESS_RELOAD,
+        TIMINGS
+    };
+
+    static void inc(counter c)
+    {
+        _counters[c]++;
+    }
+
+    static uint64_t get(counter c)
+    {
+        return _counters[c];
+    }
+
+    static void record(timing t, int64_t us)
+    {
+        _timings[t].record(us);
+    }
+
+    // Returns the current time of the monotonic clock, in microseconds.
+    static int64_t now();
+
+    // The time the packets currently being handled were read, which
+    // response latencies are measured from.
+    static int64_t rx_time()
+    {
+        return _rx_time;
+    }
+
+    static void rx_time(int64_t us)
+    {
+        _rx_time = us;
+    }
+
+    // Starts answering connections on the UNIX socket 'path'.
+    static bool listen_unix(const std::string& path);
+
+    // Starts answering HTTP requests for /metrics on 'addr', which is
+    // either a port on ::1, or an IPv6 address and port like [::]:9100.
+    // The port is moved up by 'offset', so workers each get their own.
+    static bool listen_http(const std::string& addr, int offset = 0);
+
+    static void close();
+
+    // Writes every metric in the Prometheus text format.
+    static void write(std::ostream& os);
+
+private:
+    static uint64_t _counters[COUNTERS];
+
+    static histogram _timings[TIMINGS];
+
+    static int64_t _rx_time;
+
+    enum {
+        UNIX_LISTENER, HTTP_LISTENER, CLIENT
+    };
+
+    static reactor::watch _unix_watch, _http_watch;
+
+    static std::string _unix_path;
+
+    struct client;
+
+    // Connections waiting for their request, or for room to send the
+    // rest of the response.
+    static std::list<client*> _clients;
+
+    static void handle_io(reactor::watch* w, uint32_t events);
+
+    // Starts a connection on 'fd'. HTTP clients are read a request from,
+    // the others are sent the metrics right away.
+    static void add_client(int fd, bool http);
+
+    static void handle_request(client* c);
+
+    // Queues 'data' to be sent to 'c', and closes it once it's out.
+    static void reply(client* c, const std::string& data);
+
+    // Sends as much of the response as the socket takes.
+    static void flush(client* c);
+
+    static void drop_client(client* c);
+
+    static void client_expired(void* data);
+};
+
+NDPPD_NS_END
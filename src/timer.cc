@@ -0,0 +1,198 @@
+// ndppd - NDP Proxy Daemon
+// Copyright (C) 2011  Daniel Adolfsson <daniel@priv.nu>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+#include <climits>
+#include <vector>
+
+#include <time.h>
+
+#include "ndppd.h"
+#include "timer.h"
+
+NDPPD_NS_BEGIN
+
+timer::timer(handler fn, void* data) :
+    _fn(fn), _data(data), _deadline(0), _index(-1)
+{
+}
+
+timer::~timer()
+{
+    stop();
+}
+
+std::vector<timer*>& timer::heap()
+{
+    // Never freed, so timers with static storage duration can still
+    // stop themselves while the program is exiting.
+    static std::vector<timer*>* h = new std::vector<timer*>();
+    return *h;
+}
+
+int64_t timer::now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+void timer::set_handler(handler fn, void* data)
+{
+    _fn   = fn;
+    _data = data;
+}
+
+void timer::place(timer* t, int i)
+{
+    heap()[i] = t;
+    t->_index = i;
+}
+
+void timer::sift_up(int i)
+{
+    std::vector<timer*>& h = heap();
+    timer* t = h[i];
+
+    while (i > 0) {
+        int p = (i - 1) / 2;
+
+        if (h[p]->_deadline <= t->_deadline)
+            break;
+
+        place(h[p], i);
+        i = p;
+    }
+
+    place(t, i);
+}
+
+void timer::sift_down(int i)
+{
+    std::vector<timer*>& h = heap();
+    int n = h.size();
+    timer* t = h[i];
+
+    for (;;) {
+        int c = 2 * i + 1;
+
+        if (c >= n)
+            break;
+
+        if ((c + 1 < n) && (h[c + 1]->_deadline < h[c]->_deadline))
+            c++;
+
+        if (t->_deadline <= h[c]->_deadline)
+            break;
+
+        place(h[c], i);
+        i = c;
+    }
+
+    place(t, i);
+}
+
+void timer::start(int ms)
+{
+    // A deadline of "now" could keep run_expired() busy forever if the
+    // handler keeps re-arming the timer.
+    if (ms < 1)
+        ms = 1;
+
+    int64_t old = _deadline;
+
+    _deadline = now() + ms;
+
+    if (_index < 0) {
+        heap().push_back(this);
+        sift_up(heap().size() - 1);
+    } else if (_deadline < old) {
+        sift_up(_index);
+    } else {
+        sift_down(_index);
+    }
+}
+
+void timer::stop()
+{
+    if (_index < 0)
+        return;
+
+    std::vector<timer*>& h = heap();
+
+    int i = _index;
+    timer* last = h.back();
+
+    h.pop_back();
+    _index = -1;
+
+    if (last == this)
+        return;
+
+    place(last, i);
+
+    if ((i > 0) && (h[(i - 1) / 2]->_deadline > last->_deadline))
+        sift_up(i);
+    else
+        sift_down(i);
+}
+
+bool timer::pending() const
+{
+    return _index >= 0;
+}
+
+int timer::remaining() const
+{
+    if (_index < 0)
+        return -1;
+
+    int64_t left = _deadline - now();
+
+    return (left < 0) ? 0 : ((left > INT_MAX) ? INT_MAX : (int)left);
+}
+
+int timer::next_timeout()
+{
+    std::vector<timer*>& h = heap();
+
+    if (h.empty())
+        return -1;
+
+    return h[0]->remaining();
+}
+
+int64_t timer::next_deadline()
+{
+    std::vector<timer*>& h = heap();
+
+    return h.empty() ? -1 : h[0]->_deadline;
+}
+
+void timer::run_expired()
+{
+    std::vector<timer*>& h = heap();
+    int64_t t = now();
+
+    while (!h.empty() && (h[0]->_deadline <= t)) {
+        timer* e = h[0];
+
+        e->stop();
+
+        if (e->_fn)
+            e->_fn(e->_data);
+    }
+}
+
+NDPPD_NS_END
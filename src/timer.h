@@ -0,0 +1,91 @@
+// ndppd - NDP Proxy Daemon
+// Copyright (C) 2011  Daniel Adolfsson <daniel@priv.nu>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+#pragma once
+
+#include <vector>
+#include <stdint.h>
+
+#include "ndppd.h"
+
+NDPPD_NS_BEGIN
+
+// A one-shot timer. All pending timers are kept in a single binary
+// min-heap ordered by deadline, so arming, re-arming and stopping a
+// timer is O(log n), and only timers that are actually due are
+// touched when they expire.
+
+class timer {
+public:
+    typedef void (*handler)(void* data);
+
+    timer(handler fn = 0, void* data = 0);
+
+    // Destructor. Stops the timer if it's pending.
+    ~timer();
+
+    // Sets the function to call when the timer expires.
+    void set_handler(handler fn, void* data);
+
+    // Arms the timer to expire 'ms' milliseconds from now, replacing
+    // any earlier deadline.
+    void start(int ms);
+
+    void stop();
+
+    bool pending() const;
+
+    // Returns the number of milliseconds left before the timer expires,
+    // or -1 if it isn't pending.
+    int remaining() const;
+
+    // Returns the current time of the monotonic clock, in milliseconds.
+    static int64_t now();
+
+    // Returns the number of milliseconds until the next timer expires,
+    // or -1 if there are no pending timers.
+    static int next_timeout();
+
+    // Returns the monotonic time at which the next timer expires, or -1
+    // if there are no pending timers.
+    static int64_t next_deadline();
+
+    // Calls the handler of every timer whose deadline has passed.
+    static void run_expired();
+
+private:
+    handler _fn;
+
+    void* _data;
+
+    int64_t _deadline;
+
+    // Position in the heap, or -1 if the timer isn't pending.
+    int _index;
+
+    static std::vector<timer*>& heap();
+
+    static void sift_up(int i);
+
+    static void sift_down(int i);
+
+    static void place(timer* t, int i);
+
+    timer(const timer&);
+
+    timer& operator=(const timer&);
+};
+
+NDPPD_NS_END
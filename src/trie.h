@@ -0,0 +1,340 @@
+// ndppd - NDP Proxy Daemon
+// Copyright (C) 2011  Daniel Adolfsson <daniel@priv.nu>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+#pragma once
+
+#include <cstddef>
+
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "ndppd.h"
+
+NDPPD_NS_BEGIN
+
+// A path-compressed binary trie keyed on IPv6 prefixes. Every node
+// carries the full prefix it represents, so a lookup visits at most one
+// node per branching bit instead of one per stored prefix. Nodes that
+// only exist to join two branches carry no value.
+
+template <typename T>
+class prefix_trie {
+public:
+    typedef void (*visitor)(const in6_addr& addr, int len, T& value, void* data);
+
+    prefix_trie() :
+        _root(0), _size(0)
+    {
+    }
+
+    ~prefix_trie()
+    {
+        clear();
+    }
+
+    // Returns the value stored for addr/len, creating an empty one if
+    // there was none. Bits beyond 'len' are ignored.
+    T& insert(const in6_addr& addr, int len)
+    {
+        in6_addr key = addr;
+        len = clamp(len);
+        truncate(key, len);
+
+        node** link = &_root;
+
+        while (node* n = *link) {
+            int c = common(n->key, key, (n->len < len) ? n->len : len);
+
+            if (c == n->len) {
+                if (n->len == len) {
+                    return use(n);
+                }
+
+                link = &n->child[bit(key, n->len)];
+                continue;
+            }
+
+            node* m = new node(key, len);
+
+            if (c == len) {
+                // The new prefix covers 'n'.
+                m->child[bit(n->key, len)] = n;
+                *link = m;
+                return use(m);
+            }
+
+            // The prefixes diverge at bit 'c'; join them with a glue node.
+            node* g = new node(key, c);
+            truncate(g->key, c);
+            g->child[bit(n->key, c)] = n;
+            g->child[bit(key, c)]    = m;
+            *link = g;
+            return use(m);
+        }
+
+        *link = new node(key, len);
+        return use(*link);
+    }
+
+    // Returns the value stored for exactly addr/len, or NULL.
+    T* find(const in6_addr& addr, int len) const
+    {
+        len = clamp(len);
+
+        for (node* n = _root; n && (n->len <= len); n = n->child[bit(addr, n->len)]) {
+            if (common(n->key, addr, n->len) != n->len)
+                return 0;
+
+            if (n->len == len)
+                return n->used ? &n->value : 0;
+        }
+
+        return 0;
+    }
+
+    // Returns the value of the longest prefix covering addr, or NULL.
+    T* lookup(const in6_addr& addr) const
+    {
+        T* best = 0;
+
+        for (node* n = _root; n; n = n->child[bit(addr, n->len)]) {
+            if (common(n->key, addr, n->len) != n->len)
+                break;
+
+            if (n->used)
+                best = &n->value;
+
+            if (n->len == 128)
+                break;
+        }
+
+        return best;
+    }
+
+    // Stores the values of up to 'max' prefixes covering addr in 'out',
+    // most specific first, and returns how many were found.
+    int lookup_all(const in6_addr& addr, T** out, int max) const
+    {
+        int cnt = 0;
+
+        for (node* n = _root; n; n = n->child[bit(addr, n->len)]) {
+            if (common(n->key, addr, n->len) != n->len)
+                break;
+
+            if (n->used && (cnt < max))
+                out[cnt++] = &n->value;
+
+            if (n->len == 128)
+                break;
+        }
+
+        for (int i = 0, j = cnt - 1; i < j; i++, j--) {
+            T* tmp = out[i];
+            out[i] = out[j];
+            out[j] = tmp;
+        }
+
+        return cnt;
+    }
+
+    // Removes the value stored for exactly addr/len. Returns false if
+    // there was no such value.
+    bool erase(const in6_addr& addr, int len)
+    {
+        len = clamp(len);
+
+        node** plink = 0;
+        node** link  = &_root;
+
+        while (*link && ((*link)->len < len)) {
+            if (common((*link)->key, addr, (*link)->len) != (*link)->len)
+                return false;
+
+            plink = link;
+            link  = &(*link)->child[bit(addr, (*link)->len)];
+        }
+
+        node* n = *link;
+
+        if (!n || !n->used || (n->len != len) || (common(n->key, addr, len) != len))
+            return false;
+
+        _size--;
+
+        if (n->child[0] && n->child[1]) {
+            n->used  = false;
+            n->value = T();
+            return true;
+        }
+
+        *link = n->child[0] ? n->child[0] : n->child[1];
+        delete n;
+
+        // If that left a glue node with a single branch, fold it away.
+        if (plink) {
+            node* p = *plink;
+
+            if (!p->used && !(p->child[0] && p->child[1])) {
+                *plink = p->child[0] ? p->child[0] : p->child[1];
+                p->child[0] = p->child[1] = 0;
+                delete p;
+            }
+        }
+
+        return true;
+    }
+
+    // Calls 'fn' for every stored prefix in address order.
+    void walk(visitor fn, void* data)
+    {
+        walk(_root, fn, data);
+    }
+
+    // Exchanges the contents of two tries.
+    void swap(prefix_trie& other)
+    {
+        node* root = _root;
+        size_t size = _size;
+
+        _root = other._root;
+        _size = other._size;
+
+        other._root = root;
+        other._size = size;
+    }
+
+    void clear()
+    {
+        destroy(_root);
+        _root = 0;
+        _size = 0;
+    }
+
+    size_t size() const
+    {
+        return _size;
+    }
+
+    bool empty() const
+    {
+        return !_size;
+    }
+
+private:
+    struct node {
+        in6_addr key;
+
+        int len;
+
+        bool used;
+
+        T value;
+
+        node* child[2];
+
+        node(const in6_addr& k, int l) :
+            key(k), len(l), used(false), value()
+        {
+            child[0] = child[1] = 0;
+        }
+    };
+
+    node* _root;
+
+    size_t _size;
+
+    T& use(node* n)
+    {
+        if (!n->used) {
+            n->used = true;
+            _size++;
+        }
+
+        return n->value;
+    }
+
+    static void walk(node* n, visitor fn, void* data)
+    {
+        if (!n)
+            return;
+
+        if (n->used)
+            fn(n->key, n->len, n->value, data);
+
+        walk(n->child[0], fn, data);
+        walk(n->child[1], fn, data);
+    }
+
+    static void destroy(node* n)
+    {
+        if (!n)
+            return;
+
+        destroy(n->child[0]);
+        destroy(n->child[1]);
+        delete n;
+    }
+
+    static int clamp(int len)
+    {
+        return (len < 0) ? 0 : ((len > 128) ? 128 : len);
+    }
+
+    // Returns bit 'i' of 'a', counting from the most significant bit.
+    // Bit 128 is treated as zero so leaf nodes need no special casing.
+    static int bit(const in6_addr& a, int i)
+    {
+        if (i >= 128)
+            return 0;
+
+        return (a.s6_addr[i >> 3] >> (7 - (i & 7))) & 1;
+    }
+
+    // Returns the number of leading bits 'a' and 'b' have in common,
+    // but never more than 'max'.
+    static int common(const in6_addr& a, const in6_addr& b, int max)
+    {
+        for (int w = 0; (w < 4) && (w * 32 < max); w++) {
+            uint32_t x = ntohl(a.s6_addr32[w] ^ b.s6_addr32[w]);
+
+            if (x) {
+                int c = w * 32 + __builtin_clz(x);
+                return (c < max) ? c : max;
+            }
+        }
+
+        return max;
+    }
+
+    // Clears every bit of 'a' past the first 'len'.
+    static void truncate(in6_addr& a, int len)
+    {
+        for (int w = 0; w < 4; w++) {
+            int keep = len - w * 32;
+
+            if (keep <= 0) {
+                a.s6_addr32[w] = 0;
+            } else if (keep < 32) {
+                a.s6_addr32[w] &= htonl(~(0xffffffffU >> keep));
+            }
+        }
+    }
+
+    prefix_trie(const prefix_trie&);
+
+    prefix_trie& operator=(const prefix_trie&);
+};
+
+NDPPD_NS_END
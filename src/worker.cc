@@ -0,0 +1,374 @@
+// ndppd - NDP Proxy Daemon
+// Copyright (C) 2011  Daniel Adolfsson <daniel@priv.nu>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+#include <cstdlib>
+#include <csignal>
+
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include <arpa/inet.h>
+
+#include "ndppd.h"
+#include "worker.h"
+
+NDPPD_NS_BEGIN
+
+int worker::_count;
+
+int worker::_index;
+
+pid_t worker::_parent;
+
+std::vector<pid_t> worker::_pids;
+
+int worker::_ready_fd = -1;
+
+std::vector<int> worker::_ready_fds;
+
+bool worker::_failed;
+
+int worker::_inbox = -1;
+
+std::vector<int> worker::_outboxes;
+
+reactor::watch worker::_inbox_watch;
+
+worker::message_handler worker::_message_fn;
+
+// How long a worker may take to reload before we move on to the next
+// one, in milliseconds.
+static const int RELOAD_TIMEOUT = 30000;
+
+static void supervised_signals(sigset_t* set)
+{
+    sigemptyset(set);
+    sigaddset(set, SIGINT);
+    sigaddset(set, SIGTERM);
+    sigaddset(set, SIGHUP);
+    sigaddset(set, SIGCHLD);
+}
+
+bool worker::start(int count)
+{
+    sigset_t set, old;
+
+    supervised_signals(&set);
+
+    // Nothing may slip through before supervise() is waiting for it.
+    sigprocmask(SIG_BLOCK, &set, &old);
+
+    _count  = count;
+    _parent = getpid();
+
+    // One socket pair per worker, so they can hand each other work.
+    std::vector<int> inboxes;
+
+    for (int i = 0; i < count; i++) {
+        int fds[2];
+
+        if (socketpair(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0, fds) < 0) {
+            logger::error() << "Failed to create socket pair: " << logger::err();
+            _failed = true;
+            break;
+        }
+
+        inboxes.push_back(fds[0]);
+        _outboxes.push_back(fds[1]);
+    }
+
+    for (int i = 0; !_failed && (i < count); i++) {
+        int fds[2];
+
+        if (pipe(fds) < 0) {
+            logger::error() << "Failed to create pipe: " << logger::err();
+            _failed = true;
+            break;
+        }
+
+        pid_t pid = fork();
+
+        if (pid < 0) {
+            logger::error() << "Failed to fork worker: " << logger::err();
+            ::close(fds[0]);
+            ::close(fds[1]);
+            _failed = true;
+            break;
+        }
+
+        if (pid == 0) {
+            ::close(fds[0]);
+
+            for (size_t j = 0; j < _ready_fds.size(); j++)
+                ::close(_ready_fds[j]);
+
+            _pids.clear();
+            _ready_fds.clear();
+            _index    = i;
+            _ready_fd = fds[1];
+
+            for (int j = 0; j < count; j++) {
+                if (j == i)
+                    _inbox = inboxes[j];
+                else
+                    ::close(inboxes[j]);
+            }
+
+            sigprocmask(SIG_SETMASK, &old, 0);
+            return false;
+        }
+
+        ::close(fds[1]);
+
+        _pids.push_back(pid);
+        _ready_fds.push_back(fds[0]);
+
+        // Wait for the worker to open its sockets. If it fails, the pipe
+        // is closed without a word.
+        if (!wait_ready(i, -1)) {
+            logger::error() << "Worker " << i << " failed to start";
+            _failed = true;
+            break;
+        }
+
+        logger::notice() << "Started worker " << i << " (pid " << pid << ")";
+    }
+
+    // Only the workers talk to each other.
+    for (size_t i = 0; i < inboxes.size(); i++) {
+        ::close(inboxes[i]);
+        ::close(_outboxes[i]);
+    }
+
+    _outboxes.clear();
+
+    if (_failed)
+        stop_all(SIGTERM);
+
+    return true;
+}
+
+void worker::notify_parent()
+{
+    if (_ready_fd < 0)
+        return;
+
+    char c = 1;
+
+    if (write(_ready_fd, &c, 1) != 1)
+        logger::error() << "Failed to notify parent: " << logger::err();
+}
+
+void worker::ready()
+{
+    notify_parent();
+}
+
+void worker::reloaded()
+{
+    notify_parent();
+}
+
+bool worker::wait_ready(int index, int timeout)
+{
+    struct pollfd pfd;
+    pfd.fd     = _ready_fds[index];
+    pfd.events = POLLIN;
+
+    int res;
+
+    while (((res = poll(&pfd, 1, timeout)) < 0) && (errno == EINTR))
+        ;
+
+    if (res <= 0)
+        return false;
+
+    char c;
+    ssize_t len;
+
+    while (((len = read(pfd.fd, &c, 1)) < 0) && (errno == EINTR))
+        ;
+
+    return len == 1;
+}
+
+void worker::reload_all()
+{
+    for (size_t i = 0; i < _pids.size(); i++) {
+        if (_pids[i] <= 0)
+            continue;
+
+        kill(_pids[i], SIGHUP);
+
+        // If it's gone, SIGCHLD will tell us in a moment.
+        if (!wait_ready(i, RELOAD_TIMEOUT))
+            logger::error() << "Worker " << i << " didn't finish reloading";
+    }
+}
+
+void worker::stop_all(int sig)
+{
+    for (std::vector<pid_t>::iterator it = _pids.begin(); it != _pids.end(); it++) {
+        if (*it > 0)
+            kill(*it, sig);
+    }
+}
+
+int worker::supervise()
+{
+    sigset_t set;
+
+    supervised_signals(&set);
+
+    bool stopping = _failed;
+
+    int live = _pids.size(), rc = _failed ? 1 : 0;
+
+    while (live > 0) {
+        int sig = sigwaitinfo(&set, 0);
+
+        if (sig < 0) {
+            if (errno == EINTR)
+                continue;
+
+            logger::error() << "sigwaitinfo() failed: " << logger::err();
+            stop_all(SIGTERM);
+            rc = 1;
+            break;
+        }
+
+        if (sig == SIGHUP) {
+            reload_all();
+            continue;
+        }
+
+        if (sig != SIGCHLD) {
+            if (!stopping)
+                logger::error() << "Shutting down...";
+
+            stopping = true;
+            stop_all(SIGTERM);
+            continue;
+        }
+
+        pid_t pid;
+        int status;
+
+        while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+            for (std::vector<pid_t>::iterator it = _pids.begin(); it != _pids.end(); it++) {
+                if (*it != pid)
+                    continue;
+
+                *it = 0;
+                live--;
+
+                if (!stopping) {
+                    // The other workers keep their fanout slots, so
+                    // rather than rehashing we start over.
+                    logger::error() << "Worker " << (it - _pids.begin()) << " exited, shutting down";
+                    stopping = true;
+                    rc = 1;
+                    stop_all(SIGTERM);
+                }
+                break;
+            }
+        }
+    }
+
+    // Reap anything left over.
+    while (waitpid(-1, 0, 0) > 0)
+        ;
+
+    logger::notice() << "Bye";
+
+    return rc;
+}
+
+int worker::count()
+{
+    return _count;
+}
+
+int worker::index()
+{
+    return _index;
+}
+
+int worker::fanout_group(int ifindex)
+{
+    return (int)(((uint32_t)_parent + ifindex) & 0xffff);
+}
+
+uint32_t worker::hash(const in6_addr& taddr)
+{
+    return ntohl(taddr.s6_addr32[2]) ^ ntohl(taddr.s6_addr32[3]);
+}
+
+int worker::owner(const in6_addr& taddr)
+{
+    if (_count <= 1)
+        return _index;
+
+    return (int)(hash(taddr) % _count);
+}
+
+bool worker::owns(const in6_addr& taddr)
+{
+    return owner(taddr) == _index;
+}
+
+bool worker::listen(message_handler fn)
+{
+    if (_inbox < 0)
+        return true;
+
+    _message_fn = fn;
+
+    _inbox_watch.fd = _inbox;
+    _inbox_watch.fn = &worker::handle_inbox;
+
+    return reactor::add(&_inbox_watch);
+}
+
+void worker::handle_inbox(reactor::watch* w, uint32_t events)
+{
+    uint8_t buf[512];
+    ssize_t len;
+
+    while ((len = recv(w->fd, buf, sizeof(buf), 0)) > 0) {
+        if (_message_fn)
+            _message_fn(buf, len);
+    }
+}
+
+bool worker::send(int index, const void* msg, size_t len)
+{
+    if ((index < 0) || (index >= (int)_outboxes.size()))
+        return false;
+
+    if (::send(_outboxes[index], msg, len, 0) < 0) {
+        ND_DEBUG << "worker::send() to " << index << " failed: " << logger::err();
+        return false;
+    }
+
+    return true;
+}
+
+NDPPD_NS_END
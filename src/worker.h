@@ -0,0 +1,130 @@
+// ndppd - NDP Proxy Daemon
+// Copyright (C) 2011  Daniel Adolfsson <daniel@priv.nu>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+#pragma once
+
+#include <vector>
+#include <cstddef>
+#include <stdint.h>
+
+#include <sys/types.h>
+#include <netinet/in.h>
+
+#include "ndppd.h"
+#include "reactor.h"
+
+NDPPD_NS_BEGIN
+
+// Optional multi-process mode. The parent forks 'workers' copies of the
+// daemon, each with its own sockets, sessions and tables, and then just
+// supervises them. The PF_PACKET sockets of the workers are joined into
+// one fanout group per interface, and the kernel hands each solicit to
+// a worker chosen by a hash of its target, so every target is handled
+// by exactly one worker.
+
+class worker {
+public:
+    // Forks 'count' workers, one at a time, waiting for each to call
+    // ready() before starting the next one so they join the fanout
+    // groups in order. Returns true in the parent, and false in the
+    // workers, which should carry on starting up.
+    static bool start(int count);
+
+    // Tells the parent this worker has opened all of its sockets.
+    static void ready();
+
+    // Tells the parent this worker is done with a SIGHUP.
+    static void reloaded();
+
+    // Waits for the workers to exit, forwarding SIGINT, SIGTERM and
+    // SIGHUP to them. SIGHUP goes to one worker at a time, each after
+    // the previous one called reloaded(), so proxies added on reload
+    // join the fanout groups in order too. If one of them exits on its
+    // own, the others are stopped as well. Returns the exit code for
+    // the parent.
+    static int supervise();
+
+    // Returns the total number of workers (0 if the mode is off), and
+    // which one we are.
+    static int count();
+
+    static int index();
+
+    // Returns the fanout group id to use for the interface 'ifindex'.
+    static int fanout_group(int ifindex);
+
+    // Returns the hash the fanout program computes for 'taddr'.
+    static uint32_t hash(const in6_addr& taddr);
+
+    // Returns the index of the worker solicits for 'taddr' are sent to.
+    static int owner(const in6_addr& taddr);
+
+    // Returns true if this worker is the one solicits for 'taddr' are
+    // sent to.
+    static bool owns(const in6_addr& taddr);
+
+    typedef void (*message_handler)(const uint8_t* msg, size_t len);
+
+    // Starts calling 'fn' for each message another worker sends us
+    // through send().
+    static bool listen(message_handler fn);
+
+    // Hands 'msg' to the worker 'index'. Messages are dropped rather
+    // than blocking if it's falling behind.
+    static bool send(int index, const void* msg, size_t len);
+
+private:
+    static int _count, _index;
+
+    // The parent's pid, which fanout group ids are derived from.
+    static pid_t _parent;
+
+    static std::vector<pid_t> _pids;
+
+    // Write end of the pipe ready() and reloaded() notify the parent
+    // through, and the parent's read ends, one per worker.
+    static int _ready_fd;
+
+    static std::vector<int> _ready_fds;
+
+    // True if start() failed before every worker was up.
+    static bool _failed;
+
+    // Our end of the datagram socket the other workers send() to, and
+    // their ends, one per worker.
+    static int _inbox;
+
+    static std::vector<int> _outboxes;
+
+    static reactor::watch _inbox_watch;
+
+    static message_handler _message_fn;
+
+    static void handle_inbox(reactor::watch* w, uint32_t events);
+
+    static void stop_all(int sig);
+
+    // Writes a byte to _ready_fd.
+    static void notify_parent();
+
+    // Waits for the worker 'index' to write to its pipe. Returns false
+    // if it closed it instead, or didn't answer in time.
+    static bool wait_ready(int index, int timeout);
+
+    // Sends SIGHUP to each worker in turn.
+    static void reload_all();
+};
+
+NDPPD_NS_END